@@ -0,0 +1,389 @@
+/*
+  bench_xpath.c
+
+  Micro-benchmark for the XPath engine. Builds documents of a given
+  shape, runs a catalogue of expressions over them, and writes the
+  time per query, the nodes the engine tested and the memory it
+  allocated as JSON, so runs can be compared.
+
+  Usage: bench_xpath [depth fanout tags [mintime]]
+
+  With no arguments it runs a set of standard shapes.
+
+  The CMake build defines XPATH_STATS for this target, so the engine
+  counts node visits, and routes malloc() and friends through the
+  counting versions below.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "xmlparser2.h"
+#include "xpath.h"
+
+#define HEADERSIZE 16
+
+typedef struct
+{
+  int depth;     /* levels of elements below the root */
+  int fanout;    /* children of each element */
+  int Ntags;     /* number of different tags */
+} SHAPE;
+
+typedef struct
+{
+  char *str;
+  int N;
+  int capacity;
+} BUFFER;
+
+static const SHAPE shapes[] =
+{
+  {3, 40, 4},
+  {6, 6, 4},
+  {6, 6, 64},
+  {12, 2, 8},
+};
+
+/* the tags are t0, t1 and so on, and t0 and t1 are found at every level */
+static const char *catalogue[] =
+{
+  "/",
+  "/root",
+  "/root/t0/t1",
+  "/root/*/*",
+  "//t1",
+  "//t0//t1",
+  "//*",
+  "//t1/..",
+  "//t0/t1/..",
+  "//t0[t1]",
+  "//t0[@k='3']",
+  "//t1[2]",
+  "//@id",
+  "//t0/@k",
+  "/root/*/@id",
+  "//t0 | //t1",
+};
+
+static size_t bytesallocated = 0;
+static size_t Nallocations = 0;
+
+static void runshape(const SHAPE *shape, int indexed, double mintime, int first);
+static void runquery(XMLDOC *doc, const char *xpath, double mintime, int first);
+static char *makedocument(const SHAPE *shape);
+static int makeelement_r(BUFFER *buff, const SHAPE *shape, int depth, unsigned long *serial);
+static int append(BUFFER *buff, const char *fmt, ...);
+static void printjsonstring(const char *str);
+static double now(void);
+
+int main(int argc, char **argv)
+{
+  SHAPE shape;
+  double mintime = 0.2;
+  int first = 1;
+  int i;
+
+  if (argc != 1 && argc != 4 && argc != 5)
+  {
+    fprintf(stderr, "Usage: bench_xpath [depth fanout tags [mintime]]\n");
+    return EXIT_FAILURE;
+  }
+  if (argc == 5)
+    mintime = atof(argv[4]);
+
+  printf("{\n  \"runs\": [");
+  if (argc == 1)
+  {
+    for (i = 0; i < (int) (sizeof(shapes) / sizeof(shapes[0])); i++)
+    {
+      runshape(&shapes[i], 0, mintime, first);
+      runshape(&shapes[i], 1, mintime, 0);
+      first = 0;
+    }
+  }
+  else
+  {
+    shape.depth = atoi(argv[1]);
+    shape.fanout = atoi(argv[2]);
+    shape.Ntags = atoi(argv[3]);
+    if (shape.depth < 1 || shape.fanout < 1 || shape.Ntags < 2)
+    {
+      fprintf(stderr, "bad document shape\n");
+      return EXIT_FAILURE;
+    }
+    runshape(&shape, 0, mintime, 1);
+    runshape(&shape, 1, mintime, 0);
+  }
+  printf("\n  ]\n}\n");
+
+  return 0;
+}
+
+/*
+  Run the catalogue over a document of one shape, either plain or
+  with the tag index built first.
+*/
+static void runshape(const SHAPE *shape, int indexed, double mintime, int first)
+{
+  char error[1024];
+  char *text;
+  XMLDOC *doc;
+  int i;
+
+  text = makedocument(shape);
+  if (!text)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  doc = xmldocfromstring(text, error, 1024);
+  free(text);
+  if (!doc)
+  {
+    fprintf(stderr, "%s\n", error);
+    exit(EXIT_FAILURE);
+  }
+  if (indexed && xmldoc_buildtagindex(doc))
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%s\n    {\n", first ? "" : ",");
+  printf("      \"depth\": %d, \"fanout\": %d, \"tags\": %d, \"nodes\": %d, \"indexed\": %s,\n",
+         shape->depth, shape->fanout, shape->Ntags, xml_xpath_count(doc, "//*", error, 1024), indexed ? "true" : "false");
+  printf("      \"queries\": [");
+  for (i = 0; i < (int) (sizeof(catalogue) / sizeof(catalogue[0])); i++)
+    runquery(doc, catalogue[i], mintime, i == 0);
+  printf("\n      ]\n    }");
+
+  killxmldoc(doc);
+}
+
+/*
+  Time one expression, running it until mintime has passed. The
+  counts are averaged over the runs, so they are per query.
+*/
+static void runquery(XMLDOC *doc, const char *xpath, double mintime, int first)
+{
+  char error[1024];
+  XMLNODE **nodes;
+  XMLATTRIBUTE **attributes;
+  int attr;
+  int N = 0;
+  long iterations = 0;
+  unsigned long visited;
+  size_t bytes;
+  size_t allocations;
+  double start;
+  double elapsed;
+
+  attr = xml_xpath_selectsattributes(xpath, error, 1024);
+  xml_xpath_nodesvisited = 0;
+  bytesallocated = 0;
+  Nallocations = 0;
+  start = now();
+  do
+  {
+    if (attr)
+    {
+      attributes = xml_xpath_selectattributes_len(doc, xpath, &N, error, 1024);
+      if (!attributes)
+        break;
+      free(attributes);
+    }
+    else
+    {
+      nodes = xml_xpath_select(doc, xpath, &N, error, 1024);
+      if (!nodes)
+        break;
+      free(nodes);
+    }
+    iterations++;
+    elapsed = now() - start;
+  } while (elapsed < mintime);
+  visited = xml_xpath_nodesvisited;
+  bytes = bytesallocated;
+  allocations = Nallocations;
+
+  printf("%s\n        {\"xpath\": ", first ? "" : ",");
+  printjsonstring(xpath);
+  if (iterations == 0)
+  {
+    printf(", \"error\": ");
+    printjsonstring(error);
+    printf("}");
+    return;
+  }
+  printf(", \"selects\": \"%s\", \"selected\": %d, \"iterations\": %ld, ",
+         attr ? "attributes" : "nodes", N, iterations);
+  printf("\"ns_per_query\": %.1f, \"nodes_visited\": %.1f, \"bytes_allocated\": %.1f, \"allocations\": %.1f}",
+         elapsed * 1e9 / iterations, (double) visited / iterations,
+         (double) bytes / iterations, (double) allocations / iterations);
+}
+
+/*
+  Make a document of the given shape. Every element below the root
+  has an id, unique, and an attribute k with one of ten values. The
+  tags are spread so each appears at every level.
+*/
+static char *makedocument(const SHAPE *shape)
+{
+  BUFFER buff = {0};
+  unsigned long serial = 0;
+
+  if (append(&buff, "<root>"))
+    goto out_of_memory;
+  if (makeelement_r(&buff, shape, 0, &serial))
+    goto out_of_memory;
+  if (append(&buff, "</root>"))
+    goto out_of_memory;
+
+  return buff.str;
+
+out_of_memory:
+  free(buff.str);
+  return 0;
+}
+
+static int makeelement_r(BUFFER *buff, const SHAPE *shape, int depth, unsigned long *serial)
+{
+  unsigned long id;
+  int tag;
+  int i;
+
+  if (depth >= shape->depth)
+    return 0;
+  for (i = 0; i < shape->fanout; i++)
+  {
+    id = (*serial)++;
+    tag = (int) ((id * 2654435761UL) % shape->Ntags);
+    if (i < 2)
+      tag = (depth + i) % shape->Ntags;
+    if (append(buff, "<t%d id=\"n%lu\" k=\"%lu\">", tag, id, id % 10))
+      return -1;
+    if (makeelement_r(buff, shape, depth + 1, serial))
+      return -1;
+    if (append(buff, "</t%d>", tag))
+      return -1;
+  }
+
+  return 0;
+}
+
+static int append(BUFFER *buff, const char *fmt, ...)
+{
+  char temp[256];
+  char *newstr;
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vsnprintf(temp, sizeof(temp), fmt, args);
+  va_end(args);
+  if (buff->N + len + 1 > buff->capacity)
+  {
+    newstr = realloc(buff->str, buff->capacity * 2 + len + 1);
+    if (!newstr)
+      return -1;
+    buff->str = newstr;
+    buff->capacity = buff->capacity * 2 + len + 1;
+  }
+  memcpy(buff->str + buff->N, temp, len + 1);
+  buff->N += len;
+
+  return 0;
+}
+
+static void printjsonstring(const char *str)
+{
+  putchar('"');
+  for (; *str; str++)
+  {
+    if (*str == '"' || *str == '\\')
+      putchar('\\');
+    putchar(*str);
+  }
+  putchar('"');
+}
+
+static double now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+  Counting allocators. Each block carries its size in front, so
+  realloc() can count only the bytes it adds. Everything above, like
+  the library, calls these through the macros, so only they get the
+  real functions.
+*/
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+void *malloc(size_t size);
+void *realloc(void *ptr, size_t size);
+void free(void *ptr);
+
+void *bench_malloc(size_t size)
+{
+  char *block;
+
+  block = malloc(size + HEADERSIZE);
+  if (!block)
+    return 0;
+  *(size_t *) block = size;
+  bytesallocated += size;
+  Nallocations++;
+
+  return block + HEADERSIZE;
+}
+
+void *bench_calloc(size_t N, size_t size)
+{
+  char *ptr;
+
+  ptr = bench_malloc(N * size);
+  if (ptr)
+    memset(ptr, 0, N * size);
+
+  return ptr;
+}
+
+void *bench_realloc(void *ptr, size_t size)
+{
+  char *block;
+  size_t oldsize;
+
+  if (!ptr)
+    return bench_malloc(size);
+  block = (char *) ptr - HEADERSIZE;
+  oldsize = *(size_t *) block;
+  block = realloc(block, size + HEADERSIZE);
+  if (!block)
+    return 0;
+  *(size_t *) block = size;
+  if (size > oldsize)
+    bytesallocated += size - oldsize;
+  Nallocations++;
+
+  return block + HEADERSIZE;
+}
+
+void bench_free(void *ptr)
+{
+  if (ptr)
+    free((char *) ptr - HEADERSIZE);
+}
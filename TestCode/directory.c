@@ -225,7 +225,7 @@ FILE *file_fopen(XMLNODE *node)
     FILE *fp = 0;
     int len;
     const char *data;
-    char *last;
+    int last;
     int trailing = 0;
     unsigned char *plain = 0;
     int Nplain;
@@ -238,10 +238,12 @@ FILE *file_fopen(XMLNODE *node)
     if (!fp)
         goto error_exit;
     data = xml_getdata(node);
-    len = (int) strlen(data);
-    last = strrchr(data, '\n');
-    if (last && strwhitespace(last))
-        trailing = len - (int)(last - data);
+    len = xml_getdata_len(node);
+    for (last = len - 1; last >= 0; last--)
+        if (data[last] == '\n')
+            break;
+    if (last >= 0 && strwhitespace(data + last))
+        trailing = len - last;
     if (len - trailing < 1)
         goto error_exit;
     if (!strcmp(type, "text"))
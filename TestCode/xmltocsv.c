@@ -10,10 +10,10 @@
 #define TYPE_NUMBER 1
 #define TYPE_STRING 2
 
-static char *escapecsvstring(const char *str);
-static char *trim(const char *str);
+static char *escapecsvstring(const char *str, int len);
+static char *trim(const char *str, int len, int *Ntrimmed);
 static char *mystrdup(const char *str);
-static int mystrcount(const char *str, int ch);
+static int mystrcount(const char *str, int len, int ch);
 
 /*
   test if two nodes have the same structure. Do the attributes and the hierarchy
@@ -189,7 +189,7 @@ int nodetorecord_r(XMLNODE *node, int useattributes, int usechildren, int index,
       {
           if (i + index > 0)
               fprintf(fp, ", ");
-          escaped = escapecsvstring(attr->value);
+          escaped = escapecsvstring(attr->value, attr->valuelen);
          fprintf(fp, "%s", escaped);
           free(escaped);
          i++;
@@ -201,7 +201,7 @@ int nodetorecord_r(XMLNODE *node, int useattributes, int usechildren, int index,
       {
          if (i + index > 0)
              fprintf(fp, ", ");
-         escaped = escapecsvstring(child->data);
+         escaped = escapecsvstring(child->data, child->datalen);
          fprintf(fp, "%s", escaped);
          free(escaped);
          i++;
@@ -365,31 +365,37 @@ void printheader(FIELDS *fields, FILE *fp)
 /*
   escape a csv string so that it can go in a field.
    Params: str - the plain text
+           len - length of the text
    Returns: the escaped string.
    Note: most strings don't need to be escaped. Only ones with embedded commas or quotes.
+     CSV is text, so a field ends at a nul, if the data has one.
  */
-static char *escapecsvstring(const char *str)
+static char *escapecsvstring(const char *str, int len)
 {
-    int len;
     char *answer = 0;
     char *trimmed = 0;
+    char *nul;
+    int Ntrimmed;
     int i;
     int j = 0;
     
     if(!str)
         return mystrdup("");
     
-    trimmed = trim(str);
+    trimmed = trim(str, len, &Ntrimmed);
     if (!trimmed)
         goto out_of_memory;
-    if (strchr(trimmed, '\"') || strchr(trimmed, ','))
+    nul = memchr(trimmed, 0, Ntrimmed);
+    if (nul)
+        Ntrimmed = (int) (nul - trimmed);
+    if (memchr(trimmed, '\"', Ntrimmed) || memchr(trimmed, ',', Ntrimmed))
     {
-        len = strlen(trimmed) + mystrcount(trimmed, '\"') + 2 + 1;
+        len = Ntrimmed + mystrcount(trimmed, Ntrimmed, '\"') + 2 + 1;
         answer = malloc(len);
         if (!answer)
             goto out_of_memory;
         answer[j++] = '\"';
-        for (i = 0; trimmed[i]; i++)
+        for (i = 0; i < Ntrimmed; i++)
         {
             if (trimmed[i] == '\"')
             {
@@ -415,24 +421,28 @@ out_of_memory:
     return 0;
 }
 
-static char *trim(const char *str)
+/*
+   Trim leading and trailing whitespace.
+   Params: str - the string
+           len - the length of the string
+           Ntrimmed - return for length of the trimmed string
+   Returns: the trimmed string, malloced
+ */
+static char *trim(const char *str, int len, int *Ntrimmed)
 {
-    int i;
-    int j = 0;
-    char *answer = malloc(strlen(str) + 1);
+    int start = 0;
+    char *answer;
+    
+    while (start < len && isspace((unsigned char) str[start]))
+        start++;
+    while (len > start && isspace((unsigned char) str[len - 1]))
+        len--;
+    answer = malloc(len - start + 1);
     if (!answer)
         return 0;
-    for (i = 0; isspace((unsigned char) str[i]); i++)
-        ;
-    while (str[i])
-        answer[j++] = str[i++];
-    answer[j] = 0;
-    while (j--)
-    {
-        if (!isspace((unsigned char)answer[j]))
-            break;
-        answer[j] = 0;
-    }
+    memcpy(answer, str + start, len - start);
+    answer[len - start] = 0;
+    *Ntrimmed = len - start;
     
     return answer;
 }
@@ -445,12 +455,12 @@ static char *mystrdup(const char *str)
     return answer;
 }
 
-static int mystrcount(const char *str, int ch)
+static int mystrcount(const char *str, int len, int ch)
 {
     int answer = 0;
     int i;
     
-    for (i = 0; str[i]; i++)
+    for (i = 0; i < len; i++)
         if (str[i] == ch)
             answer++;
     
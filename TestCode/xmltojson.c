@@ -142,24 +142,26 @@ out_of_memory:
     return 0;
 }
 
-char *trim(const char *str)
+/*
+   Trim leading and trailing whitespace.
+   Params: str - the string
+           len - the length of the string (from xml_getdata_len())
+   Returns: the trimmed string, malloced
+ */
+char *trim(const char *str, int len)
 {
-    int i;
-    int j = 0;
-    char *answer = malloc(strlen(str) + 1);
+    int start = 0;
+    char *answer;
+    
+    while (start < len && isspace((unsigned char) str[start]))
+        start++;
+    while (len > start && isspace((unsigned char) str[len - 1]))
+        len--;
+    answer = malloc(len - start + 1);
     if (!answer)
         return 0;
-    for (i = 0; isspace((unsigned char) str[i]); i++)
-        ;
-    while (str[i])
-        answer[j++] = str[i++];
-    answer[j] = 0;
-    while (j--)
-    {
-        if (!isspace((unsigned char)answer[j]))
-            break;
-        answer[j] = 0;
-    }
+    memcpy(answer, str + start, len - start);
+    answer[len - start] = 0;
     
     return answer;
 }
@@ -258,7 +260,7 @@ int childrenallfields(XMLNODE *node, int useattributes)
     return 1;
 }
 
-void writefield(FILE *fp, const char *raw)
+void writefield(FILE *fp, const char *raw, int len)
 {
     int type;
     char *data = 0;
@@ -270,7 +272,7 @@ void writefield(FILE *fp, const char *raw)
         return;
     }
     
-    data = trim(raw);
+    data = trim(raw, len);
     if (!data)
         goto out_of_memory;
     type = getdatatype(data);
@@ -339,7 +341,7 @@ void xmltojson_r(FILE *fp, XMLNODE *node, int useattributes,  int depth, int wri
                     for (i = 0; i < depth + 1; i++)
                         fprintf(fp, "  ");
                     fprintf(fp, "@%s:", attr->name);
-                    writefield(fp, attr->value);
+                    writefield(fp, attr->value, attr->valuelen);
                     if (attr->next || is_field(node, useattributes) || node->child)
                         fprintf(fp, ",\n");
                     else
@@ -350,7 +352,7 @@ void xmltojson_r(FILE *fp, XMLNODE *node, int useattributes,  int depth, int wri
                     for (i = 0; i < depth + 1; i++)
                         fprintf(fp, "  ");
                     fprintf(fp, "%s:", xml_gettag(node));
-                    writefield(fp, xml_getdata(node));
+                    writefield(fp, xml_getdata(node), xml_getdata_len(node));
                     fprintf(fp, "\n");
                 }
             }
@@ -372,7 +374,7 @@ void xmltojson_r(FILE *fp, XMLNODE *node, int useattributes,  int depth, int wri
             }
             if (writetag)
                 fprintf(fp, "%s:", xml_gettag(node));
-            writefield(fp, xml_getdata(node));
+            writefield(fp, xml_getdata(node), xml_getdata_len(node));
         }
         if (node->next)
         {
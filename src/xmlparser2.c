@@ -8,24 +8,58 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <locale.h>
+#include <math.h>
 
 #define MAXRECURSIONLIMIT 100
+#define ATTRIBUTEHASHTHRESHOLD 16
+
+/*
+  Indexes and cached numbers are built on first use, perhaps by several
+  threads at once on a frozen document. Each thread builds its own, and
+  only the first to swap it in wins; the rest throw theirs away. Once
+  a pointer is set it never changes until the document is edited.
+  Other compilers get plain loads and stores, which are only safe from
+  one thread, so there xmldoc_freeze() refuses.
+*/
+#if defined(__GNUC__) || defined(__clang__)
+#define ATOMICPOINTERS 1
+#define LOADPOINTER(ptr) __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+#define PUBLISHPOINTER(ptr, expected, value) \
+  __atomic_compare_exchange_n(&(ptr), &(expected), (value), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+#define ATOMICPOINTERS 0
+#define LOADPOINTER(ptr) (ptr)
+#define PUBLISHPOINTER(ptr, expected, value) \
+  ((ptr) == (expected) ? ((ptr) = (value), 1) : ((expected) = (ptr), 0))
+#endif
 
 
 typedef struct xmlattribute
 {
   char *name;                /* attriibute name */
   char *value;               /* attribute value (without quotes) */
+  int valuelen;              /* length of the value */
+  struct xmlnumber *number;  /* cached numeric value, set on first typed read */
   struct xmlattribute *next; /* next pointer in linked list */
 } XMLATTRIBUTE;
 
 typedef struct xmlnode
 {
   char *tag;                 /* tag to identify data type */
+  int taglen;                /* length of the tag */
   XMLATTRIBUTE *attributes;  /* attributes */
+  struct xmlattributetable *attributetable; /* hash of attributes, if many */
   char *data;                /* data as ascii */
+  int datalen;               /* length of the data (which may contain nuls) */
+  struct xmlnumber *number;  /* cached numeric value, set on first typed read */
   int position;              /* position of the node within parent's data string */
   int lineno;                /* line number of node in document */
+  int preorder;              /* position of node in document order */
+  int subtreeend;            /* preorder number of last node in the subtree */
+  uint64_t tagfilter;        /* Bloom filter of the tags in the subtree */
+  struct xmlnode *parent;    /* parent node (0 for the root) */
   struct xmlnode *next;      /* sibling node */
   struct xmlnode *child;     /* first child node */
 } XMLNODE;
@@ -33,8 +67,26 @@ typedef struct xmlnode
 typedef struct
 {
   XMLNODE *root;             /* the root node */
+  int Nnodes;                /* number of nodes in the document */
+  struct xmltagindex *tagindex; /* tag postings, built on demand */
+  struct xmlattributeindex *attributeindex; /* attribute value postings, built on demand */
+  struct xmltextindex *textindex; /* full-text postings, built on demand */
+  int *positions;            /* positions among same-tag siblings, built on demand */
+  char *idattribute;         /* attribute holding element ids, 0 for "id" */
+  unsigned int *marks;       /* scratch marks for queries, indexed by preorder */
+  unsigned int markgeneration; /* current value of a set mark */
+  unsigned int generation;   /* bumped by xmldoc_changed() */
+  struct xmlresultcache *resultcache; /* cached query results, if enabled */
+  int frozen;                /* set by xmldoc_freeze(), no more changes */
 } XMLDOC;
 
+typedef struct
+{
+  void (*opennode)(XMLNODE *node, void *ptr); /* element start, attributes read */
+  int (*closenode)(XMLNODE *node, void *ptr); /* element complete, non-zero to keep */
+  void *ptr;                 /* passed back to the callbacks */
+} XMLHANDLER;
+
 struct strbuff
 {
     const char *str;
@@ -55,6 +107,102 @@ typedef struct
   int N;
 } STRING;
 
+typedef struct
+{
+  const char *tag;           /* the tag (owned by the first node with it) */
+  XMLNODE **nodes;           /* nodes with this tag, in document order */
+  int N;                     /* number of nodes with this tag */
+} TAGPOSTINGS;
+
+typedef struct
+{
+  XMLNODE *node;             /* node with the token in its data or an attribute */
+  XMLATTRIBUTE *attr;        /* the attribute, 0 for the node's data */
+} TEXTPOSTING;
+
+typedef struct
+{
+  const char *token;         /* the token, in the document's text (not nul-terminated) */
+  int len;                   /* length of the token */
+  TEXTPOSTING *postings;     /* where it occurs, in document order */
+  int N;                     /* number of postings */
+} TEXTTOKEN;
+
+typedef struct
+{
+  const char *token;         /* a token in a node's data or attribute */
+  int len;                   /* length of the token */
+  int field;                 /* number of the data or attribute, in document order */
+  XMLNODE *node;             /* the node */
+  XMLATTRIBUTE *attr;        /* the attribute, 0 for the node's data */
+} TEXTOCCURRENCE;
+
+typedef struct
+{
+  unsigned int key;          /* hash of the attribute name */
+  XMLATTRIBUTE *attr;        /* the attribute, 0 for an empty slot */
+} ATTRIBUTESLOT;
+
+#define XML_TEXT_CONTAINS 1
+#define XML_TEXT_STARTSWITH 2
+#define XML_TEXT_EQUALS 3
+
+#define NUMBER_INT64 1
+#define NUMBER_DOUBLE 2
+#define NUMBER_BOOL 4
+
+typedef struct xmlnumber
+{
+  int flags;                 /* which of the values below are valid */
+  int64_t ivalue;            /* value as an integer */
+  double dvalue;             /* value as a double */
+  int bvalue;                /* value as a boolean */
+} XMLNUMBER;
+
+typedef struct xmlattributetable
+{
+  int capacity;              /* number of slots, a power of two */
+  ATTRIBUTESLOT *slots;      /* open-addressed hash table */
+} XMLATTRIBUTETABLE;
+
+typedef struct xmltagindex
+{
+  XMLNODE **order;           /* every node, in document order */
+  int Nnodes;                /* number of nodes in the document */
+  TAGPOSTINGS *table;        /* open-addressed hash table of tags */
+  int capacity;              /* size of table, a power of two */
+  int Ntags;                 /* number of distinct tags */
+  XMLNODE **pool;            /* storage for all the postings lists */
+} XMLTAGINDEX;
+
+typedef struct xmlattributeindex
+{
+  char *name;                /* the attribute indexed */
+  XMLTAGINDEX *values;       /* nodes with the attribute, keyed by value */
+  struct xmlattributeindex *next; /* next index in the list */
+} XMLATTRIBUTEINDEX;
+
+typedef struct
+{
+  unsigned long key;         /* the query's key, 0 for an empty entry */
+  unsigned int generation;   /* document generation the result is for */
+  void **items;              /* the result, nul-terminated */
+  int N;                     /* number of items */
+} CACHEENTRY;
+
+typedef struct xmlresultcache
+{
+  CACHEENTRY *entries;       /* entries, one place for each key */
+  int capacity;              /* number of entries, a power of two */
+} XMLRESULTCACHE;
+
+typedef struct xmltextindex
+{
+  TEXTTOKEN *tokens;         /* distinct tokens, sorted by their bytes */
+  int Ntokens;               /* number of distinct tokens */
+  TEXTPOSTING *pool;         /* storage for all the postings lists */
+} XMLTEXTINDEX;
+
 typedef struct
 {
   int set;
@@ -72,6 +220,8 @@ typedef struct lexer
   int lineno;
   int columnno;
   int badmatch;
+  int Nnodes;
+  XMLHANDLER *handler;
   ERROR *err;
 } LEXER;
 
@@ -98,25 +248,65 @@ static int bbx_utf8_putch(char *out, int ch);
 static int stringaccess(void *ptr);
 
 void killxmlnode(XMLNODE *node);
+unsigned int xml_attributekey(const char *attr);
+uint64_t xml_tagfilterbits(const char *tag);
+const char *xml_getattributebykey(XMLNODE *node, const char *attr, unsigned int key);
 static void killxmlattribute(XMLATTRIBUTE *attr);
 
+static XMLATTRIBUTE *findattribute(XMLNODE *node, const char *attr, unsigned int key);
+static XMLNUMBER *getnumber(XMLNUMBER **cache, const char *str, int len, XMLNUMBER *temp);
+static void parsenumber(const char *str, int len, XMLNUMBER *number);
+static int parseint64(const char *str, int len, int64_t *value);
+static int parsedouble(const char *str, int len, double *value);
+static int parsebool(const char *str, int len, int *value);
+static XMLATTRIBUTETABLE *buildattributetable(XMLATTRIBUTE *attributes);
+static XMLTAGINDEX *buildtagindex(XMLNODE *root);
+static void killtagindex(XMLTAGINDEX *index);
+static int addpostings(XMLTAGINDEX *index, const char **keys);
+static XMLATTRIBUTEINDEX *buildattributeindex(XMLNODE *root, const char *attr);
+static void killattributeindex(XMLATTRIBUTEINDEX *index);
+static XMLATTRIBUTEINDEX *getattributeindex(XMLDOC *doc, const char *attr);
+static TAGPOSTINGS *tagindex_get(XMLTAGINDEX *index, const char *tag);
+static XMLTEXTINDEX *buildtextindex(XMLNODE *root);
+static void killtextindex(XMLTEXTINDEX *index);
+static int textcandidates(XMLTEXTINDEX *index, XMLNODE *node, const char *text, int len, int how, TEXTPOSTING **out);
+static int scancandidates(XMLNODE *node, const char *attr, TEXTPOSTING **out);
+static int textmatches(const char *str, int len, const char *text, int textlen, int how);
+static TEXTOCCURRENCE *addoccurrences(TEXTOCCURRENCE *out, XMLNODE *node, XMLATTRIBUTE *attr, int field);
+static int counttokens(const char *str, int len);
+static int istokenchar(int ch);
+static int findtoken(XMLTEXTINDEX *index, const char *token, int len);
+static int postingslowerbound(TEXTTOKEN *token, int preorder);
+static int comparetokens(const char *a, int alen, const char *b, int blen);
+static int compareoccurrences(const void *e1, const void *e2);
+static int comparepostings(const void *e1, const void *e2);
+static int lowerbound(XMLNODE **nodes, int N, int preorder);
+static int *buildpositions(XMLTAGINDEX *index, int Nnodes);
+static void killresultcache(XMLRESULTCACHE *cache);
+static CACHEENTRY *cacheentry(XMLRESULTCACHE *cache, unsigned long key);
+static int renumber_r(XMLNODE *node, XMLNODE *parent, int preorder);
+static unsigned int strhash(const char *str);
+
 static int is_initidentifier(int ch);
 static int is_elementnamech(int ch);
 static int is_attributenamech(int ch);
 
 static int string_init(STRING *s);
 static void string_push(STRING *s, int ch, ERROR *err);
-static void string_concat(STRING *s, const char *str, ERROR *err);
+static void string_concat(STRING *s, const char *str, int len, ERROR *err);
 static char *string_release(STRING *s);
 
 static XMLDOC *xmldocument(LEXER *lex, ERROR *err);
-static XMLNODE *xmlnode(LEXER *lex, ERROR *err);
+static XMLDOC *floadxml(FILE *fp, XMLHANDLER *handler, char *errormessage, int Nerr);
+static XMLDOC *xmlfromstring(const char *str, XMLHANDLER *handler, char *errormessage, int Nerr);
+static XMLNODE *xmlnode(LEXER *lex, XMLNODE *parent, ERROR *err);
+static int closenode(LEXER *lex, XMLNODE *node);
 static XMLNODE *comment(LEXER *lex, ERROR *err);
 static XMLATTRIBUTE *attributelist(LEXER *lex, ERROR *err);
 static XMLATTRIBUTE *xmlattribute(LEXER *lex, ERROR *err);
-static char *quotedstring(LEXER *lex, ERROR *err);
-static char *textspan(LEXER *lex, ERROR *err);
-static char *cdata(LEXER *lex, ERROR *err);
+static char *quotedstring(LEXER *lex, int *len, ERROR *err);
+static char *textspan(LEXER *lex, int *len, ERROR *err);
+static char *cdata(LEXER *lex, int *len, ERROR *err);
 static char *processinginstruction(LEXER *lex, ERROR *err);
 static char *attributename(LEXER *lex, ERROR *err);
 static char *elementname(LEXER *lex, ERROR *err);
@@ -193,6 +383,11 @@ XMLDOC *loadxmldoc(const char *filename,char *errormessage, int Nerr)
 }
 
 XMLDOC *floadxmldoc(FILE *fp, char *errormessage, int Nerr)
+{
+    return floadxml(fp, 0, errormessage, Nerr);
+}
+
+static XMLDOC *floadxml(FILE *fp, XMLHANDLER *handler, char *errormessage, int Nerr)
 {
     ERROR error;
     LEXER lexer;
@@ -226,6 +421,7 @@ XMLDOC *floadxmldoc(FILE *fp, char *errormessage, int Nerr)
          return 0;
      }
 
+    lexer.handler = handler;
     answer = xmldocument(&lexer, &error);
     if (error.set)
     {
@@ -432,6 +628,11 @@ static int bbx_utf8_putch(char *out, int ch)
 
 
 XMLDOC *xmldocfromstring(const char *str,char *errormessage, int Nerr)
+{
+    return xmlfromstring(str, 0, errormessage, Nerr);
+}
+
+static XMLDOC *xmlfromstring(const char *str, XMLHANDLER *handler, char *errormessage, int Nerr)
 {
    ERROR error;
    LEXER lexer;
@@ -455,6 +656,7 @@ XMLDOC *xmldocfromstring(const char *str,char *errormessage, int Nerr)
         return 0;
     }
     initlexer(&lexer, &error, stringaccess, &strbuf);
+    lexer.handler = handler;
     answer = xmldocument(&lexer, &error);
     if (error.set)
     {
@@ -481,10 +683,61 @@ void killxmldoc(XMLDOC *doc)
   if(doc)
   {
       killxmlnode(doc->root);
+      killtagindex(doc->tagindex);
+      killattributeindex(doc->attributeindex);
+      killtextindex(doc->textindex);
+      free(doc->positions);
+      free(doc->idattribute);
+      free(doc->marks);
+      killresultcache(doc->resultcache);
       free(doc);
   }
 }
 
+/*
+  Parse a document from a stream, passing nodes to a handler as they are read.
+  Params: fp - the stream
+          handler - callbacks for element open and close
+          errormessage - return for error message
+          Nerr - size of error buffer
+  Returns: 0 on success, -1 on error
+  Notes: opennode is called once the tag and attributes have been read,
+    with the parent link set but no children. closenode is called when the
+    element is complete. Unless it returns non-zero the subtree is freed
+    immediately, so memory use is bounded by the depth of the document plus
+    whatever the handler keeps. A kept node is freed with its parent, unless
+    that is kept too, and the root is always freed at the end of the parse.
+ */
+int fstreamxmldoc(FILE *fp, XMLHANDLER *handler, char *errormessage, int Nerr)
+{
+    XMLDOC *doc;
+
+    doc = floadxml(fp, handler, errormessage, Nerr);
+    if (!doc)
+        return -1;
+    killxmldoc(doc);
+    return 0;
+}
+
+/*
+  Parse a document from a string, passing nodes to a handler as they are read.
+  Params: str - the string
+          handler - callbacks for element open and close
+          errormessage - return for error message
+          Nerr - size of error buffer
+  Returns: 0 on success, -1 on error
+ */
+int streamxmldocfromstring(const char *str, XMLHANDLER *handler, char *errormessage, int Nerr)
+{
+    XMLDOC *doc;
+
+    doc = xmlfromstring(str, handler, errormessage, Nerr);
+    if (!doc)
+        return -1;
+    killxmldoc(doc);
+    return 0;
+}
+
 /*
   get the root node of the document
 */
@@ -509,16 +762,243 @@ const char *xml_getdata(XMLNODE *node)
     return node->data;
 }
 
+/*
+  get the length of a node's tag
+*/
+int xml_gettag_len(XMLNODE *node)
+{
+    return node->taglen;
+}
+
+/*
+  get the length of a node's data
+  Notes: the data may contain embedded nuls, so use this rather than
+    strlen() if you need the whole of it. 0 if the node has no data.
+*/
+int xml_getdata_len(XMLNODE *node)
+{
+    return node->datalen;
+}
+
 /*
   get a node's attributes
 */
 const char *xml_getattribute(XMLNODE *node, const char *attr)
 {
+  XMLATTRIBUTE *found;
+
+  found = findattribute(node, attr, node->attributetable ? xml_attributekey(attr) : 0);
+  return found ? found->value : 0;
+}
+
+/*
+  get a node's attribute, and the length of its value
+  Params: node - the node
+          attr - the attribute name
+          len - return for the length of the value (0 if not present)
+  Returns: the attribute value, 0 if not present
+*/
+const char *xml_getattribute_len(XMLNODE *node, const char *attr, int *len)
+{
+  XMLATTRIBUTE *found;
+
+  found = findattribute(node, attr, node->attributetable ? xml_attributekey(attr) : 0);
+  *len = found ? found->valuelen : 0;
+  return found ? found->value : 0;
+}
+
+/*
+  get the lookup key for an attribute name
+  Notes: compute once for a name you will query over and over,
+    and pass to xml_getattributebykey().
+*/
+unsigned int xml_attributekey(const char *attr)
+{
+  return strhash(attr);
+}
+
+/*
+  get the bits a tag sets in the tag filters
+  Params: tag - the tag
+  Returns: the bits, which all appear in the tagfilter of every node
+    with the tag and of all its ancestors
+  Notes: the tagfilter of a node is a small Bloom filter, made at load
+    time, of the tags in its subtree. If a node's filter lacks any of
+    a tag's bits, nothing in the subtree has the tag, so a search for
+    it can skip the lot. A filter with all the bits only says that the
+    tag may be there.
+*/
+uint64_t xml_tagfilterbits(const char *tag)
+{
+  unsigned int hash = strhash(tag);
+
+  return ((uint64_t) 1 << (hash & 63)) | ((uint64_t) 1 << ((hash >> 6) & 63));
+}
+
+/*
+  can a subtree contain a tag?
+  Params: node - root of the subtree
+          bits - bits for the tag, from xml_tagfilterbits(), 0 for any tag
+  Returns: 0 if no node in the subtree has the tag, 1 if one may
+*/
+int xml_maycontaintag(XMLNODE *node, uint64_t bits)
+{
+  return (node->tagfilter & bits) == bits;
+}
+
+/*
+  get a node's attribute, using a precomputed key
+  Params: node - the node
+          attr - the attribute name
+          key - key for the name, from xml_attributekey()
+  Returns: the attribute value, 0 if not present
+  Notes: nodes with lots of attributes are given a hash table
+    when parsed, so the lookup doesn't have to walk the list.
+*/
+const char *xml_getattributebykey(XMLNODE *node, const char *attr, unsigned int key)
+{
+  XMLATTRIBUTE *found;
+
+  found = findattribute(node, attr, key);
+  return found ? found->value : 0;
+}
+
+/*
+  get a node's attribute itself, using a precomputed key
+  Params: node - the node
+          attr - the attribute name
+          key - key for the name, from xml_attributekey()
+  Returns: the attribute, 0 if not present
+*/
+XMLATTRIBUTE *xml_getattributenode(XMLNODE *node, const char *attr, unsigned int key)
+{
+  return findattribute(node, attr, key);
+}
+
+/*
+  get an attribute as a 64 bit integer
+  Params: node - the node
+          attr - the attribute name
+          value - return for the value (untouched on fail)
+  Returns: 1 on success, 0 if the attribute is missing or not an integer
+  Notes: the conversion doesn't depend on the locale, and the result
+    is cached on the attribute, so repeated reads are cheap.
+*/
+int xml_getattribute_int64(XMLNODE *node, const char *attr, int64_t *value)
+{
+  XMLATTRIBUTE *found;
+  XMLNUMBER temp;
+  XMLNUMBER *number;
+
+  found = findattribute(node, attr, node->attributetable ? xml_attributekey(attr) : 0);
+  if (!found)
+    return 0;
+  number = getnumber(&found->number, found->value, found->valuelen, &temp);
+  if (!(number->flags & NUMBER_INT64))
+    return 0;
+  *value = number->ivalue;
+
+  return 1;
+}
+
+/*
+  get an attribute as a double
+  Params: node - the node
+          attr - the attribute name
+          value - return for the value (untouched on fail)
+  Returns: 1 on success, 0 if the attribute is missing or not a number
+  Notes: leading and trailing whitespace is allowed, as are INF, -INF
+    and NaN. Cached like xml_getattribute_int64().
+*/
+int xml_getattribute_double(XMLNODE *node, const char *attr, double *value)
+{
+  XMLATTRIBUTE *found;
+  XMLNUMBER temp;
+  XMLNUMBER *number;
+
+  found = findattribute(node, attr, node->attributetable ? xml_attributekey(attr) : 0);
+  if (!found)
+    return 0;
+  number = getnumber(&found->number, found->value, found->valuelen, &temp);
+  if (!(number->flags & NUMBER_DOUBLE))
+    return 0;
+  *value = number->dvalue;
+
+  return 1;
+}
+
+/*
+  get an attribute as a boolean
+  Params: node - the node
+          attr - the attribute name
+          value - return for the value, 1 or 0 (untouched on fail)
+  Returns: 1 on success, 0 if the attribute is missing or not a boolean
+  Notes: accepts "true", "false", "1" and "0", as XML Schema does.
+*/
+int xml_getattribute_bool(XMLNODE *node, const char *attr, int *value)
+{
+  XMLATTRIBUTE *found;
+  XMLNUMBER temp;
+  XMLNUMBER *number;
+
+  found = findattribute(node, attr, node->attributetable ? xml_attributekey(attr) : 0);
+  if (!found)
+    return 0;
+  number = getnumber(&found->number, found->value, found->valuelen, &temp);
+  if (!(number->flags & NUMBER_BOOL))
+    return 0;
+  *value = number->bvalue;
+
+  return 1;
+}
+
+/*
+  get a node's data as a double
+  Params: node - the node
+          value - return for the value (untouched on fail)
+  Returns: 1 on success, 0 if the data is not a number
+  Notes: as xml_getattribute_double().
+*/
+int xml_getdata_double(XMLNODE *node, double *value)
+{
+  XMLNUMBER temp;
+  XMLNUMBER *number;
+
+  if (!node->data)
+    return 0;
+  number = getnumber(&node->number, node->data, node->datalen, &temp);
+  if (!(number->flags & NUMBER_DOUBLE))
+    return 0;
+  *value = number->dvalue;
+
+  return 1;
+}
+
+/*
+  find an attribute, in the hash table if the node has one
+    (key is only used for the table)
+*/
+static XMLATTRIBUTE *findattribute(XMLNODE *node, const char *attr, unsigned int key)
+{
+  XMLATTRIBUTETABLE *table = node->attributetable;
   XMLATTRIBUTE *next;
+  unsigned int i;
+
+  if (table)
+  {
+    i = key & (table->capacity - 1);
+    while (table->slots[i].attr)
+    {
+      if (table->slots[i].key == key && !strcmp(table->slots[i].attr->name, attr))
+        return table->slots[i].attr;
+      i = (i + 1) & (table->capacity - 1);
+    }
+    return 0;
+  }
 
   for(next = node->attributes; next; next = next->next)
     if(!strcmp(next->name, attr))
-        return next->value;
+        return next;
 
   return 0;
 }
@@ -606,15 +1086,18 @@ XMLNODE *xml_getchild(XMLNODE *node, const char *tag, int index)
   recursive get descendants
   Params; node the the node
           tag - tag to retrieve
+          bits - the tag's filter bits, 0 for all tags
           list = pointer to return list of pointers to matchign nodes
           N - return for number of nodes found, also index of current place to write
+          capacity - return for allocated size of list
   Returns: 0 on success -1 on out of memory
   Notes:
-    we are descending the tree, allocating space for a pointer for every
-    matching node.
+    we are descending the tree, growing the list geometrically
+    as matching nodes are found. Subtrees whose tag filter rules
+    the tag out are skipped.
 
 */
-static int getdescendants_r(XMLNODE *node, const char *tag,  XMLNODE ***list, int *N)
+static int getdescendants_r(XMLNODE *node, const char *tag, uint64_t bits, XMLNODE ***list, int *N, int *capacity)
 {
   XMLNODE **temp;
   XMLNODE *next;
@@ -623,18 +1106,27 @@ static int getdescendants_r(XMLNODE *node, const char *tag,  XMLNODE ***list, in
   next = node;
   while(next)
   {
+    if ((next->tagfilter & bits) != bits)
+    {
+      next = next->next;
+      continue;
+    }
     if(tag == 0 || (next->tag && !strcmp(next->tag, tag)))
     {
-      temp = realloc(*list, (*N +1) * sizeof(XMLNODE *));
-      if(!temp)
-        return -1;
-      *list = temp;
+      if (*N >= *capacity)
+      {
+        temp = realloc(*list, (*capacity * 2 + 16) * sizeof(XMLNODE *));
+        if(!temp)
+          return -1;
+        *list = temp;
+        *capacity = *capacity * 2 + 16;
+      }
       (*list)[*N] = next;
       (*N)++;
     }
     if(next->child)
     {
-      err = getdescendants_r(next->child, tag, list, N);
+      err = getdescendants_r(next->child, tag, bits, list, N, capacity);
       if(err)
         return err;
     }
@@ -655,72 +1147,749 @@ static int getdescendants_r(XMLNODE *node, const char *tag,  XMLNODE ***list, in
      some child element. You also don't know if several of them are
      in the file. Just call to extract a list, then query for
      children so you know that the tag is an actual match.
-     Don't call for huge lists as inefficient.
+     Don't call for huge lists as inefficient. If you need to
+     fish for many tags, use xmldoc_getdescendants() instead.
 */
 XMLNODE **xml_getdescendants(XMLNODE *node, const char *tag, int *N)
 {
   XMLNODE **answer = 0;
+  int capacity = 0;
   int err;
 
   *N = 0;
-  err = getdescendants_r(node, tag, &answer, N);
+  err = getdescendants_r(node, tag, tag ? xml_tagfilterbits(tag) : 0, &answer, N, &capacity);
   if(err)
   {
     free(answer);
+    *N = 0;
     return 0;
   }
 
   return answer;
 }
 
-static void getnestedata_r(XMLNODE *node, STRING *str, ERROR *err)
+/*
+  build the tag index of a document
+  Params: doc - the document
+  Returns: 0 on success, -1 on out of memory
+  Notes: makes a list of the nodes with each tag, in document order. xmldoc_getdescendants() builds the
+    index on first use, but you can call this after loading to pay
+    the cost up front.
+*/
+int xmldoc_buildtagindex(XMLDOC *doc)
 {
-    XMLNODE *child;
-    int i = 0;
-    
-    for (child = node->child; child; child = child->next)
+  XMLTAGINDEX *index;
+  XMLTAGINDEX *expected = 0;
+
+  if (LOADPOINTER(doc->tagindex))
+    return 0;
+  index = buildtagindex(doc->root);
+  if (!index)
+    return -1;
+  if (!PUBLISHPOINTER(doc->tagindex, expected, index))
+    killtagindex(index);
+
+  return 0;
+}
+
+/*
+  build an index of the values of an attribute
+  Params: doc - the document
+          attr - the attribute name
+  Returns: 0 on success, -1 on out of memory
+  Notes: makes a list of the nodes with each value of the attribute, in
+    document order. xmldoc_getnodesbyattribute() builds the index on
+    first use, and the XPath engine uses it for [@attr='value']
+    predicates.
+*/
+int xmldoc_buildattributeindex(XMLDOC *doc, const char *attr)
+{
+  XMLATTRIBUTEINDEX *index;
+  XMLATTRIBUTEINDEX *head;
+  XMLATTRIBUTEINDEX *other;
+
+  if (getattributeindex(doc, attr))
+    return 0;
+  index = buildattributeindex(doc->root, attr);
+  if (!index)
+    return -1;
+  head = LOADPOINTER(doc->attributeindex);
+  index->next = head;
+  while (!PUBLISHPOINTER(doc->attributeindex, head, index))
+  {
+    for (other = head; other != index->next; other = other->next)
     {
-        while (node->data && i < child->position && node->data[i])
-            string_push(str, node->data[i++], err);
-        getnestedata_r(child, str, err);
+      if (!strcmp(other->name, attr))
+      {
+        index->next = 0;
+        killattributeindex(index);
+        return 0;
+      }
     }
-    while (node->data && node->data[i])
-        string_push(str, node->data[i++], err);
-    
+    index->next = head;
+  }
+
+  return 0;
 }
 
-char *xml_getnesteddata(XMLNODE *node)
+/*
+  get all nodes with an attribute of a given value, using the attribute index
+   Params: doc - the document
+           node - root of the subtree to search (must be from doc)
+           attr - the attribute name
+           value - the value to look for
+           N - return for number found, -1 on out of memory
+   Returns: list of matching nodes in document order, 0 if there
+     are none or on out of memory.
+   Notes: like xmldoc_getdescendants(), the subtree is the node and its
+     descendants.
+*/
+XMLNODE **xmldoc_getnodesbyattribute(XMLDOC *doc, XMLNODE *node, const char *attr, const char *value, int *N)
 {
-    ERROR error;
-    STRING str;
-    initerror(&error);
-    string_init(&str);
-    getnestedata_r(node, &str, &error);
-    return string_release(&str);
+  XMLATTRIBUTEINDEX *index;
+  TAGPOSTINGS *postings;
+  XMLNODE **answer;
+  int start;
+  int end;
+
+  *N = 0;
+  if (xmldoc_buildattributeindex(doc, attr))
+  {
+    *N = -1;
+    return 0;
+  }
+  index = getattributeindex(doc, attr);
+
+  postings = tagindex_get(index->values, value);
+  if (!postings)
+    return 0;
+
+  start = lowerbound(postings->nodes, postings->N, node->preorder);
+  end = lowerbound(postings->nodes, postings->N, node->subtreeend + 1);
+  if (start == end)
+    return 0;
+
+  answer = malloc((end - start) * sizeof(XMLNODE *));
+  if (!answer)
+  {
+    *N = -1;
+    return 0;
+  }
+  memcpy(answer, postings->nodes + start, (end - start) * sizeof(XMLNODE *));
+  *N = end - start;
+
+  return answer;
 }
 
 /*
-    get a node's line number.
-    (note this one is null-guarded because it is meant to be called in error conditions)
- */
-int xml_getlineno(XMLNODE *node)
+  get all nodes which have an attribute, using the attribute index
+   Params: doc - the document
+           node - root of the subtree to search (must be from doc)
+           attr - the attribute name
+           N - return for number found, -1 on out of memory
+   Returns: list of nodes with the attribute in document order, 0 if
+     there are none or on out of memory.
+*/
+XMLNODE **xmldoc_getnodeswithattribute(XMLDOC *doc, XMLNODE *node, const char *attr, int *N)
 {
-    if (node)
-        return node->lineno;
-    return -1;
+  XMLTAGINDEX *values;
+  XMLNODE **answer;
+  int start;
+  int end;
+
+  *N = 0;
+  if (xmldoc_buildattributeindex(doc, attr))
+  {
+    *N = -1;
+    return 0;
+  }
+  values = getattributeindex(doc, attr)->values;
+
+  start = lowerbound(values->order, values->Nnodes, node->preorder);
+  end = lowerbound(values->order, values->Nnodes, node->subtreeend + 1);
+  if (start == end)
+    return 0;
+
+  answer = malloc((end - start) * sizeof(XMLNODE *));
+  if (!answer)
+  {
+    *N = -1;
+    return 0;
+  }
+  memcpy(answer, values->order + start, (end - start) * sizeof(XMLNODE *));
+  *N = end - start;
+
+  return answer;
 }
+
 /*
-  Report any attributes which are not on a list of knowwn attributes
- 
-  Params: node the node to test
-        ... NULL-terminated list of known node names.
-   Returns: a list of unrecognised attribures as a deep copy, 0 if
-       there are none.
-    Notes:
-       Call as
-       XMLATTRIBUTE *badattr =  0;
-       char *end = 0;
- 
+  count the nodes which have an attribute, from the attribute index
+   Params: doc - the document
+           attr - the attribute name
+   Returns: the number of nodes with the attribute, -1 if the attribute
+     has no index.
+   Notes: like xmldoc_tagcount(), this doesn't build the index.
+*/
+int xmldoc_attributecount(XMLDOC *doc, const char *attr)
+{
+  XMLATTRIBUTEINDEX *index;
+
+  index = getattributeindex(doc, attr);
+  return index ? index->values->Nnodes : -1;
+}
+
+/*
+  get the node with a key attribute of a given value, using the attribute index
+   Params: doc - the document
+           attr - the key attribute
+           value - the value to look for
+   Returns: the first node in document order with the value, 0 if
+     there is none or on out of memory.
+   Notes: the index is built on first use, and after that each call
+     is a hash lookup with nothing allocated, so it is the way to
+     resolve references by id or name over and over. Call
+     xmldoc_buildattributeindex() first to tell out of memory apart,
+     then 0 only means there is no such node.
+*/
+XMLNODE *xmldoc_getnodebykey(XMLDOC *doc, const char *attr, const char *value)
+{
+  TAGPOSTINGS *postings;
+
+  if (xmldoc_buildattributeindex(doc, attr))
+    return 0;
+  postings = tagindex_get(getattributeindex(doc, attr)->values, value);
+
+  return postings ? postings->nodes[0] : 0;
+}
+
+/*
+  set the attribute which holds element ids
+   Params: doc - the document
+           attr - the attribute name
+   Returns: 0 on success, -1 on out of memory or if the document is frozen
+   Notes: the default is "id". The attribute is used by xmldoc_getnodebyid()
+     and by the XPath id() function, and its index is built straight
+     away.
+*/
+int xmldoc_setidattribute(XMLDOC *doc, const char *attr)
+{
+  char *copy;
+
+  if (doc->frozen)
+    return -1;
+  copy = malloc(strlen(attr) + 1);
+  if (!copy)
+    return -1;
+  strcpy(copy, attr);
+  free(doc->idattribute);
+  doc->idattribute = copy;
+
+  return xmldoc_buildattributeindex(doc, attr);
+}
+
+/*
+  get the element with an id
+   Params: doc - the document
+           id - the id
+   Returns: the element, 0 if there is none or on out of memory.
+   Notes: if several elements have the id, the first one is returned.
+*/
+XMLNODE *xmldoc_getnodebyid(XMLDOC *doc, const char *id)
+{
+  return xmldoc_getnodebykey(doc, doc->idattribute ? doc->idattribute : "id", id);
+}
+
+/*
+  turn on the result cache
+   Params: doc - the document
+           capacity - number of results to keep, 0 to turn the cache off
+   Returns: 0 on success, -1 on out of memory or if the document is frozen
+   Notes: the XPath engine keeps the results of compiled queries here,
+     and hands back copies while the document is unchanged. Each key
+     has one place in the cache, so two queries can push each other
+     out, but looking a result up is a single probe.
+*/
+int xmldoc_enableresultcache(XMLDOC *doc, int capacity)
+{
+  XMLRESULTCACHE *cache = 0;
+  int size = 1;
+  int i;
+
+  if (doc->frozen)
+    return -1;
+  if (capacity > 0)
+  {
+    while (size < capacity)
+      size *= 2;
+    cache = malloc(sizeof(XMLRESULTCACHE));
+    if (!cache)
+      return -1;
+    cache->entries = malloc(size * sizeof(CACHEENTRY));
+    if (!cache->entries)
+    {
+      free(cache);
+      return -1;
+    }
+    cache->capacity = size;
+    for (i = 0; i < size; i++)
+    {
+      cache->entries[i].key = 0;
+      cache->entries[i].generation = 0;
+      cache->entries[i].items = 0;
+      cache->entries[i].N = 0;
+    }
+  }
+  killresultcache(doc->resultcache);
+  doc->resultcache = cache;
+
+  return 0;
+}
+
+/*
+  get a result from the cache
+   Params: doc - the document
+           key - the key it was stored under
+           N - return for the number of items
+   Returns: a copy of the result, nul-terminated, 0 if there is no
+     result for the key from this generation of the document, or on
+     out of memory.
+*/
+void **xmldoc_getcachedresult(XMLDOC *doc, unsigned long key, int *N)
+{
+  CACHEENTRY *entry;
+  void **answer;
+
+  *N = 0;
+  if (!doc->resultcache)
+    return 0;
+  entry = cacheentry(doc->resultcache, key);
+  if (entry->key != key || entry->generation != doc->generation)
+    return 0;
+  answer = malloc((entry->N + 1) * sizeof(void *));
+  if (!answer)
+    return 0;
+  memcpy(answer, entry->items, (entry->N + 1) * sizeof(void *));
+  *N = entry->N;
+
+  return answer;
+}
+
+/*
+  store a result in the cache
+   Params: doc - the document
+           key - key to store it under (not 0)
+           items - the result
+           N - number of items
+   Returns: 0 on success, -1 on out of memory
+   Notes: the items are copied, and replace any result that had the
+     same place in the cache. Does nothing if the cache is off, or if
+     the document is frozen, when the cache only gives back results
+     stored before.
+*/
+int xmldoc_cacheresult(XMLDOC *doc, unsigned long key, void **items, int N)
+{
+  CACHEENTRY *entry;
+  void **copy;
+
+  if (!doc->resultcache || doc->frozen)
+    return 0;
+  copy = malloc((N + 1) * sizeof(void *));
+  if (!copy)
+    return -1;
+  memcpy(copy, items, N * sizeof(void *));
+  copy[N] = 0;
+  entry = cacheentry(doc->resultcache, key);
+  free(entry->items);
+  entry->key = key;
+  entry->generation = doc->generation;
+  entry->items = copy;
+  entry->N = N;
+
+  return 0;
+}
+
+/*
+  tell the document that it has been edited
+   Params: doc - the document
+   Notes: call after adding, removing or changing nodes or attributes
+     yourself. The nodes are numbered again, the lengths of their tags,
+     data and attribute values are measured again, their tag filters and
+     attribute tables are remade, the indexes are thrown away to be
+     rebuilt when next needed, and the document's generation goes up,
+     so cached results are no longer used. The lengths are taken with
+     strlen(), so data or values with embedded nuls are cut at the
+     first one.
+*/
+void xmldoc_changed(XMLDOC *doc)
+{
+  killtagindex(doc->tagindex);
+  doc->tagindex = 0;
+  killattributeindex(doc->attributeindex);
+  doc->attributeindex = 0;
+  killtextindex(doc->textindex);
+  doc->textindex = 0;
+  free(doc->positions);
+  doc->positions = 0;
+  free(doc->marks);
+  doc->marks = 0;
+  doc->Nnodes = renumber_r(doc->root, 0, 0);
+  doc->generation++;
+}
+
+/*
+  make the document read-only, so several threads can query it at once
+   Params: doc - the document
+   Returns: 0 on success, -1 if this build can't share a document
+     between threads, when the document is left as it was
+   Notes: it needs the XPATH_THREADS build, for the per-thread marks,
+     and a GCC or Clang compatible compiler, for the atomic pointers
+     the lazily built indexes are published through. After this, XPath queries and the accessor functions can run
+     on the document from any number of threads without a lock. The
+     queries keep their scratch marks per thread instead of on the
+     document, indexes and cached numbers are still built when first
+     needed, and the result cache gives back what it holds but doesn't
+     take new results. There is no way back: the document must not be
+     edited, or passed to xmldoc_changed(), once it is frozen.
+*/
+int xmldoc_freeze(XMLDOC *doc)
+{
+#if !defined(XPATH_THREADS) || !ATOMICPOINTERS
+  (void) doc;
+  return -1;
+#else
+  free(doc->marks);
+  doc->marks = 0;
+  doc->frozen = 1;
+
+  return 0;
+#endif
+}
+
+/*
+  get all descendants that match a particular tag, using the tag index
+   Params: doc - the document
+           node - root of the subtree to search (must be from doc)
+           tag - the tag (NULL for all nodes)
+           N - return for number found, -1 on out of memory
+   Returns: list of matching nodes in document order, 0 if there
+     are none or on out of memory.
+   Notes: the subtree is node and its descendants (unlike
+     xml_getdescendants(), which also searches the node's siblings).
+     The first call builds the tag index, after that each call is a
+     binary search of the tag's list, so it is cheap to fish for
+     lots of different tags.
+*/
+XMLNODE **xmldoc_getdescendants(XMLDOC *doc, XMLNODE *node, const char *tag, int *N)
+{
+  XMLTAGINDEX *index;
+  TAGPOSTINGS *postings;
+  XMLNODE **nodes;
+  XMLNODE **answer;
+  int Nnodes;
+  int start;
+  int end;
+
+  *N = 0;
+  if (xmldoc_buildtagindex(doc))
+  {
+    *N = -1;
+    return 0;
+  }
+  index = LOADPOINTER(doc->tagindex);
+
+  if (tag)
+  {
+    postings = tagindex_get(index, tag);
+    if (!postings)
+      return 0;
+    nodes = postings->nodes;
+    Nnodes = postings->N;
+  }
+  else
+  {
+    nodes = index->order;
+    Nnodes = index->Nnodes;
+  }
+
+  start = lowerbound(nodes, Nnodes, node->preorder);
+  end = lowerbound(nodes, Nnodes, node->subtreeend + 1);
+  if (start == end)
+    return 0;
+
+  answer = malloc((end - start) * sizeof(XMLNODE *));
+  if (!answer)
+  {
+    *N = -1;
+    return 0;
+  }
+  memcpy(answer, nodes + start, (end - start) * sizeof(XMLNODE *));
+  *N = end - start;
+
+  return answer;
+}
+
+/*
+  get a node's position among its siblings with the same tag
+   Params: doc - the document
+           node - the node (must be from doc)
+   Returns: the position, counting from 1, 0 if no sibling has the
+     same tag, -1 on out of memory.
+   Notes: the first call builds the tag index, if it isn't there, and
+     numbers every node from it, after that each call is a lookup.
+     So the unique path to a node, like /bookstore/book[3]/title,
+     costs only as much as the depth of the node.
+*/
+int xmldoc_getsiblingposition(XMLDOC *doc, XMLNODE *node)
+{
+  int *positions;
+  int *expected = 0;
+
+  positions = LOADPOINTER(doc->positions);
+  if (!positions)
+  {
+    if (xmldoc_buildtagindex(doc))
+      return -1;
+    positions = buildpositions(LOADPOINTER(doc->tagindex), doc->Nnodes);
+    if (!positions)
+      return -1;
+    if (!PUBLISHPOINTER(doc->positions, expected, positions))
+    {
+      free(positions);
+      positions = expected;
+    }
+  }
+
+  return positions[node->preorder];
+}
+
+/*
+  count the elements with a tag, from the tag index
+   Params: doc - the document
+           tag - the tag (NULL for all elements)
+   Returns: the number of elements with the tag, -1 if the document
+     has no tag index.
+   Notes: this doesn't build the index, so it is a cheap way for a
+     query to ask how common a tag is, once the index is there.
+*/
+int xmldoc_tagcount(XMLDOC *doc, const char *tag)
+{
+  XMLTAGINDEX *index;
+  TAGPOSTINGS *postings;
+
+  index = LOADPOINTER(doc->tagindex);
+  if (!index)
+    return -1;
+  if (!tag)
+    return index->Nnodes;
+  postings = tagindex_get(index, tag);
+
+  return postings ? postings->N : 0;
+}
+
+/*
+  build the full-text index of a document
+  Params: doc - the document
+  Returns: 0 on success, -1 on out of memory
+  Notes: splits the data of every node and the value of every attribute
+    into tokens, and lists the places each token occurs in document
+    order. xmldoc_getnodesbytext() builds the index on first use. Once
+    a document has one, the XPath engine uses it for contains(),
+    starts-with() and text() = 'literal' predicates.
+*/
+int xmldoc_buildtextindex(XMLDOC *doc)
+{
+  XMLTEXTINDEX *index;
+  XMLTEXTINDEX *expected = 0;
+
+  if (LOADPOINTER(doc->textindex))
+    return 0;
+  index = buildtextindex(doc->root);
+  if (!index)
+    return -1;
+  if (!PUBLISHPOINTER(doc->textindex, expected, index))
+    killtextindex(index);
+
+  return 0;
+}
+
+/*
+  does the document have a full-text index?
+   Params: doc - the document
+   Returns: 1 if the text index has been built, else 0
+*/
+int xmldoc_hastextindex(XMLDOC *doc)
+{
+  return LOADPOINTER(doc->textindex) != 0;
+}
+
+/*
+  get all nodes whose data or attribute matches a string, using the text index
+   Params: doc - the document
+           node - root of the subtree to search (must be from doc)
+           attr - the attribute to test, NULL to test the node's data
+           text - the string to look for
+           how - XML_TEXT_CONTAINS, XML_TEXT_STARTSWITH or XML_TEXT_EQUALS
+           N - return for number found, -1 on out of memory
+   Returns: list of matching nodes in document order, 0 if there
+     are none or on out of memory.
+   Notes: the tests are on bytes, as XPath's contains(), starts-with()
+     and = are. Tokens are runs of letters and digits, and every token
+     of the string which must be whole in the value (one with something
+     other than a letter or digit either side of it) is looked up
+     directly. Partial tokens at the ends of the string are matched
+     against the list of tokens, and a string with no tokens at all
+     falls back to searching the subtree. Every candidate is then
+     checked against the string itself.
+*/
+XMLNODE **xmldoc_getnodesbytext(XMLDOC *doc, XMLNODE *node, const char *attr, const char *text, int how, int *N)
+{
+  TEXTPOSTING *candidates = 0;
+  XMLNODE **answer = 0;
+  const char *str;
+  int len;
+  int Ncandidates;
+  int Nanswer = 0;
+  int i;
+
+  *N = 0;
+  if (xmldoc_buildtextindex(doc))
+  {
+    *N = -1;
+    return 0;
+  }
+
+  Ncandidates = textcandidates(LOADPOINTER(doc->textindex), node, text, strlen(text), how, &candidates);
+  if (Ncandidates == -2)
+    Ncandidates = scancandidates(node, attr, &candidates);
+  if (Ncandidates < 0)
+  {
+    *N = -1;
+    goto done;
+  }
+  if (Ncandidates == 0)
+    goto done;
+
+  answer = malloc(Ncandidates * sizeof(XMLNODE *));
+  if (!answer)
+  {
+    *N = -1;
+    goto done;
+  }
+  for (i = 0; i < Ncandidates; i++)
+  {
+    if (attr)
+    {
+      if (!candidates[i].attr || strcmp(candidates[i].attr->name, attr))
+        continue;
+      str = candidates[i].attr->value;
+      len = candidates[i].attr->valuelen;
+    }
+    else
+    {
+      if (candidates[i].attr)
+        continue;
+      str = candidates[i].node->data ? candidates[i].node->data : "";
+      len = candidates[i].node->datalen;
+    }
+    if (Nanswer > 0 && answer[Nanswer-1] == candidates[i].node)
+      continue;
+    if (textmatches(str, len, text, strlen(text), how))
+      answer[Nanswer++] = candidates[i].node;
+  }
+  if (Nanswer == 0)
+  {
+    free(answer);
+    answer = 0;
+  }
+  *N = Nanswer;
+
+done:
+  free(candidates);
+  return answer;
+}
+
+static void getnestedata_r(XMLNODE *node, STRING *str, ERROR *err)
+{
+    XMLNODE *child;
+    int i = 0;
+    
+    for (child = node->child; child; child = child->next)
+    {
+        while (i < child->position && i < node->datalen)
+            string_push(str, node->data[i++], err);
+        getnestedata_r(child, str, err);
+    }
+    while (i < node->datalen)
+        string_push(str, node->data[i++], err);
+    
+}
+
+char *xml_getnesteddata(XMLNODE *node)
+{
+    ERROR error;
+    STRING str;
+    initerror(&error);
+    string_init(&str);
+    getnestedata_r(node, &str, &error);
+    return string_release(&str);
+}
+
+/*
+    get a node's line number.
+    (note this one is null-guarded because it is meant to be called in error conditions)
+ */
+int xml_getlineno(XMLNODE *node)
+{
+    if (node)
+        return node->lineno;
+    return -1;
+}
+
+/*
+  get a node's parent (0 for the root)
+*/
+XMLNODE *xml_getparent(XMLNODE *node)
+{
+    return node->parent;
+}
+
+/*
+  test whether one node is an ancestor of another
+  Params: ancestor - the possible ancestor
+          node - the node to test
+  Returns: 1 if ancestor is a proper ancestor of node, else 0
+  Notes: both nodes must be from the same document. Constant
+    time, as the parser records the preorder number of each node
+    and of the last node in its subtree.
+*/
+int xml_isancestor(XMLNODE *ancestor, XMLNODE *node)
+{
+    if (node->preorder > ancestor->preorder && node->preorder <= ancestor->subtreeend)
+        return 1;
+    return 0;
+}
+
+/*
+  compare two nodes' positions in document order
+  Returns: negative if a comes first, positive if b comes first, 0 if the same node
+  Notes: both nodes must be from the same document.
+*/
+int xml_compareorder(XMLNODE *a, XMLNODE *b)
+{
+    return a->preorder - b->preorder;
+}
+/*
+  Report any attributes which are not on a list of knowwn attributes
+ 
+  Params: node the node to test
+        ... NULL-terminated list of known node names.
+   Returns: a list of unrecognised attribures as a deep copy, 0 if
+       there are none.
+    Notes:
+       Call as
+       XMLATTRIBUTE *badattr =  0;
+       char *end = 0;
+ 
      badatttr = xml_unknownattributes(node, "faith", "hope", "charity", end);
      if (badattr)
          // We've got a node with some attributes we don't recognise
@@ -766,100 +1935,1264 @@ XMLATTRIBUTE *xml_unknownattributes(XMLNODE *node, ...)
         }
         name = va_arg(args, char *);
     }
-    va_end(args);
-    
-    i = 0;
-    for (attr = node->attributes; attr != NULL; attr = attr->next)
+    va_end(args);
+    
+    i = 0;
+    for (attr = node->attributes; attr != NULL; attr = attr->next)
+    {
+        if (!matches[i])
+        {
+            copy = malloc(sizeof(XMLATTRIBUTE));
+            if (!copy)
+                goto out_of_memory;
+            copy->value = 0;
+            copy->number = 0;
+            copy->name = mystrdup(attr->name);
+            if (!copy->name)
+                goto out_of_memory;
+            copy->value = malloc(attr->valuelen + 1);
+            if (!copy->value)
+                goto out_of_memory;
+            memcpy(copy->value, attr->value, attr->valuelen + 1);
+            copy->valuelen = attr->valuelen;
+            copy->next = answer;
+            answer = copy;
+            copy = 0;
+        }
+        i++;
+    }
+    
+    copy = 0;
+    while (answer)
+    {
+        attr = answer;
+        answer = answer->next;
+        attr->next = copy;
+        copy = attr;
+    }
+     answer = copy;
+    
+    free(matches);
+    
+    return answer;
+    
+out_of_memory:
+    free(matches);
+    if (copy)
+    {
+        free(copy->name);
+        free(copy->value);
+        free(copy);
+    }
+    killxmlattribute(answer);
+    
+    return  0;
+}
+
+
+/*
+  xml node destructor
+  Notes: destroy siblings in a list, chilren recursively
+    as children are unlikely to be nested very deep
+
+*/
+void killxmlnode(XMLNODE *node)
+{
+  XMLNODE *next;
+
+  if(node)
+  {
+    while(node)
+    {
+      next = node->next;
+      if(node->child)
+        killxmlnode(node->child);
+      killxmlattribute(node->attributes);
+      free(node->attributetable);
+      free(node->number);
+      free(node->data);
+      free(node->tag);
+      free(node);
+      node = next;
+    }
+  }
+}
+
+/*
+  destroy the attributes list
+*/
+static void killxmlattribute(XMLATTRIBUTE *attr)
+{
+  XMLATTRIBUTE *next;
+  if(attr)
+  {
+    while(attr)
+    {
+       next = attr->next;
+       free(attr->name);
+       free(attr->value);
+       free(attr->number);
+       free(attr);
+       attr = next;
+    }
+  }
+}
+
+/*
+  build the attribute hash table for a node with lots of attributes
+  Returns: the table, 0 if the node has few attributes (or out of memory)
+  Notes: with a short list it is quicker just to walk it. Where
+    a name is duplicated, the first one is entered, to match the list.
+*/
+static XMLATTRIBUTETABLE *buildattributetable(XMLATTRIBUTE *attributes)
+{
+  XMLATTRIBUTETABLE *table;
+  XMLATTRIBUTE *attr;
+  unsigned int key;
+  unsigned int i;
+  int N = 0;
+  int capacity = 1;
+
+  for (attr = attributes; attr; attr = attr->next)
+    N++;
+  if (N <= ATTRIBUTEHASHTHRESHOLD)
+    return 0;
+  while (capacity < N * 2)
+    capacity *= 2;
+
+  table = malloc(sizeof(XMLATTRIBUTETABLE) + capacity * sizeof(ATTRIBUTESLOT));
+  if (!table)
+    return 0;
+  table->capacity = capacity;
+  table->slots = (ATTRIBUTESLOT *) (table + 1);
+  for (i = 0; i < (unsigned int) capacity; i++)
+  {
+    table->slots[i].key = 0;
+    table->slots[i].attr = 0;
+  }
+
+  for (attr = attributes; attr; attr = attr->next)
+  {
+    key = strhash(attr->name);
+    i = key & (capacity - 1);
+    while (table->slots[i].attr)
+    {
+      if (table->slots[i].key == key && !strcmp(table->slots[i].attr->name, attr->name))
+        break;
+      i = (i + 1) & (capacity - 1);
+    }
+    if (!table->slots[i].attr)
+    {
+      table->slots[i].key = key;
+      table->slots[i].attr = attr;
+    }
+  }
+
+  return table;
+}
+
+/*
+  get the cached numeric value of a string, parsing it on first use
+  Params: cache - the cache pointer of the attribute or node
+          str - the string
+          len - length of the string
+          temp - space to use if we can't allocate the cache
+  Returns: the parsed value
+*/
+static XMLNUMBER *getnumber(XMLNUMBER **cache, const char *str, int len, XMLNUMBER *temp)
+{
+  XMLNUMBER *number;
+  XMLNUMBER *expected = 0;
+
+  number = LOADPOINTER(*cache);
+  if (number)
+    return number;
+  number = malloc(sizeof(XMLNUMBER));
+  if (!number)
+    number = temp;
+  parsenumber(str, len, number);
+  if (number != temp && !PUBLISHPOINTER(*cache, expected, number))
+  {
+    free(number);
+    number = expected;
+  }
+
+  return number;
+}
+
+static void parsenumber(const char *str, int len, XMLNUMBER *number)
+{
+  number->flags = 0;
+  number->ivalue = 0;
+  number->dvalue = 0.0;
+  number->bvalue = 0;
+
+  if (parseint64(str, len, &number->ivalue))
+    number->flags |= NUMBER_INT64;
+  if (parsedouble(str, len, &number->dvalue))
+    number->flags |= NUMBER_DOUBLE;
+  if (parsebool(str, len, &number->bvalue))
+    number->flags |= NUMBER_BOOL;
+}
+
+/*
+  strip leading and trailing whitespace, by adjusting start and end
+*/
+static void trimspan(const char *str, int *start, int *end)
+{
+  while (*start < *end && isspace((unsigned char) str[*start]))
+    (*start)++;
+  while (*end > *start && isspace((unsigned char) str[*end - 1]))
+    (*end)--;
+}
+
+static int parseint64(const char *str, int len, int64_t *value)
+{
+  int start = 0;
+  int end = len;
+  int negative = 0;
+  uint64_t answer = 0;
+  uint64_t limit;
+  int digit;
+
+  trimspan(str, &start, &end);
+  if (start < end && (str[start] == '-' || str[start] == '+'))
+  {
+    negative = str[start] == '-' ? 1 : 0;
+    start++;
+  }
+  if (start == end)
+    return 0;
+
+  limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+  for (; start < end; start++)
+  {
+    if (!isdigit((unsigned char) str[start]))
+      return 0;
+    digit = str[start] - '0';
+    if (answer > (limit - digit) / 10)
+      return 0;
+    answer = answer * 10 + digit;
+  }
+
+  if (negative)
+    *value = answer == (uint64_t) INT64_MAX + 1 ? INT64_MIN : -(int64_t) answer;
+  else
+    *value = (int64_t) answer;
+
+  return 1;
+}
+
+/*
+  parse a double
+  Notes: most numbers in XML have few enough digits, and a small
+    enough exponent, that the mantissa and the power of ten are both
+    exact as doubles, so one multiply or divide gives the correctly
+    rounded answer. The rest go to strtod(), with the decimal point
+    switched to the one the locale expects.
+*/
+static int parsedouble(const char *str, int len, double *value)
+{
+  static const double powersoften[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  int start = 0;
+  int end = len;
+  int i;
+  int negative = 0;
+  uint64_t mantissa = 0;
+  int Ndigits = 0;
+  int Nsignificant = 0;
+  int truncated = 0;
+  int exponent = 0;
+  int explicitexponent = 0;
+  int expnegative = 0;
+  int Nexpdigits = 0;
+  char buff[64];
+  char *copy;
+  char *endptr;
+  const char *point;
+  double answer;
+
+  trimspan(str, &start, &end);
+  i = start;
+  if (i < end && (str[i] == '-' || str[i] == '+'))
+  {
+    negative = str[i] == '-' ? 1 : 0;
+    i++;
+  }
+  if (end - i == 3 && !strncmp(str + i, "INF", 3))
+  {
+    *value = negative ? -HUGE_VAL : HUGE_VAL;
+    return 1;
+  }
+  if (end - start == 3 && !strncmp(str + start, "NaN", 3))
+  {
+    *value = NAN;
+    return 1;
+  }
+
+  for (; i < end && isdigit((unsigned char) str[i]); i++)
+  {
+    Ndigits++;
+    if (Nsignificant < 19)
+    {
+      mantissa = mantissa * 10 + (str[i] - '0');
+      if (mantissa)
+        Nsignificant++;
+    }
+    else
+    {
+      exponent++;
+      truncated = 1;
+    }
+  }
+  if (i < end && str[i] == '.')
+  {
+    for (i++; i < end && isdigit((unsigned char) str[i]); i++)
+    {
+      Ndigits++;
+      if (Nsignificant < 19)
+      {
+        mantissa = mantissa * 10 + (str[i] - '0');
+        if (mantissa)
+          Nsignificant++;
+        exponent--;
+      }
+      else
+        truncated = 1;
+    }
+  }
+  if (Ndigits == 0)
+    return 0;
+  if (i < end && (str[i] == 'e' || str[i] == 'E'))
+  {
+    i++;
+    if (i < end && (str[i] == '-' || str[i] == '+'))
+    {
+      expnegative = str[i] == '-' ? 1 : 0;
+      i++;
+    }
+    for (; i < end && isdigit((unsigned char) str[i]); i++)
+    {
+      Nexpdigits++;
+      if (explicitexponent < 100000)
+        explicitexponent = explicitexponent * 10 + (str[i] - '0');
+    }
+    if (Nexpdigits == 0)
+      return 0;
+    exponent += expnegative ? -explicitexponent : explicitexponent;
+  }
+  if (i != end)
+    return 0;
+
+  if (!truncated && mantissa <= ((uint64_t) 1 << 53) && exponent >= -22 && exponent <= 22)
+  {
+    answer = (double) mantissa;
+    if (exponent < 0)
+      answer /= powersoften[-exponent];
+    else
+      answer *= powersoften[exponent];
+    *value = negative ? -answer : answer;
+    return 1;
+  }
+
+  copy = end - start < (int) sizeof(buff) ? buff : malloc(end - start + 1);
+  if (!copy)
+    return 0;
+  memcpy(copy, str + start, end - start);
+  copy[end - start] = 0;
+  point = localeconv()->decimal_point;
+  if (point && point[0] && point[1] == 0)
+  {
+    for (i = 0; copy[i]; i++)
+      if (copy[i] == '.')
+        copy[i] = point[0];
+  }
+  answer = strtod(copy, &endptr);
+  if (copy != buff)
+    free(copy);
+  *value = answer;
+
+  return 1;
+}
+
+static int parsebool(const char *str, int len, int *value)
+{
+  int start = 0;
+  int end = len;
+
+  trimspan(str, &start, &end);
+  if ((end - start == 4 && !strncmp(str + start, "true", 4)) ||
+      (end - start == 1 && str[start] == '1'))
+  {
+    *value = 1;
+    return 1;
+  }
+  if ((end - start == 5 && !strncmp(str + start, "false", 5)) ||
+      (end - start == 1 && str[start] == '0'))
+  {
+    *value = 0;
+    return 1;
+  }
+
+  return 0;
+}
+
+static int countnodes_r(XMLNODE *node)
+{
+  int answer = 0;
+
+  while (node)
+  {
+    if (node->child)
+      answer += countnodes_r(node->child);
+    answer++;
+    node = node->next;
+  }
+
+  return answer;
+}
+
+/*
+  list the nodes in document order
+*/
+static XMLNODE **listnodes_r(XMLNODE *node, XMLNODE **out)
+{
+  while (node)
+  {
+    *out++ = node;
+    if (node->child)
+      out = listnodes_r(node->child, out);
+    node = node->next;
+  }
+
+  return out;
+}
+
+/*
+  find a tag's slot in the index hash table (empty slot if not present)
+*/
+static TAGPOSTINGS *tagindex_slot(TAGPOSTINGS *table, int capacity, const char *tag)
+{
+  unsigned int i;
+
+  i = strhash(tag) & (capacity - 1);
+  while (table[i].tag && strcmp(table[i].tag, tag))
+    i = (i + 1) & (capacity - 1);
+
+  return &table[i];
+}
+
+/*
+  add a tag to the index, growing the table as needed
+  Returns: the tag's entry, 0 on out of memory
+*/
+static TAGPOSTINGS *tagindex_add(XMLTAGINDEX *index, const char *tag)
+{
+  TAGPOSTINGS *table;
+  TAGPOSTINGS *slot;
+  int capacity;
+  int i;
+
+  if ((index->Ntags + 1) * 2 > index->capacity)
+  {
+    capacity = index->capacity ? index->capacity * 2 : 16;
+    table = malloc(capacity * sizeof(TAGPOSTINGS));
+    if (!table)
+      return 0;
+    for (i = 0; i < capacity; i++)
+    {
+      table[i].tag = 0;
+      table[i].nodes = 0;
+      table[i].N = 0;
+    }
+    for (i = 0; i < index->capacity; i++)
+      if (index->table[i].tag)
+        *tagindex_slot(table, capacity, index->table[i].tag) = index->table[i];
+    free(index->table);
+    index->table = table;
+    index->capacity = capacity;
+  }
+
+  slot = tagindex_slot(index->table, index->capacity, tag);
+  if (!slot->tag)
+  {
+    slot->tag = tag;
+    index->Ntags++;
+  }
+
+  return slot;
+}
+
+static TAGPOSTINGS *tagindex_get(XMLTAGINDEX *index, const char *tag)
+{
+  TAGPOSTINGS *slot;
+
+  if (!index->capacity)
+    return 0;
+  slot = tagindex_slot(index->table, index->capacity, tag);
+
+  return slot->tag ? slot : 0;
+}
+
+/*
+  build the tag index
+  Notes: nodes are listed in document order, so each tag's
+    postings are sorted by the preorder numbers given by the parser.
+*/
+static XMLTAGINDEX *buildtagindex(XMLNODE *root)
+{
+  XMLTAGINDEX *index;
+
+  index = malloc(sizeof(XMLTAGINDEX));
+  if (!index)
+    return 0;
+  index->order = 0;
+  index->Nnodes = 0;
+  index->table = 0;
+  index->capacity = 0;
+  index->Ntags = 0;
+  index->pool = 0;
+
+  index->Nnodes = countnodes_r(root);
+  index->order = malloc((index->Nnodes + 1) * sizeof(XMLNODE *));
+  if (!index->order)
+    goto out_of_memory;
+  listnodes_r(root, index->order);
+  if (addpostings(index, 0))
+    goto out_of_memory;
+
+  return index;
+
+out_of_memory:
+  killtagindex(index);
+  return 0;
+}
+
+/*
+  sort the listed nodes into postings lists
+  Params: index - index with order and Nnodes set up
+          keys - key for each node, 0 to use the tags
+  Returns: 0 on success, -1 on out of memory
+*/
+static int addpostings(XMLTAGINDEX *index, const char **keys)
+{
+  TAGPOSTINGS *postings;
+  XMLNODE **pos;
+  int i;
+
+  for (i = 0; i < index->Nnodes; i++)
+  {
+    postings = tagindex_add(index, keys ? keys[i] : index->order[i]->tag);
+    if (!postings)
+      return -1;
+    postings->N++;
+  }
+
+  index->pool = malloc((index->Nnodes + 1) * sizeof(XMLNODE *));
+  if (!index->pool)
+    return -1;
+  pos = index->pool;
+  for (i = 0; i < index->capacity; i++)
+  {
+    if (index->table[i].tag)
+    {
+      index->table[i].nodes = pos;
+      pos += index->table[i].N;
+      index->table[i].N = 0;
+    }
+  }
+  for (i = 0; i < index->Nnodes; i++)
+  {
+    postings = tagindex_get(index, keys ? keys[i] : index->order[i]->tag);
+    postings->nodes[postings->N++] = index->order[i];
+  }
+
+  return 0;
+}
+
+/*
+  build the index of one attribute's values
+  Notes: the values index is a tag index, keyed by the attribute value
+    instead of the tag, and listing only the nodes which have the
+    attribute.
+*/
+static XMLATTRIBUTEINDEX *buildattributeindex(XMLNODE *root, const char *attr)
+{
+  XMLATTRIBUTEINDEX *index;
+  XMLTAGINDEX *values;
+  XMLATTRIBUTE *found;
+  const char **keys = 0;
+  unsigned int key;
+  int N;
+  int i;
+
+  index = malloc(sizeof(XMLATTRIBUTEINDEX));
+  if (!index)
+    return 0;
+  index->name = 0;
+  index->values = 0;
+  index->next = 0;
+
+  index->name = malloc(strlen(attr) + 1);
+  if (!index->name)
+    goto out_of_memory;
+  strcpy(index->name, attr);
+
+  values = malloc(sizeof(XMLTAGINDEX));
+  if (!values)
+    goto out_of_memory;
+  values->order = 0;
+  values->Nnodes = 0;
+  values->table = 0;
+  values->capacity = 0;
+  values->Ntags = 0;
+  values->pool = 0;
+  index->values = values;
+
+  N = countnodes_r(root);
+  values->order = malloc((N + 1) * sizeof(XMLNODE *));
+  keys = malloc((N + 1) * sizeof(const char *));
+  if (!values->order || !keys)
+    goto out_of_memory;
+  listnodes_r(root, values->order);
+
+  key = xml_attributekey(attr);
+  for (i = 0; i < N; i++)
+  {
+    found = findattribute(values->order[i], attr, key);
+    if (found)
+    {
+      keys[values->Nnodes] = found->value;
+      values->order[values->Nnodes++] = values->order[i];
+    }
+  }
+  if (addpostings(values, keys))
+    goto out_of_memory;
+
+  free(keys);
+  return index;
+
+out_of_memory:
+  free(keys);
+  killattributeindex(index);
+  return 0;
+}
+
+static void killattributeindex(XMLATTRIBUTEINDEX *index)
+{
+  XMLATTRIBUTEINDEX *next;
+
+  while (index)
+  {
+    next = index->next;
+    killtagindex(index->values);
+    free(index->name);
+    free(index);
+    index = next;
+  }
+}
+
+static XMLATTRIBUTEINDEX *getattributeindex(XMLDOC *doc, const char *attr)
+{
+  XMLATTRIBUTEINDEX *index;
+
+  for (index = LOADPOINTER(doc->attributeindex); index; index = index->next)
+    if (!strcmp(index->name, attr))
+      return index;
+
+  return 0;
+}
+
+/*
+  number the nodes among their siblings with the same tag. The tag's
+  postings are in document order, so counting along them by parent
+  gives the positions, in one pass over the document.
+*/
+static int *buildpositions(XMLTAGINDEX *index, int Nnodes)
+{
+  TAGPOSTINGS *postings;
+  XMLNODE *node;
+  int *positions;
+  int *counts;
+  int i;
+  int j;
+
+  positions = calloc(Nnodes > 0 ? Nnodes : 1, sizeof(int));
+  counts = calloc(Nnodes > 0 ? Nnodes : 1, sizeof(int));
+  if (!positions || !counts)
+    goto out_of_memory;
+
+  for (i = 0; i < index->capacity; i++)
+  {
+    postings = &index->table[i];
+    if (!postings->tag)
+      continue;
+    for (j = 0; j < postings->N; j++)
+    {
+      node = postings->nodes[j];
+      if (node->parent)
+        positions[node->preorder] = ++counts[node->parent->preorder];
+    }
+    for (j = 0; j < postings->N; j++)
     {
-        if (!matches[i])
-        {
-            copy = malloc(sizeof(XMLATTRIBUTE));
-            if (!copy)
-                goto out_of_memory;
-            copy->name = mystrdup(attr->name);
-            if (!copy->name)
-                goto out_of_memory;
-            copy->value = mystrdup(attr->value);
-            if (!copy->value)
-                goto out_of_memory;
-            copy->next = answer;
-            answer = copy;
-            copy = 0;
-        }
-        i++;
+      node = postings->nodes[j];
+      if (node->parent && counts[node->parent->preorder] == 1)
+        positions[node->preorder] = 0;
     }
-    
-    copy = 0;
-    while (answer)
+    for (j = 0; j < postings->N; j++)
+      if (postings->nodes[j]->parent)
+        counts[postings->nodes[j]->parent->preorder] = 0;
+  }
+  free(counts);
+
+  return positions;
+
+out_of_memory:
+  free(positions);
+  free(counts);
+  return 0;
+}
+
+static void killtagindex(XMLTAGINDEX *index)
+{
+  if (index)
+  {
+    free(index->order);
+    free(index->table);
+    free(index->pool);
+    free(index);
+  }
+}
+
+/*
+  build the full-text index
+  Notes: every token is listed with the node and attribute it came
+    from, the list is sorted by token, and then each run of the same
+    token becomes one postings list. Sorting on the field number as
+    well keeps the postings in document order.
+*/
+static XMLTEXTINDEX *buildtextindex(XMLNODE *root)
+{
+  XMLTEXTINDEX *index;
+  XMLNODE **order = 0;
+  TEXTOCCURRENCE *occurrences = 0;
+  TEXTOCCURRENCE *occ;
+  XMLATTRIBUTE *attr;
+  TEXTTOKEN *token;
+  TEXTPOSTING *pos;
+  int Nnodes;
+  int Noccurrences = 0;
+  int Npostings = 0;
+  int field = 0;
+  int i;
+
+  index = malloc(sizeof(XMLTEXTINDEX));
+  if (!index)
+    return 0;
+  index->tokens = 0;
+  index->Ntokens = 0;
+  index->pool = 0;
+
+  Nnodes = countnodes_r(root);
+  order = malloc((Nnodes + 1) * sizeof(XMLNODE *));
+  if (!order)
+    goto out_of_memory;
+  listnodes_r(root, order);
+
+  for (i = 0; i < Nnodes; i++)
+  {
+    Noccurrences += counttokens(order[i]->data, order[i]->datalen);
+    for (attr = order[i]->attributes; attr; attr = attr->next)
+      Noccurrences += counttokens(attr->value, attr->valuelen);
+  }
+  occurrences = malloc((Noccurrences + 1) * sizeof(TEXTOCCURRENCE));
+  if (!occurrences)
+    goto out_of_memory;
+
+  occ = occurrences;
+  for (i = 0; i < Nnodes; i++)
+  {
+    occ = addoccurrences(occ, order[i], 0, field++);
+    for (attr = order[i]->attributes; attr; attr = attr->next)
+      occ = addoccurrences(occ, order[i], attr, field++);
+  }
+  qsort(occurrences, Noccurrences, sizeof(TEXTOCCURRENCE), compareoccurrences);
+
+  for (i = 0; i < Noccurrences; i++)
+  {
+    if (i == 0 || comparetokens(occurrences[i-1].token, occurrences[i-1].len,
+                                occurrences[i].token, occurrences[i].len))
     {
-        attr = answer;
-        answer = answer->next;
-        attr->next = copy;
-        copy = attr;
+      index->Ntokens++;
+      Npostings++;
     }
-     answer = copy;
-    
-    free(matches);
-    
-    return answer;
-    
+    else if (occurrences[i-1].field != occurrences[i].field)
+      Npostings++;
+  }
+  index->tokens = malloc((index->Ntokens + 1) * sizeof(TEXTTOKEN));
+  index->pool = malloc((Npostings + 1) * sizeof(TEXTPOSTING));
+  if (!index->tokens || !index->pool)
+    goto out_of_memory;
+
+  token = index->tokens - 1;
+  pos = index->pool;
+  for (i = 0; i < Noccurrences; i++)
+  {
+    if (i == 0 || comparetokens(occurrences[i-1].token, occurrences[i-1].len,
+                                occurrences[i].token, occurrences[i].len))
+    {
+      token++;
+      token->token = occurrences[i].token;
+      token->len = occurrences[i].len;
+      token->postings = pos;
+      token->N = 0;
+    }
+    else if (occurrences[i-1].field == occurrences[i].field)
+      continue;
+    pos->node = occurrences[i].node;
+    pos->attr = occurrences[i].attr;
+    pos++;
+    token->N++;
+  }
+
+  free(occurrences);
+  free(order);
+  return index;
+
 out_of_memory:
-    free(matches);
-    if (copy)
+  free(occurrences);
+  free(order);
+  killtextindex(index);
+  return 0;
+}
+
+static void killtextindex(XMLTEXTINDEX *index)
+{
+  if (index)
+  {
+    free(index->tokens);
+    free(index->pool);
+    free(index);
+  }
+}
+
+/*
+  list the tokens in a node's data, or in one of its attributes
+  Returns: pointer to the end of the list
+*/
+static TEXTOCCURRENCE *addoccurrences(TEXTOCCURRENCE *out, XMLNODE *node, XMLATTRIBUTE *attr, int field)
+{
+  const char *str = attr ? attr->value : node->data;
+  int len = attr ? attr->valuelen : node->datalen;
+  int i = 0;
+  int start;
+
+  while (i < len)
+  {
+    if (!istokenchar(str[i]))
     {
-        free(copy->name);
-        free(copy->value);
-        free(copy);
+      i++;
+      continue;
     }
-    killxmlattribute(answer);
-    
-    return  0;
+    start = i;
+    while (i < len && istokenchar(str[i]))
+      i++;
+    out->token = str + start;
+    out->len = i - start;
+    out->field = field;
+    out->node = node;
+    out->attr = attr;
+    out++;
+  }
+
+  return out;
 }
 
+static int counttokens(const char *str, int len)
+{
+  int answer = 0;
+  int i;
+
+  for (i = 0; i < len; i++)
+    if (istokenchar(str[i]) && (i == 0 || !istokenchar(str[i-1])))
+      answer++;
+
+  return answer;
+}
 
 /*
-  xml node destructor
-  Notes: destroy siblings in a list, chilren recursively
-    as children are unlikely to be nested very deep
+  letters and digits make up tokens, and so does any byte of a
+  multi-byte UTF-8 character
+*/
+static int istokenchar(int ch)
+{
+  ch &= 0xFF;
+  return ch >= 0x80 || isalnum(ch);
+}
 
+/*
+  find the nodes which might match a text query
+  Params: index - the text index
+          node - the subtree to search
+          text - the string to look for
+          len - its length
+          how - XML_TEXT_CONTAINS etc
+          out - return for the candidates, in document order
+  Returns: number of candidates, -1 on out of memory, -2 if the
+    string has no tokens to look up.
+  Notes: a token of the string is whole in the value if there is
+    something else either side of it in the string, or if it is at
+    the start of a starts-with() string, or for =, anywhere. The rarest
+    whole token is the best choice. Failing that, a token at the end
+    of the string must start a token of the value, which is a range of
+    the sorted tokens, and failing that the longest partial token is
+    looked for inside each token of the index.
 */
-void killxmlnode(XMLNODE *node)
+static int textcandidates(XMLTEXTINDEX *index, XMLNODE *node, const char *text, int len, int how, TEXTPOSTING **out)
 {
-  XMLNODE *next;
+  TEXTTOKEN *found;
+  TEXTPOSTING *answer;
+  const char *best = 0;
+  int bestlen = 0;
+  int bestkind = 0;
+  int bestN = 0;
+  int left, right;
+  int first, last;
+  int kind;
+  int start;
+  int Nanswer;
+  int i, j;
+
+  *out = 0;
+  i = 0;
+  while (i < len)
+  {
+    if (!istokenchar(text[i]))
+    {
+      i++;
+      continue;
+    }
+    start = i;
+    while (i < len && istokenchar(text[i]))
+      i++;
+    left = start > 0 || how != XML_TEXT_CONTAINS;
+    right = i < len || how == XML_TEXT_EQUALS;
+    kind = left && right ? 3 : left ? 2 : 1;
+    if (kind == 3)
+    {
+      j = findtoken(index, text + start, i - start);
+      if (j == index->Ntokens || comparetokens(index->tokens[j].token, index->tokens[j].len, text + start, i - start))
+        return 0;
+      if (bestkind < 3 || index->tokens[j].N < bestN)
+      {
+        best = text + start;
+        bestlen = i - start;
+        bestN = index->tokens[j].N;
+        bestkind = 3;
+      }
+    }
+    else if (kind > bestkind || (kind == bestkind && i - start > bestlen))
+    {
+      best = text + start;
+      bestlen = i - start;
+      bestkind = kind;
+    }
+  }
+  if (!best)
+    return -2;
 
-  if(node)
+  if (bestkind == 1)
   {
-    while(node)
+    first = 0;
+    last = index->Ntokens;
+  }
+  else
+  {
+    first = findtoken(index, best, bestlen);
+    last = first;
+    while (last < index->Ntokens && index->tokens[last].len >= bestlen &&
+           !memcmp(index->tokens[last].token, best, bestlen))
     {
-      next = node->next;
-      if(node->child)
-        killxmlnode(node->child);
-      killxmlattribute(node->attributes);
-      free(node->data);
-      free(node->tag);
-      free(node);
-      node = next;
+      last++;
+      if (bestkind == 3)
+        break;
     }
   }
+
+  Nanswer = 0;
+  for (j = first; j < last; j++)
+  {
+    found = &index->tokens[j];
+    if (bestkind == 1 && !textmatches(found->token, found->len, best, bestlen, XML_TEXT_CONTAINS))
+      continue;
+    Nanswer += postingslowerbound(found, node->subtreeend + 1) - postingslowerbound(found, node->preorder);
+  }
+  if (Nanswer == 0)
+    return 0;
+
+  answer = malloc(Nanswer * sizeof(TEXTPOSTING));
+  if (!answer)
+    return -1;
+  Nanswer = 0;
+  for (j = first; j < last; j++)
+  {
+    found = &index->tokens[j];
+    if (bestkind == 1 && !textmatches(found->token, found->len, best, bestlen, XML_TEXT_CONTAINS))
+      continue;
+    start = postingslowerbound(found, node->preorder);
+    i = postingslowerbound(found, node->subtreeend + 1);
+    memcpy(answer + Nanswer, found->postings + start, (i - start) * sizeof(TEXTPOSTING));
+    Nanswer += i - start;
+  }
+  if (last - first > 1)
+    qsort(answer, Nanswer, sizeof(TEXTPOSTING), comparepostings);
+
+  *out = answer;
+  return Nanswer;
 }
 
 /*
-  destroy the attributes list
+  every node of a subtree as a candidate, for strings with no tokens
+  Returns: number of candidates, -1 on out of memory
 */
-static void killxmlattribute(XMLATTRIBUTE *attr)
+static int scancandidates(XMLNODE *node, const char *attr, TEXTPOSTING **out)
 {
-  XMLATTRIBUTE *next;
-  if(attr)
+  TEXTPOSTING *answer;
+  XMLNODE *top = node;
+  XMLATTRIBUTE *found = 0;
+  unsigned int key = attr ? xml_attributekey(attr) : 0;
+  int N = 0;
+
+  *out = 0;
+  answer = malloc((node->subtreeend - node->preorder + 1) * sizeof(TEXTPOSTING));
+  if (!answer)
+    return -1;
+  for (;;)
   {
-    while(attr)
+    if (attr)
+      found = findattribute(node, attr, key);
+    if (!attr || found)
     {
-       next = attr->next;
-       free(attr->name);
-       free(attr->value);
-       free(attr);
-       attr = next;
+      answer[N].node = node;
+      answer[N].attr = found;
+      N++;
+    }
+    if (node->child)
+      node = node->child;
+    else
+    {
+      while (node != top && !node->next)
+        node = node->parent;
+      if (node == top)
+        break;
+      node = node->next;
+    }
+  }
+
+  *out = answer;
+  return N;
+}
+
+/*
+  test a value against the string of a text query
+*/
+static int textmatches(const char *str, int len, const char *text, int textlen, int how)
+{
+  const char *ptr = str;
+  const char *end = str + len - textlen;
+
+  switch (how)
+  {
+    case XML_TEXT_EQUALS:
+      return len == textlen && !memcmp(str, text, len);
+    case XML_TEXT_STARTSWITH:
+      return len >= textlen && !memcmp(str, text, textlen);
+  }
+  if (textlen == 0)
+    return 1;
+  while (ptr <= end)
+  {
+    ptr = memchr(ptr, text[0], end - ptr + 1);
+    if (!ptr)
+      break;
+    if (!memcmp(ptr, text, textlen))
+      return 1;
+    ptr++;
+  }
+
+  return 0;
+}
+
+/*
+  index of the first token of the index not less than a string
+*/
+static int findtoken(XMLTEXTINDEX *index, const char *token, int len)
+{
+  int low = 0;
+  int high = index->Ntokens;
+  int mid;
+
+  while (low < high)
+  {
+    mid = low + (high - low) / 2;
+    if (comparetokens(index->tokens[mid].token, index->tokens[mid].len, token, len) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+/*
+  index of the first posting of a token at or after preorder
+*/
+static int postingslowerbound(TEXTTOKEN *token, int preorder)
+{
+  int low = 0;
+  int high = token->N;
+  int mid;
+
+  while (low < high)
+  {
+    mid = low + (high - low) / 2;
+    if (token->postings[mid].node->preorder < preorder)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+static int comparetokens(const char *a, int alen, const char *b, int blen)
+{
+  int diff = memcmp(a, b, alen < blen ? alen : blen);
+
+  if (diff)
+    return diff;
+  return alen - blen;
+}
+
+static int compareoccurrences(const void *e1, const void *e2)
+{
+  const TEXTOCCURRENCE *a = e1;
+  const TEXTOCCURRENCE *b = e2;
+  int diff = comparetokens(a->token, a->len, b->token, b->len);
+
+  if (diff)
+    return diff;
+  return a->field - b->field;
+}
+
+static int comparepostings(const void *e1, const void *e2)
+{
+  const TEXTPOSTING *a = e1;
+  const TEXTPOSTING *b = e2;
+
+  return a->node->preorder - b->node->preorder;
+}
+
+/*
+  index of first node in a document-ordered list at or after preorder
+*/
+static int lowerbound(XMLNODE **nodes, int N, int preorder)
+{
+  int low = 0;
+  int high = N;
+  int mid;
+
+  while (low < high)
+  {
+    mid = low + (high - low) / 2;
+    if (nodes[mid]->preorder < preorder)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+static void killresultcache(XMLRESULTCACHE *cache)
+{
+  int i;
+
+  if (cache)
+  {
+    for (i = 0; i < cache->capacity; i++)
+      free(cache->entries[i].items);
+    free(cache->entries);
+    free(cache);
+  }
+}
+
+/*
+  the place in the cache for a key
+*/
+static CACHEENTRY *cacheentry(XMLRESULTCACHE *cache, unsigned long key)
+{
+  unsigned long hash = key * 2654435761UL;
+
+  return &cache->entries[(hash ^ (hash >> 16)) & (cache->capacity - 1)];
+}
+
+/*
+  number a list of siblings and their subtrees in document order
+  Returns: the next preorder number
+  Notes: also sets the parent links, lengths and tag filters, remakes
+    the attribute tables and drops the cached numbers, as the parser
+    would have done for the tree as it is now.
+*/
+static int renumber_r(XMLNODE *node, XMLNODE *parent, int preorder)
+{
+  XMLNODE *child;
+  XMLATTRIBUTE *attr;
+
+  while (node)
+  {
+    node->parent = parent;
+    node->preorder = preorder++;
+    node->taglen = (int) strlen(node->tag);
+    node->datalen = node->data ? (int) strlen(node->data) : 0;
+    free(node->attributetable);
+    node->attributetable = buildattributetable(node->attributes);
+    free(node->number);
+    node->number = 0;
+    for (attr = node->attributes; attr; attr = attr->next)
+    {
+      attr->valuelen = attr->value ? (int) strlen(attr->value) : 0;
+      free(attr->number);
+      attr->number = 0;
     }
+    preorder = renumber_r(node->child, node, preorder);
+    node->subtreeend = preorder - 1;
+    node->tagfilter = xml_tagfilterbits(node->tag);
+    for (child = node->child; child; child = child->next)
+      node->tagfilter |= child->tagfilter;
+    node = node->next;
+  }
+
+  return preorder;
+}
+
+/*
+  FNV-1a hash of a string
+*/
+static unsigned int strhash(const char *str)
+{
+  unsigned long answer = 2166136261UL;
+
+  while (*str)
+  {
+    answer ^= (unsigned char) *str++;
+    answer *= 16777619UL;
   }
+
+  return (unsigned int) (answer & 0xFFFFFFFF);
 }
 
 static int is_initidentifier(int ch)
@@ -930,11 +3263,11 @@ out_of_memory:
 
 }
 
-static void string_concat(STRING *s, const char *str, ERROR *err)
+static void string_concat(STRING *s, const char *str, int len, ERROR *err)
 {
     int i;
     
-    for (i =0; str[i]; i++)
+    for (i =0; i < len; i++)
         string_push(s, str[i], err);
 }
 
@@ -972,6 +3305,18 @@ static XMLDOC *xmldocument(LEXER *lex, ERROR *err)
         reporterror(err, "out of memory");
         return 0;
     }
+    doc->root = 0;
+    doc->Nnodes = 0;
+    doc->tagindex = 0;
+    doc->attributeindex = 0;
+    doc->textindex = 0;
+    doc->positions = 0;
+    doc->idattribute = 0;
+    doc->marks = 0;
+    doc->markgeneration = 0;
+    doc->generation = 0;
+    doc->resultcache = 0;
+    doc->frozen = 0;
     
     skipbom(lex, err);
 
@@ -982,12 +3327,14 @@ static XMLDOC *xmldocument(LEXER *lex, ERROR *err)
         ch = gettoken(lex);
         if (is_initidentifier(ch))
         {
-            node = xmlnode(lex, err);
+            node = xmlnode(lex, 0, err);
             if (node)
             {
                 if (!err->set)
                 {
+                    closenode(lex, node);
                     doc->root = node;
+                    doc->Nnodes = lex->Nnodes;
                     return doc;
                 }
                 else
@@ -1024,7 +3371,7 @@ static XMLDOC *xmldocument(LEXER *lex, ERROR *err)
     return 0;
 }
 
-static XMLNODE *xmlnode(LEXER *lex, ERROR *err)
+static XMLNODE *xmlnode(LEXER *lex, XMLNODE *parent, ERROR *err)
 {
     int ch;
     char *tag = 0;
@@ -1034,6 +3381,7 @@ static XMLNODE *xmlnode(LEXER *lex, ERROR *err)
     STRING datastr;
     int shriek;
     int lineno;
+    int len;
     
     if (err->set)
         return 0;
@@ -1057,12 +3405,22 @@ static XMLNODE *xmlnode(LEXER *lex, ERROR *err)
         if (!node)
             goto out_of_memory;
         node->tag = tag;
+        node->taglen = (int) strlen(tag);
         node->attributes = attributes;
+        node->attributetable = buildattributetable(attributes);
         node->data = 0;
+        node->datalen = 0;
+        node->number = 0;
         node->position = 0;
         node->lineno = lineno;
+        node->preorder = lex->Nnodes++;
+        node->subtreeend = node->preorder;
+        node->tagfilter = xml_tagfilterbits(tag);
+        node->parent = parent;
         node->child = 0;
         node->next = 0;
+        if (lex->handler && lex->handler->opennode)
+            (*lex->handler->opennode)(node, lex->handler->ptr);
         endrecursion(err);
         return node;
     }
@@ -1073,20 +3431,30 @@ static XMLNODE *xmlnode(LEXER *lex, ERROR *err)
         if (!node)
             goto out_of_memory;
         node->tag = tag;
+        node->taglen = (int) strlen(tag);
         node->attributes = attributes;
+        node->attributetable = buildattributetable(attributes);
         node->data = 0;
+        node->datalen = 0;
+        node->number = 0;
         node->position = 0;
         node->lineno = lineno;
+        node->preorder = lex->Nnodes++;
+        node->subtreeend = node->preorder;
+        node->tagfilter = xml_tagfilterbits(tag);
+        node->parent = parent;
         node->child = 0;
         node->next = 0;
         tag = 0;
         attributes = 0;
+        if (lex->handler && lex->handler->opennode)
+            (*lex->handler->opennode)(node, lex->handler->ptr);
         
         do {
-            char *text = textspan(lex, err);
+            char *text = textspan(lex, &len, err);
             if (text)
             {
-                string_concat(&datastr, text, err);
+                string_concat(&datastr, text, len, err);
                 free(text);
                 text = 0;
             }
@@ -1097,15 +3465,23 @@ static XMLNODE *xmlnode(LEXER *lex, ERROR *err)
                 ch = gettoken(lex);
                 if (is_initidentifier(ch))
                 {
-                    XMLNODE *child = xmlnode(lex, err);
+                    XMLNODE *child = xmlnode(lex, node, err);
                     if (!child)
                         goto parse_error;
-                    if (lastchild)
-                        lastchild->next = child;
-                    else
-                        node->child = child;
-                    lastchild = child;
                     child->position = datastr.N;
+                    if (!closenode(lex, child))
+                    {
+                        killxmlnode(child);
+                    }
+                    else
+                    {
+                        if (lastchild)
+                            lastchild->next = child;
+                        else
+                            node->child = child;
+                        lastchild = child;
+                        node->tagfilter |= child->tagfilter;
+                    }
                 }
                 else if(ch == '/')
                 {
@@ -1113,7 +3489,9 @@ static XMLNODE *xmlnode(LEXER *lex, ERROR *err)
                     tag = elementname(lex,err);
                     if (tag && !strcmp(tag, node->tag))
                     {
+                        node->datalen = datastr.N;
                         node->data = string_release(&datastr);
+                        node->subtreeend = lex->Nnodes - 1;
                         free(tag);
                         match(lex, '>');
                         endrecursion(err);
@@ -1132,9 +3510,9 @@ static XMLNODE *xmlnode(LEXER *lex, ERROR *err)
                         comment(lex, err);
                     else if(shriek == CDATA)
                     {
-                        text = cdata(lex, err);
+                        text = cdata(lex, &len, err);
                         if (text)
-                            string_concat(&datastr, text, err);
+                            string_concat(&datastr, text, len, err);
                         free(text);
                     }
                 }
@@ -1164,6 +3542,20 @@ out_of_memory:
     return 0;
 }
 
+/*
+  Pass a completed element to the stream handler.
+  Returns: non-zero if the element should be linked into the tree,
+    0 if it should be freed.
+ */
+static int closenode(LEXER *lex, XMLNODE *node)
+{
+    if (!lex->handler)
+        return 1;
+    if (!lex->handler->closenode)
+        return 0;
+    return (*lex->handler->closenode)(node, lex->handler->ptr);
+}
+
 static XMLNODE *comment(LEXER *lex, ERROR *err)
 {
     char buff[4] = {0};
@@ -1230,6 +3622,7 @@ static XMLATTRIBUTE *xmlattribute(LEXER *lex, ERROR *err)
 {
     char *name = 0;
     char *value = 0;
+    int len;
     XMLATTRIBUTE *answer = 0;
     
     name = attributename(lex, err);
@@ -1239,7 +3632,7 @@ static XMLATTRIBUTE *xmlattribute(LEXER *lex, ERROR *err)
     if (!match(lex, '='))
         goto parse_error;
     skipwhitespace(lex, err);
-    value = quotedstring(lex, err);
+    value = quotedstring(lex, &len, err);
     if (!value)
         goto parse_error;
     
@@ -1248,6 +3641,8 @@ static XMLATTRIBUTE *xmlattribute(LEXER *lex, ERROR *err)
         goto out_of_memory;
     answer->name = name;
     answer->value = value;
+    answer->valuelen = len;
+    answer->number = 0;
     answer->next = 0;
     return answer;
     
@@ -1268,7 +3663,7 @@ out_of_memory:
 
 
 
-static char *quotedstring(LEXER *lex, ERROR *err)
+static char *quotedstring(LEXER *lex, int *len, ERROR *err)
 {
     int quotech;
     STRING str;
@@ -1301,6 +3696,7 @@ static char *quotedstring(LEXER *lex, ERROR *err)
     }
     if (!match(lex, quotech))
         goto parse_error;
+    *len = str.N;
     return string_release(&str);
 parse_error:
     free(string_release(&str));
@@ -1309,7 +3705,7 @@ parse_error:
     
 }
 
-static char *textspan(LEXER *lex, ERROR *err)
+static char *textspan(LEXER *lex, int *len, ERROR *err)
 {
    int ch;
    STRING str;
@@ -1327,10 +3723,11 @@ static char *textspan(LEXER *lex, ERROR *err)
       string_push(&str, ch, err);
    } 
    
+    *len = str.N;
     return string_release(&str);
 }
 
-static char *cdata(LEXER *lex, ERROR *err)
+static char *cdata(LEXER *lex, int *len, ERROR *err)
 {
     char buff[4] = {0};
     int ch;
@@ -1359,7 +3756,10 @@ static char *cdata(LEXER *lex, ERROR *err)
         buff[2] = ch;
         match(lex, ch);
         if (!strcmp(buff, "]]>"))
+        {
+            *len = str.N;
             return string_release(&str);
+        }
     }
     free (string_release(&str));
     reporterror(err, "unterminated CDATA tag (starts line %d)", lineno);
@@ -1650,6 +4050,8 @@ static void initlexer(LEXER *lex, ERROR *err, int (*getch)(void *), void *ptr)
   lex->lineno = 0;
   lex->columnno = 0;
   lex->badmatch = 0;
+  lex->Nnodes = 0;
+  lex->handler = 0;
   err->lexer = lex;
   /* hacked. Put a '<' sitting in the token becuase non-seekable UTF-16 streams
    need to read this character to determine data format */
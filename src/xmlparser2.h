@@ -2,21 +2,32 @@
 #define xmlparser_h
 
 #include <stdio.h>
+#include <stdint.h>
 
 typedef struct xmlattribute
 {
   char *name;                /* attribute name */
   char *value;               /* attribute value (without quotes) */
+  int valuelen;              /* length of the value */
+  struct xmlnumber *number;  /* cached numeric value, set on first typed read */
   struct xmlattribute *next; /* next pointer in linked list */
 } XMLATTRIBUTE;
 
 typedef struct xmlnode
 {
   char *tag;                 /* tag to identify data type */
+  int taglen;                /* length of the tag */
   XMLATTRIBUTE *attributes;  /* attributes */
+  struct xmlattributetable *attributetable; /* hash of attributes, if many */
   char *data;                /* data as ascii */
+  int datalen;               /* length of the data (which may contain nuls) */
+  struct xmlnumber *number;  /* cached numeric value, set on first typed read */
   int position;              /* position of the node within parent's data string */
   int lineno;                /* line number of node in document */
+  int preorder;              /* position of node in document order */
+  int subtreeend;            /* preorder number of last node in the subtree */
+  uint64_t tagfilter;        /* Bloom filter of the tags in the subtree */
+  struct xmlnode *parent;    /* parent node (0 for the root) */
   struct xmlnode *next;      /* sibling node */
   struct xmlnode *child;     /* first child node */
 } XMLNODE;
@@ -24,24 +35,81 @@ typedef struct xmlnode
 typedef struct
 {
   XMLNODE *root;             /* the root node */
+  int Nnodes;                /* number of nodes in the document */
+  struct xmltagindex *tagindex; /* tag postings, built on demand */
+  struct xmlattributeindex *attributeindex; /* attribute value postings, built on demand */
+  struct xmltextindex *textindex; /* full-text postings, built on demand */
+  int *positions;            /* positions among same-tag siblings, built on demand */
+  char *idattribute;         /* attribute holding element ids, 0 for "id" */
+  unsigned int *marks;       /* scratch marks for queries, indexed by preorder */
+  unsigned int markgeneration; /* current value of a set mark */
+  unsigned int generation;   /* bumped by xmldoc_changed() */
+  struct xmlresultcache *resultcache; /* cached query results, if enabled */
+  int frozen;                /* set by xmldoc_freeze(), no more changes */
 } XMLDOC;
 
+typedef struct
+{
+  void (*opennode)(XMLNODE *node, void *ptr); /* element start, attributes read */
+  int (*closenode)(XMLNODE *node, void *ptr); /* element complete, non-zero to keep */
+  void *ptr;                 /* passed back to the callbacks */
+} XMLHANDLER;
+
+#define XML_TEXT_CONTAINS 1
+#define XML_TEXT_STARTSWITH 2
+#define XML_TEXT_EQUALS 3
 
 XMLDOC *loadxmldoc(const char *fname, char *errormessage, int Nerr);
 XMLDOC *floadxmldoc(FILE *fp, char *errormessage, int Nerr);
 XMLDOC *xmldocfromstring(const char *str,char *errormessage, int Nerr);
+int fstreamxmldoc(FILE *fp, XMLHANDLER *handler, char *errormessage, int Nerr);
+int streamxmldocfromstring(const char *str, XMLHANDLER *handler, char *errormessage, int Nerr);
 void killxmldoc(XMLDOC *doc);
 void killxmlnode(XMLNODE *node);
 
 XMLNODE *xml_getroot(XMLDOC *doc);
 const char *xml_gettag(XMLNODE *node);
 const char *xml_getdata(XMLNODE *node);
+int xml_gettag_len(XMLNODE *node);
+int xml_getdata_len(XMLNODE *node);
 const char *xml_getattribute(XMLNODE *node, const char *attr);
+const char *xml_getattribute_len(XMLNODE *node, const char *attr, int *len);
+unsigned int xml_attributekey(const char *attr);
+uint64_t xml_tagfilterbits(const char *tag);
+int xml_maycontaintag(XMLNODE *node, uint64_t bits);
+const char *xml_getattributebykey(XMLNODE *node, const char *attr, unsigned int key);
+XMLATTRIBUTE *xml_getattributenode(XMLNODE *node, const char *attr, unsigned int key);
+int xml_getattribute_int64(XMLNODE *node, const char *attr, int64_t *value);
+int xml_getattribute_double(XMLNODE *node, const char *attr, double *value);
+int xml_getattribute_bool(XMLNODE *node, const char *attr, int *value);
+int xml_getdata_double(XMLNODE *node, double *value);
 int xml_Nchildren(XMLNODE *node);
 int xml_Nchildrenwithtag(XMLNODE *node, const char *tag);
 XMLNODE *xml_getchild(XMLNODE *node, const char *tag, int index);
 XMLNODE **xml_getdescendants(XMLNODE *node, const char *tag, int *N);
+int xmldoc_buildtagindex(XMLDOC *doc);
+XMLNODE **xmldoc_getdescendants(XMLDOC *doc, XMLNODE *node, const char *tag, int *N);
+int xmldoc_tagcount(XMLDOC *doc, const char *tag);
+int xmldoc_getsiblingposition(XMLDOC *doc, XMLNODE *node);
+int xmldoc_buildattributeindex(XMLDOC *doc, const char *attr);
+XMLNODE **xmldoc_getnodesbyattribute(XMLDOC *doc, XMLNODE *node, const char *attr, const char *value, int *N);
+XMLNODE **xmldoc_getnodeswithattribute(XMLDOC *doc, XMLNODE *node, const char *attr, int *N);
+int xmldoc_attributecount(XMLDOC *doc, const char *attr);
+XMLNODE *xmldoc_getnodebykey(XMLDOC *doc, const char *attr, const char *value);
+int xmldoc_setidattribute(XMLDOC *doc, const char *attr);
+XMLNODE *xmldoc_getnodebyid(XMLDOC *doc, const char *id);
+int xmldoc_enableresultcache(XMLDOC *doc, int capacity);
+void **xmldoc_getcachedresult(XMLDOC *doc, unsigned long key, int *N);
+int xmldoc_cacheresult(XMLDOC *doc, unsigned long key, void **items, int N);
+void xmldoc_changed(XMLDOC *doc);
+int xmldoc_freeze(XMLDOC *doc);
+int xmldoc_buildtextindex(XMLDOC *doc);
+int xmldoc_hastextindex(XMLDOC *doc);
+XMLNODE **xmldoc_getnodesbytext(XMLDOC *doc, XMLNODE *node, const char *attr, const char *text, int how, int *N);
 char *xml_getnesteddata(XMLNODE *node);
+XMLNODE *xml_getparent(XMLNODE *node);
+int xml_isancestor(XMLNODE *ancestor, XMLNODE *node);
+int xml_compareorder(XMLNODE *a, XMLNODE *b);
 
 int xml_getlineno(XMLNODE *node);
 XMLATTRIBUTE *xml_unknownattributes(XMLNODE *node, ...);
@@ -6,30 +6,54 @@
 //
 
 #include "xpath.h"
+#include "xpathvm.h"
 
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#ifdef XPATH_THREADS
+#include <pthread.h>
+#endif
 
-typedef struct hashcell
+#ifdef XPATH_STATS
+unsigned long xml_xpath_nodesvisited = 0;
+#endif
+
+typedef struct
 {
-    void *key;
-    struct hashcell *next;
-    int deleted;
-} HASHCELL;
+    unsigned int *mark;         /* the document's mark array */
+    unsigned int generation;    /* value of a mark set by this query */
+} MARKS;
 
-typedef struct {
-    HASHCELL *pool;
-    int N;
-    HASHCELL **table;
-    int Nallocated;
-} HASHTABLE;
+#ifdef XPATH_THREADS
+typedef struct
+{
+    unsigned int *mark;         /* the thread's mark array */
+    int capacity;               /* number of marks allocated */
+    unsigned int generation;    /* value of the last set of marks */
+} THREADMARKS;
+#endif
+
+typedef struct
+{
+    XMLNODE **nodes;            /* the nodes, in document order */
+    int N;                      /* number of nodes */
+    int capacity;               /* allocated size of nodes */
+} NODESET;
+
+typedef struct
+{
+    NODESET *set;               /* set to collect the nodes in, or */
+    int (*callback)(XMLNODE *node, void *ptr); /* function to pass them to */
+    void *ptr;                  /* pointer passed to the callback */
+} NODESINK;
 
 typedef struct
 {
     const char *input;
     int tokenpos;
+    int tokenend;
     int pos;
     int token;
     char error[1204];
@@ -44,34 +68,252 @@ typedef struct
 #define OPENSQUARE 6
 #define CLOSESQUARE 7
 #define DOTDOT 8
+#define NUMBER 9
+#define STRING 10
+#define EQUALS 11
+#define OPENPAREN 12
+#define CLOSEPAREN 13
+#define PIPE 14
+
+#define AXIS_CHILD 1
+#define AXIS_DESCENDANT 2
+#define AXIS_DESCENDANTORSELF 3
+#define AXIS_PARENT 4
+#define AXIS_ATTRIBUTE 5
+
+#define PREDICATE_HASCHILD 1
+#define PREDICATE_HASANYCHILD 2
+#define PREDICATE_POSITION 3
+#define PREDICATE_LAST 4
+#define PREDICATE_HASATTRIBUTE 5
+#define PREDICATE_ATTRIBUTEEQUALS 6
+#define PREDICATE_CHILDEQUALS 7
+
+typedef struct
+{
+    int type;                   /* PREDICATE_HASCHILD, PREDICATE_POSITION etc */
+    char *name;                 /* child tag or attribute name to test for */
+    unsigned int key;           /* attribute key, for attribute tests */
+    char *value;                /* value to compare with, 0 for none */
+    int position;               /* position wanted, for PREDICATE_POSITION */
+} XPATHPREDICATE;
+
+typedef struct
+{
+    int axis;                   /* AXIS_CHILD, AXIS_PARENT etc */
+    char *name;                 /* name to match, 0 for any */
+    unsigned int key;           /* attribute key, for attribute steps */
+    uint64_t tagfilter;         /* tag filter bits of the name, 0 for any */
+    XPATHPREDICATE *predicates; /* predicates filtering the step */
+    int Npredicates;            /* number of predicates */
+    int positional;             /* set if any predicate depends on position */
+} XPATHSTEP;
+
+struct xpath
+{
+    char *source;               /* the expression it was compiled from */
+    XPATHSTEP *steps;           /* the location steps, in order */
+    int Nsteps;                 /* number of steps */
+    struct xpath *next;         /* next path of a union, or 0 */
+    XPATHPROGRAM *program;      /* bytecode, for expressions the steps can't express */
+    unsigned long serial;       /* identifies the compiled query, for the result cache */
+};
+
+#ifdef XPATH_THREADS
+#define TASK_NODE 1
+#define TASK_SUBTREE 2
+#define TASK_CHILDREN 3
+
+#define PARALLEL_MINNODES 65536     /* smallest search worth splitting */
+#define PARALLEL_MINCONTEXT 4096    /* smallest frontier worth splitting */
+#define PARALLEL_TASKSPERTHREAD 16  /* pieces per thread, for balance */
+
+typedef struct
+{
+    int type;                   /* TASK_NODE, TASK_SUBTREE or TASK_CHILDREN */
+    XMLNODE *node;              /* the node or the root of the subtree */
+    XMLNODE **context;          /* context nodes, for TASK_CHILDREN */
+    int Ncontext;               /* number of context nodes */
+    NODESET result;             /* the nodes the task selected */
+    int err;                    /* set on out of memory */
+} XPATHTASK;
+
+typedef struct
+{
+    pthread_mutex_t lock;       /* taken to pop or steal a task */
+    int head;                   /* next task for the owner */
+    int tail;                   /* one past the last task, stolen from here */
+} WORKQUEUE;
+
+typedef struct
+{
+    const XPATHSTEP *step;      /* the step being run */
+    XPATHTASK *tasks;           /* the pieces, in document order */
+    WORKQUEUE *queues;          /* one queue per thread */
+    int Nqueues;                /* number of queues */
+} WORKPOOL;
+
+typedef struct
+{
+    WORKPOOL *pool;             /* the shared pool */
+    int id;                     /* the worker's own queue */
+} WORKER;
+#endif
+
+typedef struct nfatransition
+{
+    const XPATHSTEP *step;      /* step giving the node test and predicates */
+    struct nfastate *target;    /* state the transition leads to */
+} NFATRANSITION;
 
-static HASHTABLE *inithashtablefromtree(XMLNODE *root);
-static XMLNODE **getselectednodes(XMLNODE *root, HASHTABLE *ht, int *Nret);
-
-static void stepup_r(XMLNODE *node, HASHTABLE *ht);
-static void stepdown_r(XMLNODE *node, HASHTABLE *ht);
-static void select_r(XMLNODE *node, HASHTABLE *ht, int (*predicate)(XMLNODE *node, void *ptr), void *ptr);
-static void fish_r(XMLNODE *node, HASHTABLE *ht, int (*predicate)(XMLNODE *node, void *ptr), void *ptr);
-static void markdeleted_r(XMLNODE *node, HASHTABLE *ht);
-static int countselectednodes_r(XMLNODE *node, HASHTABLE *ht);
-static XMLNODE **getselectednodes_r(XMLNODE *node, HASHTABLE *ht, XMLNODE **out);
-static int getnodepath_r(XMLNODE *node, char *path, int len, XMLNODE *reference);
-static int pathdepth_r(XMLNODE *node);
-static int countnodes_r(XMLNODE *node);
-static void fillhashtable_r(XMLNODE *node, HASHTABLE *ht);
-
-static XMLATTRIBUTE **simplexpression(XMLNODE *root, HASHTABLE *ht, LEXER *lex);
-static XMLATTRIBUTE **pathexpression(XMLNODE *root, HASHTABLE *ht, LEXER *lex, int level);
-static XMLATTRIBUTE **postfixexpression(XMLNODE *root, HASHTABLE *ht, LEXER *lex);
-static void predicate(XMLNODE *root, HASHTABLE *ht, LEXER *lex);
+typedef struct
+{
+    int query;                  /* index of the query which accepts */
+    const XPATHSTEP *attribute; /* attribute the node must have, or 0 */
+} NFAACCEPT;
+
+typedef struct nfastate
+{
+    int id;                     /* index of the state in the set */
+    NFATRANSITION *transitions; /* transitions on matching a node */
+    int Ntransitions;           /* number of transitions */
+    struct nfastate *descendant; /* state reached by "//", or 0 */
+    int selfloop;               /* set if this is a "//" state */
+    NFAACCEPT *accepts;         /* queries which accept in this state */
+    int Naccepts;               /* number of accepts */
+    int *table;                 /* hash of plain named transitions, or 0 */
+    int capacity;               /* size of table, a power of two */
+    int *others;                /* transitions not in the table */
+    int Nothers;                /* number of others */
+} NFASTATE;
+
+struct xpathset
+{
+    XPATH **xpaths;             /* the queries, owned by the caller */
+    int N;                      /* number of queries */
+    NFASTATE **states;          /* all the states of the automaton */
+    int Nstates;                /* number of states */
+    NFASTATE *start;            /* the start state, for the document node */
+    int *fallback;              /* set for queries run on their own */
+};
+
+typedef struct
+{
+    NFASTATE **active;          /* stack of sets of active states */
+    int N;                      /* number of entries on the stack */
+    int capacity;               /* allocated size of active */
+    int *stamp;                 /* last node each state was added for */
+    NODESET *results;           /* results for each query */
+    int err;                    /* set on out of memory */
+} NFARUN;
+
+typedef struct
+{
+    int from;                   /* first of the node's active states */
+    int pending;                /* first of the node's pending accepts */
+    int keep;                   /* set if the subtree must be kept */
+} NFAFRAME;
+
+typedef struct
+{
+    const XPATHSET *set;        /* the queries */
+    NFARUN run;                 /* active states, for all open elements */
+    NFAFRAME *frames;           /* one frame for each open element */
+    int Nframes;                /* number of open elements, plus the document */
+    int framecapacity;          /* allocated size of frames */
+    int *pending;               /* queries waiting for an element to close */
+    int Npending;               /* number of pending queries */
+    int pendingcapacity;        /* allocated size of pending */
+    int *delivered;             /* last node delivered for each query */
+    void (*callback)(XMLNODE *node, int query, void *ptr); /* result callback */
+    void *ptr;                  /* passed back to the callback */
+} NFASTREAM;
+
+#define NFATABLETHRESHOLD 8
+
+static XPATH *parsexpath(const char *xpath, char *errormessage, int Nerr);
+static XPATH *unionexpr(LEXER *lex);
+static XPATH *locationpath(LEXER *lex);
+static void step(XPATH *xp, LEXER *lex, int axis);
+static void predicate(XPATHSTEP *step, LEXER *lex);
+static void orderpredicates(XPATHSTEP *step);
+static int predicatecost(const XPATHPREDICATE *pred);
+static int literal(XPATHPREDICATE *pred, LEXER *lex);
+static XPATHSTEP *addstep(XPATH *xp, LEXER *lex, int axis, const char *name);
+static int selectsattributes(const XPATH *xp);
+
+static int execute(const XPATH *xp, XMLDOC *doc, int Nsteps, int Nthreads, NODESET *result);
+static int unite(const XPATH *xp, XMLDOC *doc, int Nthreads, NODESET *result);
+static int pickpivot(const XPATH *xp, XMLDOC *doc, int Nsteps);
+static int pivotstep(const XPATH *xp, XMLDOC *doc, int pivot, NODESET *result);
+static XMLNODE *matchupwards(const XPATHSTEP *steps, int pivot, XMLNODE *node);
+static XMLNODE *matchsegment(const XPATHSTEP *steps, int first, int last, XMLNODE *node);
+static int iterate(const XPATH *xp, XMLDOC *doc, int (*callback)(XMLNODE *node, void *ptr), void *ptr);
+static int deliver(XMLDOC *doc, NODESET *set, int (*callback)(XMLNODE *node, void *ptr), void *ptr);
+static int runstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink);
+static int childstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink);
+static int descendantstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink, int includeself);
+static int descendants_r(XMLNODE *node, const XPATHSTEP *step, MARKS *marks, NODESINK *sink);
+static int indexeddescendants(XMLDOC *doc, XMLNODE *node, int includeself, const XPATHSTEP *step, const XPATHPREDICATE *pred, NODESINK *sink);
+static const XPATHPREDICATE *indexedpredicate(const XPATHSTEP *step);
+#ifdef XPATH_THREADS
+static int canparallel(XMLDOC *doc, const XPATHSTEP *step, NODESET *context);
+static int parallelstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink, int Nthreads);
+static int splitsubtree_r(XMLNODE *node, int grain, XPATHTASK **tasks, int *N, int *capacity);
+static int addtask(XPATHTASK **tasks, int *N, int *capacity, int type, XMLNODE *node);
+static void *worker(void *ptr);
+static int takework(WORKPOOL *pool, int id);
+static void runtask(const XPATHSTEP *step, XPATHTASK *task);
+#endif
+static int parentstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink);
+static int attributestep(const XPATHSTEP *step, NODESET *context, NODESINK *sink);
+static int emit(NODESINK *sink, const XPATHSTEP *step, XMLNODE *node);
+static int matchpredicates(const XPATHSTEP *step, XMLNODE *node);
+static int matchpredicate(const XPATHPREDICATE *pred, XMLNODE *node);
+static void selectsiblings(MARKS *marks, const XPATHSTEP *step, XMLNODE *first);
+static int isnested(NODESET *set);
+static XMLATTRIBUTE **getpathattributes(const XPATH *xp, XMLDOC *doc, int *Nret);
+static int attributesfromindex(const XPATH *xp, XMLDOC *doc);
+static XMLATTRIBUTE **getunionattributes(const XPATH *xp, XMLDOC *doc, int *Nret);
+static XMLNODE **getselectednodes(XMLDOC *doc, NODESET *set, int *Nret);
+
+static int nodeset_add(NODESET *set, XMLNODE *node);
+static int nodeset_merge(NODESET *a, NODESET *b, NODESET *result);
+static int comparenodes(XMLNODE *a, XMLNODE *b);
+static void nodeset_sort(NODESET *set);
+static int compareorder(const void *e1, const void *e2);
+static int countnode(XMLNODE *node, void *ptr);
+static int firstnode(XMLNODE *node, void *ptr);
+static int initmarks(XMLDOC *doc, MARKS *marks);
+#ifdef XPATH_THREADS
+static int initthreadmarks(XMLDOC *doc, MARKS *marks);
+static void makethreadmarkskey(void);
+static void killthreadmarks(void *ptr);
+#endif
+static int ismarked(MARKS *marks, XMLNODE *node);
+static void setmark(MARKS *marks, XMLNODE *node);
+static void clearmark(MARKS *marks, XMLNODE *node);
+
+static int nfa_canrun(const XPATH *xp);
+static NFASTATE *nfa_newstate(XPATHSET *set);
+static NFASTATE *nfa_transition(XPATHSET *set, NFASTATE *state, const XPATHSTEP *step);
+static NFASTATE *nfa_descendant(XPATHSET *set, NFASTATE *state);
+static int nfa_buildtables(XPATHSET *set);
+static int nfa_accept(NFASTATE *state, int query, const XPATHSTEP *attribute);
+static int nfa_add(NFARUN *run, NFASTATE *state, int preorder);
+static void nfa_run_r(const XPATHSET *set, XMLNODE *node, NFARUN *run, int from, int to);
+static int nfa_advance(NFARUN *run, XMLNODE *node, int from, int to, int (*predicates)(const XPATHSTEP *step, XMLNODE *node));
+static int nfa_canstream(const XPATH *xp);
+static int nfa_stream(const XPATHSET *set, FILE *fp, const char *str, void (*callback)(XMLNODE *node, int query, void *ptr), void *ptr, char *errormessage, int Nerr);
+static void nfa_streamopen(XMLNODE *node, void *ptr);
+static int nfa_streamclose(XMLNODE *node, void *ptr);
+static int matchattributepredicates(const XPATHSTEP *step, XMLNODE *node);
 
 static int matchhaschild(XMLNODE *node, void *ptr);
 static int matchhasanychild(XMLNODE *node, void *ptr);
 static int matchattribute(XMLNODE *node, void *ptr);
+static int matchstep(XMLNODE *node, void *ptr);
 static int matchtag(XMLNODE *node, void *ptr);
-static int matchall(XMLNODE *node, void *ptr);
-
-static int pickattribute(XMLATTRIBUTE *attr, void *ptr);
 
 static void initlexer(LEXER *lex, const char *xpath);
 static int gettoken(LEXER *lex);
@@ -81,11 +323,10 @@ static int haserror(LEXER *lex);
 static void writeerror(LEXER *lex, const char *fmt, ...);
 static int iselementchar(int ch);
 
-static HASHTABLE *inithashtable(int N);
-static void killhashtable(HASHTABLE *ht);
-static void ht_addentry(HASHTABLE *ht, void *address);
-static HASHCELL *ht_get(HASHTABLE *ht, void *address);
-static unsigned int hash(void *address);
+
+static char *mystrdup(const char *str);
+static unsigned long newserial(void);
+static unsigned int strhash(const char *str);
 
 static void printnode_r(XMLNODE *node, int depth);
 static void printnodewithsibs(XMLNODE *node);
@@ -102,48 +343,29 @@ static void printnodewithsibs(XMLNODE *node);
  
     Notes: were the quety returns no nores, u]it will return an empty
     list containing onl the terminal NULL value. When it encouters an error
-    it wil return 0.
+    it wil return 0. If you run the same query many times, compile it
+    once with xml_xpath_compile() and call xml_xpath_exec() instead.
  */
 XMLNODE **xml_xpath_select(XMLDOC *doc, const char *xpath, int *Nselected, char *errormessage, int Nerr)
 {
-    LEXER lex;
-    HASHTABLE *ht = 0;
+    XPATH *xp;
     XMLNODE **answer = 0;
-    XMLATTRIBUTE** selattributes = 0;
-    
-    ht = inithashtablefromtree(doc->root);
-    if (!ht)
-    {
-        goto  out_of_memory;
-    }
-    
-    initlexer(&lex, xpath);
-    selattributes = simplexpression(doc->root, ht, &lex);
-    free(selattributes);
-    selattributes = 0;
     
-    if (haserror(&lex))
-    {
-        killhashtable(ht);
-        if (errormessage)
-            strncpy(errormessage, lex.error, Nerr);
+    xp = parsexpath(xpath, errormessage, Nerr);
+    if (!xp)
         return 0;
-    }
-    if (errormessage)
-        errormessage[0] = 0;
     
-    answer = getselectednodes(doc->root, ht, Nselected);
+    answer = xml_xpath_exec(xp, doc, Nselected);
     if (!answer)
         goto  out_of_memory;
     
-    killhashtable(ht);
+    killxpath(xp);
     return answer;
     
 out_of_memory:
-    free(selattributes);
-    killhashtable(ht);
+    killxpath(xp);
     if (errormessage)
-        strncpy(errormessage, "Out of memory", Nerr);
+        snprintf(errormessage, Nerr, "Out of memory");
     return  0;
 }
 
@@ -152,7 +374,6 @@ out_of_memory:
  
     Params: doc - the xml document
             xpath - the path to query
-            Nselected - return for number of selected paths
             errormessage - return buffer for parse errors
             Nerr - length of errormessage buffer.
     Returns: the selected attributes as a list, yerminateed with a NULL
@@ -166,37 +387,108 @@ out_of_memory:
  */
 XMLATTRIBUTE **xml_xpath_selectattributes(XMLDOC *doc, const char *xpath, char *errormessage, int Nerr)
 {
-    LEXER lex;
-    HASHTABLE *ht = 0;
+    return xml_xpath_selectattributes_len(doc, xpath, 0, errormessage, Nerr);
+}
+
+/*
+    Call the XPath query on an expression which selects attributes,
+    getting the number of attributes back as well.
+ 
+    Params: doc - the xml document
+            xpath - the path to query
+            Nselected - return for number of selected attributes
+            errormessage - return buffer for parse errors
+            Nerr - length of errormessage buffer.
+    Returns: the selected attributes as a list, terminated with a NULL,
+    0 on error.
+ */
+XMLATTRIBUTE **xml_xpath_selectattributes_len(XMLDOC *doc, const char *xpath, int *Nselected, char *errormessage, int Nerr)
+{
+    XPATH *xp;
     XMLATTRIBUTE **answer = 0;
     
-    ht = inithashtablefromtree(doc->root);
-    if (!ht)
-    {
+    xp = parsexpath(xpath, errormessage, Nerr);
+    if (!xp)
+        return 0;
+    
+    answer = xml_xpath_execattributes_len(xp, doc, Nselected);
+    if (!answer)
         goto  out_of_memory;
-    }
     
-    initlexer(&lex, xpath);
-    answer = simplexpression(doc->root, ht, &lex);
+    killxpath(xp);
+    return answer;
     
-    if (haserror(&lex))
-    {
-        killhashtable(ht);
-        if (errormessage)
-            strncpy(errormessage, lex.error, Nerr);
+out_of_memory:
+    killxpath(xp);
+    if (errormessage)
+        snprintf(errormessage, Nerr, "Out of memory");
+    return  0;
+}
+
+/*
+    Get the first node an XPath query selects.
+ 
+    Params: doc - the xml document
+            xpath - the path to query
+            errormessage - return buffer for parse errors
+            Nerr - length of errormessage buffer.
+    Returns: the first selected node in document order, 0 if there isn't one.
+ 
+    Notes: the search stops at the first match, so this is the cheap
+    way to test if a node exists. On error it also returns 0, but puts
+    a message in the buffer, which is otherwise set to the empty string.
+ */
+XMLNODE *xml_xpath_selectfirst(XMLDOC *doc, const char *xpath, char *errormessage, int Nerr)
+{
+    XPATH *xp;
+    XMLNODE *answer = 0;
+    
+    xp = parsexpath(xpath, errormessage, Nerr);
+    if (!xp)
         return 0;
-    }
+    
+    if (iterate(xp, doc, firstnode, &answer))
+        goto out_of_memory;
+    
+    killxpath(xp);
+    return answer;
+    
+out_of_memory:
+    killxpath(xp);
     if (errormessage)
-        errormessage[0] = 0;
+        snprintf(errormessage, Nerr, "Out of memory");
+    return 0;
+}
+
+/*
+    Count the nodes an XPath query selects.
+ 
+    Params: doc - the xml document
+            xpath - the path to query
+            errormessage - return buffer for parse errors
+            Nerr - length of errormessage buffer.
+    Returns: the number of nodes selected, -1 on error.
+ */
+int xml_xpath_count(XMLDOC *doc, const char *xpath, char *errormessage, int Nerr)
+{
+    XPATH *xp;
+    int answer = 0;
     
-    killhashtable(ht);
+    xp = parsexpath(xpath, errormessage, Nerr);
+    if (!xp)
+        return -1;
+    
+    if (iterate(xp, doc, countnode, &answer))
+        goto out_of_memory;
+    
+    killxpath(xp);
     return answer;
     
 out_of_memory:
-    killhashtable(ht);
+    killxpath(xp);
     if (errormessage)
-        strncpy(errormessage, "Out of memory", Nerr);
-    return  0;
+        snprintf(errormessage, Nerr, "Out of memory");
+    return -1;
 }
 
 /*
@@ -212,25 +504,15 @@ s.
  */
 int xml_xpath_selectsattributes(const char *xpath, char *errormessage, int Nerr)
 {
-    LEXER lex;
-    XMLATTRIBUTE **attributes;
-    int answer = 0;
-    initlexer(&lex, xpath);
-    attributes = simplexpression(0, 0, &lex);
-    if (attributes)
-    {
-        answer = 1;
-        free(attributes);
-    }
+    XPATH *xp;
+    int answer;
     
-    if (haserror(&lex))
-    {
-        if (errormessage)
-            strncpy(errormessage, lex.error, Nerr);
+    xp = parsexpath(xpath, errormessage, Nerr);
+    if (!xp)
         return 0;
-    }
-    if (errormessage)
-        errormessage[0] = 0;
+    answer = selectsattributes(xp);
+    killxpath(xp);
+    
     return answer;
 }
 
@@ -247,540 +529,3166 @@ int xml_xpath_selectsattributes(const char *xpath, char *errormessage, int Nerr)
 */
 int xml_xpath_isvalid(const char *xpath, char *errormessage, int Nerr)
 {
-    XMLDOC *doc = 0;
-    XMLNODE **nodes = 0;
-    int N;
-    int answer = 0;
+    XPATH *xp;
     
-    doc = xmldocfromstring("<root attr=\"true\">Fred</root>\n", 0, 0);
-    if (!doc)
-        goto out_of_memory;
-    nodes = xml_xpath_select(doc, xpath, &N, errormessage, Nerr);
-    if (!nodes)
-        answer = 0;
-    else
-        answer = 1;
-    free(nodes);
-    killxmldoc(doc);
-    
-    return answer;
+    xp = parsexpath(xpath, errormessage, Nerr);
+    if (!xp)
+        return 0;
+    killxpath(xp);
     
-out_of_memory:
-    free(nodes);
-    killxmldoc(doc);
-    return -1;
+    return 1;
 }
 
 /*
-    Given an node, get the XPath expression which selects it.
-    
-    Params: doc - the XML document
-            node - the node to test (Must be from the document)
-    Returns: the ath to the node
+    Compile an XPath expression.
  
-    Notes: it returns the path as "/bookstore/book/title", so the XPath expression
-        will select all siblings at the same level. It is aso quite an
-        expensive function as it requires a full traversal of the document tree.
+    Params: xpath - the xpath expression
+            errormessage - return buffer for error diagnostics
+            Nerr - size of the errormessage buffer.
+    Returns: the compiled expression, 0 on error.
+ 
+    Notes: the compiled expression is never modified by the query
+    functions, so it can be run against any number of documents, and
+    shared between threads. Destroy with killxpath().
  */
-char *xml_xpath_getnodepath(XMLDOC *doc, XMLNODE *node)
+XPATH *xml_xpath_compile(const char *xpath, char *errormessage, int Nerr)
 {
-    int maxlen;
-    int len;
-    char *answer = 0;
-    char *temp = 0;
-    
-    maxlen = pathdepth_r(doc->root);
-    answer = malloc(maxlen + 1);
-    if (!answer)
-        goto out_of_memory;
-    getnodepath_r(doc->root, answer, 0, node);
-    len = (int) strlen(answer);
-    temp = realloc(answer, len +1);
-    if (!temp)
-        goto out_of_memory;
-    answer = temp;
+    XPATH *xp;
     
-    return answer;
+    xp = parsexpath(xpath, errormessage, Nerr);
+    if (xp)
+        xp->serial = newserial();
     
-out_of_memory:
-    free(answer);
-    return 0;
+    return xp;
 }
 
-
-
-static HASHTABLE *inithashtablefromtree(XMLNODE *root)
+/*
+    Compile an expression without giving it an identity. The query
+    functions that compile, run and discard use it, so their results
+    never go in the result cache, where nothing could look them up.
+ */
+static XPATH *parsexpath(const char *xpath, char *errormessage, int Nerr)
 {
-    HASHTABLE *ht;
-    int N;
-
-    N = countnodes_r(root);
-    ht = inithashtable(N);
-    if (!ht)
+    LEXER lex;
+    XPATH *xp;
+    
+    initlexer(&lex, xpath);
+    xp = unionexpr(&lex);
+    if (haserror(&lex))
+    {
+        killxpath(xp);
+        xp = calloc(1, sizeof(XPATH));
+        if (!xp)
+            goto out_of_memory;
+        xp->source = mystrdup(xpath);
+        if (!xp->source)
+            goto out_of_memory;
+        xp->program = xpathvm_compile(xpath, errormessage, Nerr);
+        if (!xp->program)
+        {
+            killxpath(xp);
+            return 0;
+        }
+    }
+    if (!xp)
         goto out_of_memory;
-    fillhashtable_r(root, ht);
-    return ht;
+    if (errormessage)
+        errormessage[0] = 0;
+    
+    return xp;
     
 out_of_memory:
+    killxpath(xp);
+    if (errormessage)
+        snprintf(errormessage, Nerr, "Out of memory");
     return 0;
 }
 
-static XMLATTRIBUTE **getselectedattributes(XMLNODE *root, HASHTABLE *ht, int (*predicate)(XMLATTRIBUTE *attr, void *ptr), void *ptr)
+/*
+    Run a compiled XPath query.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+            Nselected - return for number of selected nodes
+    Returns: the selected nodes as a list, terminated with a NULL,
+    0 on out of memory.
+ 
+    Notes: if the document has a result cache, a repeated query
+    gets a copy of the stored list instead of being run again.
+ */
+XMLNODE **xml_xpath_exec(const XPATH *xp, XMLDOC *doc, int *Nselected)
 {
-    XMLATTRIBUTE *attr;
-    XMLATTRIBUTE **answer = 0;
-    XMLNODE **selnodes = 0;
-    int N;
-    int i;
-    
-    selnodes = getselectednodes(root, ht, &N);
-    if (!selnodes)
-        goto out_of_memory;
-    answer = malloc((N+1) * sizeof(XMLATTRIBUTE *));
-    if(!answer)
-        goto out_of_memory;
+    NODESET result = {0};
+    XMLNODE **answer;
+    int N = 0;
     
-    for (i = 0; selnodes[i]; i++)
+    if (doc->resultcache && xp->serial)
     {
-        attr = selnodes[i]->attributes;
-        while (attr)
+        answer = (XMLNODE **) xmldoc_getcachedresult(doc, xp->serial * 2, &N);
+        if (answer)
         {
-            if ((*predicate)(attr, ptr))
-            {
-                answer[i] = attr;
-                break;
-            }
-            attr = attr->next;
+            if (Nselected)
+                *Nselected = N;
+            return answer;
         }
     }
-    answer[N] = 0;
+    if (xp->program)
+        answer = xpathvm_selectnodes(xp->program, doc, 0, &N);
+    else
+    {
+        if (unite(xp, doc, 1, &result))
+            goto out_of_memory;
+        answer = getselectednodes(doc, &result, &N);
+    }
+    if (!answer)
+        goto out_of_memory;
+    /* a result the cache can't keep is still the answer */
+    if (xp->serial)
+        xmldoc_cacheresult(doc, xp->serial * 2, (void **) answer, N);
+    if (Nselected)
+        *Nselected = N;
     
-    free(selnodes);
-    return  answer;
+    return answer;
     
 out_of_memory:
-    free(selnodes);
-    free(answer);
+    free(result.nodes);
     return 0;
 }
 
-static XMLNODE **getselectednodes(XMLNODE *root, HASHTABLE *ht, int *Nret)
+/*
+    Run a compiled XPath query on several threads.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+            Nthreads - the number of threads to use
+            Nselected - return for number of selected nodes
+    Returns: the selected nodes as a list, terminated with a NULL,
+    0 on out of memory.
+ 
+    Notes: the result is exactly what xml_xpath_exec() gives. Descendant
+    steps over big subtrees, and child steps from big frontiers, are cut
+    into pieces in document order, and the pieces are shared out between
+    the threads, which steal from each other when they run out. Because
+    the pieces don't overlap, the results are merged by joining them up
+    in order. Other steps, and small searches, run on the calling thread.
+    If the library is built without XPATH_THREADS, it is the same as
+    xml_xpath_exec().
+ */
+XMLNODE **xml_xpath_execparallel(const XPATH *xp, XMLDOC *doc, int Nthreads, int *Nselected)
 {
-    int N;
+    NODESET result = {0};
     XMLNODE **answer;
     
-    N = countselectednodes_r(root, ht);
-    answer = malloc((N+1) * sizeof(XMLNODE *));
+    if (xp->program)
+        return xpathvm_selectnodes(xp->program, doc, 0, Nselected);
+    if (unite(xp, doc, Nthreads, &result))
+        goto out_of_memory;
+    answer = getselectednodes(doc, &result, Nselected);
     if (!answer)
         goto out_of_memory;
-    getselectednodes_r(root, ht, answer);
-    answer[N] = 0;
-    if (Nret)
-        *Nret = N;
+    
     return answer;
     
 out_of_memory:
+    free(result.nodes);
     return 0;
 }
 
-static void stepup_r(XMLNODE *node, HASHTABLE *ht)
+/*
+    Run a compiled XPath query which selects attributes.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+    Returns: the selected attributes as a list, terminated with a NULL,
+    0 on out of memory.
+ 
+    Notes: if the expression doesn't select attributes, the list is empty.
+ */
+XMLATTRIBUTE **xml_xpath_execattributes(const XPATH *xp, XMLDOC *doc)
 {
-    HASHCELL *cell;
-    XMLNODE *child;
-    HASHCELL *childcell;
-    
-    while (node)
-    {
-        cell = ht_get(ht, node);
-    
-        if (cell->deleted == 1)
-        {
-            if (node->child)
-            {
-                child = node->child;
-                while (child)
-                {
-                    childcell = ht_get(ht, child);
-                    if (childcell->deleted == 0)
-                    {
-                        cell->deleted = 0;
-                        break;
-                    }
-                    child = child->next;
-                }
-            }
-                
-            if (cell->deleted == 1 && node->child)
-                stepup_r(node->child, ht);
-        }
-        
-        node = node->next;
-    }
+    return xml_xpath_execattributes_len(xp, doc, 0);
 }
 
-static void stepdown_r(XMLNODE *node, HASHTABLE *ht)
+/*
+    Run a compiled XPath query which selects attributes, getting the
+    number of attributes back as well.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+            Nselected - return for number of selected attributes
+    Returns: the selected attributes as a list, terminated with a NULL,
+    0 on out of memory.
+ 
+    Notes: the attributes are picked straight off the nodes the path
+    reaches, with no list of the nodes made first.
+ */
+XMLATTRIBUTE **xml_xpath_execattributes_len(const XPATH *xp, XMLDOC *doc, int *Nselected)
 {
-    HASHCELL *cell;
+    XMLATTRIBUTE **answer = 0;
+    int N = 0;
     
-    while (node)
+    if (doc->resultcache && xp->serial)
+        answer = (XMLATTRIBUTE **) xmldoc_getcachedresult(doc, xp->serial * 2 + 1, &N);
+    if (answer)
     {
-        cell = ht_get(ht, node);
-        
-        if (cell->deleted == 0)
-            cell->deleted = 1;
-        else
-        {
-            if (node->child)
-                stepdown_r(node->child, ht);
-        }
-        
-        node = node->next;
+        if (Nselected)
+            *Nselected = N;
+        return answer;
     }
-}
-
-static void select_r(XMLNODE *node, HASHTABLE *ht, int (*predicate)(XMLNODE *node, void *ptr), void *ptr)
-{
-    HASHCELL *cell;
-    
+    if (xp->program)
+        answer = xpathvm_selectattributes(xp->program, doc, 0, &N);
+    else if (!selectsattributes(xp))
+        answer = calloc(1, sizeof(XMLATTRIBUTE *));
+    else if (xp->next)
+        answer = getunionattributes(xp, doc, &N);
+    else
+        answer = getpathattributes(xp, doc, &N);
+    if (!answer)
+        return 0;
+    /* a result the cache can't keep is still the answer */
+    if (xp->serial)
+        xmldoc_cacheresult(doc, xp->serial * 2 + 1, (void **) answer, N);
+    if (Nselected)
+        *Nselected = N;
+    
+    return answer;
+}
+
+/*
+    Run a compiled XPath query, passing each node to a function.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+            callback - function called for each node, in document order
+            ptr - context pointer passed to the callback
+    Returns: 0 on success, -1 on out of memory.
+ 
+    Notes: the callback returns non-zero to stop the search. Where the
+    query allows it, nodes are passed on as soon as they are found,
+    without building the whole list first.
+ */
+int xml_xpath_foreach(const XPATH *xp, XMLDOC *doc, int (*callback)(XMLNODE *node, void *ptr), void *ptr)
+{
+    return iterate(xp, doc, callback, ptr);
+}
+
+/*
+    Get the first node a compiled XPath query selects.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+    Returns: the first selected node in document order, 0 if none or
+    out of memory.
+ */
+XMLNODE *xml_xpath_execfirst(const XPATH *xp, XMLDOC *doc)
+{
+    XMLNODE *answer = 0;
+    
+    if (iterate(xp, doc, firstnode, &answer))
+        return 0;
+    
+    return answer;
+}
+
+/*
+    Count the nodes a compiled XPath query selects.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+    Returns: the number of nodes selected, -1 on out of memory.
+ */
+int xml_xpath_execcount(const XPATH *xp, XMLDOC *doc)
+{
+    int answer = 0;
+    
+    if (iterate(xp, doc, countnode, &answer))
+        return -1;
+    
+    return answer;
+}
+
+/*
+    Evaluate a compiled XPath expression as a number.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+            context - the context node, 0 for the document
+            result - return for the number
+    Returns: 0 on success, -1 on out of memory or a type error.
+ 
+    Notes: the result is converted as number() would, so a node-set
+    gives the value of its first node, and NaN if it is empty. Plain
+    location paths always start from the document.
+ */
+int xml_xpath_evalnumber(const XPATH *xp, XMLDOC *doc, XMLNODE *context, double *result)
+{
+    char *str;
+    
+    if (xp->program)
+        return xpathvm_evalnumber(xp->program, doc, context, result);
+    str = xml_xpath_evalstring(xp, doc, context);
+    if (!str)
+        return -1;
+    *result = xpathvm_number(str, (int) strlen(str));
+    free(str);
+    
+    return 0;
+}
+
+/*
+    Evaluate a compiled XPath expression as a boolean.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+            context - the context node, 0 for the document
+            result - return for the answer, 1 or 0
+    Returns: 0 on success, -1 on out of memory or a type error.
+ 
+    Notes: a node-set is true if it isn't empty.
+ */
+int xml_xpath_evalboolean(const XPATH *xp, XMLDOC *doc, XMLNODE *context, int *result)
+{
+    XMLNODE *first = 0;
+    
+    if (xp->program)
+        return xpathvm_evalboolean(xp->program, doc, context, result);
+    if (iterate(xp, doc, firstnode, &first))
+        return -1;
+    *result = first ? 1 : 0;
+    
+    return 0;
+}
+
+/*
+    Evaluate a compiled XPath expression as a string.
+ 
+    Params: xp - the compiled xpath
+            doc - the xml document
+            context - the context node, 0 for the document
+    Returns: the string, allocated with malloc(), 0 on out of memory or
+    a type error.
+ 
+    Notes: the result is converted as string() would, so a node-set
+    gives the text of its first node, with all the text nested under
+    it, or the empty string if there isn't one.
+ */
+char *xml_xpath_evalstring(const XPATH *xp, XMLDOC *doc, XMLNODE *context)
+{
+    XMLATTRIBUTE **attributes;
+    XMLNODE *first = 0;
+    char *answer;
+    
+    if (xp->program)
+        return xpathvm_evalstring(xp->program, doc, context);
+    if (selectsattributes(xp))
+    {
+        attributes = xml_xpath_execattributes(xp, doc);
+        if (!attributes)
+            return 0;
+        answer = mystrdup(attributes[0] ? attributes[0]->value : "");
+        free(attributes);
+        return answer;
+    }
+    if (iterate(xp, doc, firstnode, &first))
+        return 0;
+    if (!first)
+        return mystrdup("");
+    
+    return xml_getnesteddata(first);
+}
+
+/*
+    Compiled XPath destructor
+ */
+void killxpath(XPATH *xp)
+{
+    XPATH *next;
+    int i, j;
+    
+    while (xp)
+    {
+        next = xp->next;
+        for (i = 0; i < xp->Nsteps; i++)
+        {
+            for (j = 0; j < xp->steps[i].Npredicates; j++)
+            {
+                free(xp->steps[i].predicates[j].name);
+                free(xp->steps[i].predicates[j].value);
+            }
+            free(xp->steps[i].predicates);
+            free(xp->steps[i].name);
+        }
+        free(xp->steps);
+        free(xp->source);
+        killxpathprogram(xp->program);
+        free(xp);
+        xp = next;
+    }
+}
+
+/*
+    Compile a set of XPath expressions to run together.
+ 
+    Params: xps - the compiled expressions
+            N - the number of expressions
+    Returns: the set, 0 on out of memory.
+ 
+    Notes: the paths are merged into a single automaton, in the style of
+    YFilter, with the common prefixes shared, so a whole set of queries
+    can be run in one pass over the document. Queries the automaton
+    can't handle (those with .. or positional predicates) are run on
+    their own. The set keeps pointers to the expressions, so they must
+    outlive it.
+ */
+XPATHSET *xml_xpath_compileset(XPATH **xps, int N)
+{
+    XPATHSET *set;
+    NFASTATE *state;
+    const XPATHSTEP *step;
+    int i, j;
+    
+    set = malloc(sizeof(XPATHSET));
+    if (!set)
+        return 0;
+    set->xpaths = 0;
+    set->N = N;
+    set->states = 0;
+    set->Nstates = 0;
+    set->start = 0;
+    set->fallback = 0;
+    
+    set->xpaths = malloc((N + 1) * sizeof(XPATH *));
+    set->fallback = calloc(N + 1, sizeof(int));
+    if (!set->xpaths || !set->fallback)
+        goto out_of_memory;
+    memcpy(set->xpaths, xps, N * sizeof(XPATH *));
+    
+    set->start = nfa_newstate(set);
+    if (!set->start)
+        goto out_of_memory;
+    
+    for (i = 0; i < N; i++)
+    {
+        if (!nfa_canrun(xps[i]))
+        {
+            set->fallback[i] = 1;
+            continue;
+        }
+        state = set->start;
+        for (j = 0; j < xps[i]->Nsteps; j++)
+        {
+            step = &xps[i]->steps[j];
+            if (step->axis == AXIS_CHILD)
+                state = nfa_transition(set, state, step);
+            else if (step->axis == AXIS_DESCENDANT)
+            {
+                state = nfa_descendant(set, state);
+                if (state)
+                    state = nfa_transition(set, state, step);
+            }
+            else if (step->axis == AXIS_DESCENDANTORSELF)
+            {
+                /* followed by the attribute step, so accept here and below */
+                if (nfa_accept(state, i, &xps[i]->steps[j+1]))
+                    goto out_of_memory;
+                state = nfa_descendant(set, state);
+                if (state)
+                    state = nfa_transition(set, state, step);
+            }
+            else if (step->axis == AXIS_ATTRIBUTE)
+                break;
+            if (!state)
+                goto out_of_memory;
+        }
+        if (nfa_accept(state, i, j < xps[i]->Nsteps ? &xps[i]->steps[j] : 0))
+            goto out_of_memory;
+    }
+    if (nfa_buildtables(set))
+        goto out_of_memory;
+    
+    return set;
+    
+out_of_memory:
+    killxpathset(set);
+    return 0;
+}
+
+/*
+    Run a set of XPath expressions against a document, in one pass.
+ 
+    Params: set - the compiled set
+            doc - the xml document
+            results - return for the results, one list per expression
+            Nresults - return for the number selected by each (may be 0)
+    Returns: 0 on success, -1 on out of memory.
+ 
+    Notes: each result is a null-terminated list of nodes in document
+    order, exactly as xml_xpath_exec() would return, and must be freed.
+ */
+int xml_xpath_execset(const XPATHSET *set, XMLDOC *doc, XMLNODE ***results, int *Nresults)
+{
+    NFARUN run;
+    int i;
+    
+    run.active = 0;
+    run.N = 0;
+    run.capacity = 0;
+    run.stamp = 0;
+    run.results = 0;
+    run.err = 0;
+    
+    for (i = 0; i < set->N; i++)
+        results[i] = 0;
+    
+    run.stamp = calloc(set->Nstates, sizeof(int));
+    run.results = calloc(set->N + 1, sizeof(NODESET));
+    if (!run.stamp || !run.results)
+        goto out_of_memory;
+    
+    if (nfa_add(&run, set->start, -1))
+        goto out_of_memory;
+    nfa_run_r(set, doc->root, &run, 0, run.N);
+    if (run.err)
+        goto out_of_memory;
+    
+    for (i = 0; i < set->N; i++)
+    {
+        if (set->fallback[i])
+        {
+            results[i] = xml_xpath_exec(set->xpaths[i], doc, Nresults ? &Nresults[i] : 0);
+            if (!results[i])
+                goto out_of_memory;
+            continue;
+        }
+        if (Nresults)
+            Nresults[i] = run.results[i].N;
+        if (nodeset_add(&run.results[i], 0))
+            goto out_of_memory;
+        results[i] = run.results[i].nodes;
+        run.results[i].nodes = 0;
+    }
+    
+    free(run.active);
+    free(run.stamp);
+    free(run.results);
+    return 0;
+    
+out_of_memory:
+    for (i = 0; i < set->N; i++)
+    {
+        free(results[i]);
+        results[i] = 0;
+        if (run.results)
+            free(run.results[i].nodes);
+    }
+    free(run.active);
+    free(run.stamp);
+    free(run.results);
+    return -1;
+}
+
+/*
+    Run a set of XPath expressions over a file as it is parsed.
+ 
+    Params: set - the compiled set
+            fp - the file, opened for reading
+            callback - function called with each match and the query it matches
+            ptr - pointer passed to the callback
+            errormessage - return for parse errors
+            Nerr - size of the error buffer
+    Returns: 0 on success, -1 on error.
+ 
+    Notes: the whole document is never built. Each element is freed as soon
+    as it is complete, unless it or an ancestor is a match, so files much
+    larger than memory can be searched. Matches are passed to the callback
+    when their element closes, so inner matches come before outer ones,
+    with the subtree complete but the ancestors only partly read. Matches
+    for attribute queries like //a/@x are passed the element as soon as its
+    start tag is read. Nodes are freed after the callback returns, so they
+    must be copied if they are needed.
+    Only the forward subset of XPath can be streamed: child and descendant
+    steps, attribute steps and tests, and child tests on the last step.
+    Sets with any other queries are rejected.
+ */
+int xml_xpath_streamfile(const XPATHSET *set, FILE *fp, void (*callback)(XMLNODE *node, int query, void *ptr), void *ptr, char *errormessage, int Nerr)
+{
+    return nfa_stream(set, fp, 0, callback, ptr, errormessage, Nerr);
+}
+
+/*
+    Run a set of XPath expressions over a string as it is parsed.
+ 
+    Params: set - the compiled set
+            str - the XML document
+            callback - function called with each match and the query it matches
+            ptr - pointer passed to the callback
+            errormessage - return for parse errors
+            Nerr - size of the error buffer
+    Returns: 0 on success, -1 on error.
+ 
+    Notes: see xml_xpath_streamfile().
+ */
+int xml_xpath_streamstring(const XPATHSET *set, const char *str, void (*callback)(XMLNODE *node, int query, void *ptr), void *ptr, char *errormessage, int Nerr)
+{
+    return nfa_stream(set, 0, str, callback, ptr, errormessage, Nerr);
+}
+
+/*
+    XPath set destructor
+ */
+void killxpathset(XPATHSET *set)
+{
+    int i;
+    
+    if (set)
+    {
+        for (i = 0; i < set->Nstates; i++)
+        {
+            free(set->states[i]->transitions);
+            free(set->states[i]->accepts);
+            free(set->states[i]->table);
+            free(set->states[i]->others);
+            free(set->states[i]);
+        }
+        free(set->states);
+        free(set->xpaths);
+        free(set->fallback);
+        free(set);
+    }
+}
+
+/*
+    Given an node, get the XPath expression which selects it.
+    
+    Params: doc - the XML document
+            node - the node to test (Must be from the document)
+    Returns: the ath to the node
+ 
+    Notes: it returns the path as "/bookstore/book/title", so the XPath expression
+        will select all siblings at the same level. It walks up the parent
+        pointers, so the cost is proportional to the depth of the node.
+ */
+char *xml_xpath_getnodepath(XMLDOC *doc, XMLNODE *node)
+{
+    XMLNODE *ancestor;
+    int len = 0;
+    int taglen;
+    char *answer = 0;
+    
+    /* the parent links are enough, doc is kept for the API */
+    (void) doc;
+    for (ancestor = node; ancestor; ancestor = ancestor->parent)
+        len += (int) strlen(ancestor->tag) + 1;
+    answer = malloc(len + 1);
+    if (!answer)
+        goto out_of_memory;
+    answer[len] = 0;
+    for (ancestor = node; ancestor; ancestor = ancestor->parent)
+    {
+        taglen = (int) strlen(ancestor->tag);
+        len -= taglen + 1;
+        answer[len] = '/';
+        memcpy(answer + len + 1, ancestor->tag, taglen);
+    }
+    
+    return answer;
+    
+out_of_memory:
+    return 0;
+}
+
+/*
+    Given an node, get an XPath expression which selects it and only it.
+ 
+    Params: doc - the XML document
+            node - the node (Must be from the document)
+    Returns: the path to the node
+ 
+    Notes: it returns the path as "/bookstore/book[3]/title", with a position
+        on every step that has siblings of the same tag. The positions are
+        numbered once per document, so each call only walks up the parent
+        pointers.
+ */
+char *xml_xpath_getuniquenodepath(XMLDOC *doc, XMLNODE *node)
+{
+    XMLNODE *ancestor;
+    char buff[32];
+    int len = 0;
+    int taglen;
+    int poslen;
+    int position;
+    char *answer = 0;
+    
+    for (ancestor = node; ancestor; ancestor = ancestor->parent)
+    {
+        position = xmldoc_getsiblingposition(doc, ancestor);
+        if (position < 0)
+            goto out_of_memory;
+        len += (int) strlen(ancestor->tag) + 1;
+        if (position > 0)
+            len += snprintf(buff, sizeof(buff), "[%d]", position);
+    }
+    answer = malloc(len + 1);
+    if (!answer)
+        goto out_of_memory;
+    answer[len] = 0;
+    for (ancestor = node; ancestor; ancestor = ancestor->parent)
+    {
+        position = xmldoc_getsiblingposition(doc, ancestor);
+        poslen = position > 0 ? snprintf(buff, sizeof(buff), "[%d]", position) : 0;
+        len -= poslen;
+        memcpy(answer + len, buff, poslen);
+        taglen = (int) strlen(ancestor->tag);
+        len -= taglen + 1;
+        answer[len] = '/';
+        memcpy(answer + len + 1, ancestor->tag, taglen);
+    }
+    
+    return answer;
+    
+out_of_memory:
+    return 0;
+}
+
+/*
+    Start a fresh set of marks on the document.
+ 
+    Notes: the mark array is kept on the document and reused. Rather than
+    clear it, we bump the generation, so old marks are simply stale, and
+    only have to clear when the counter wraps. A frozen document is
+    shared between threads, so then each thread uses marks of its own.
+ */
+static int initmarks(XMLDOC *doc, MARKS *marks)
+{
+#ifdef XPATH_THREADS
+    if (doc->frozen)
+        return initthreadmarks(doc, marks);
+#endif
+    if (!doc->marks)
+    {
+        doc->marks = calloc(doc->Nnodes > 0 ? doc->Nnodes : 1, sizeof(unsigned int));
+        if (!doc->marks)
+            goto out_of_memory;
+        doc->markgeneration = 0;
+    }
+    doc->markgeneration++;
+    if (doc->markgeneration == 0)
+    {
+        memset(doc->marks, 0, (doc->Nnodes > 0 ? doc->Nnodes : 1) * sizeof(unsigned int));
+        doc->markgeneration = 1;
+    }
+    marks->mark = doc->marks;
+    marks->generation = doc->markgeneration;
+    
+    return 0;
+    
+out_of_memory:
+    return -1;
+}
+
+#ifdef XPATH_THREADS
+static pthread_key_t threadmarkskey;
+static pthread_once_t threadmarksonce = PTHREAD_ONCE_INIT;
+static int threadmarkserror = 0;
+
+/*
+    Marks for a query on a frozen document, from an array belonging to
+    the calling thread. The generation counts up across all the
+    documents the thread queries, so the array never has to be cleared
+    between them, only grown for a bigger document.
+ */
+static int initthreadmarks(XMLDOC *doc, MARKS *marks)
+{
+    THREADMARKS *scratch;
+    unsigned int *mark;
+    int size = doc->Nnodes > 0 ? doc->Nnodes : 1;
+    
+    pthread_once(&threadmarksonce, makethreadmarkskey);
+    if (threadmarkserror)
+        goto out_of_memory;
+    scratch = pthread_getspecific(threadmarkskey);
+    if (!scratch)
+    {
+        scratch = malloc(sizeof(THREADMARKS));
+        if (!scratch)
+            goto out_of_memory;
+        scratch->mark = 0;
+        scratch->capacity = 0;
+        scratch->generation = 0;
+        if (pthread_setspecific(threadmarkskey, scratch))
+        {
+            free(scratch);
+            goto out_of_memory;
+        }
+    }
+    if (scratch->capacity < size)
+    {
+        mark = calloc(size, sizeof(unsigned int));
+        if (!mark)
+            goto out_of_memory;
+        free(scratch->mark);
+        scratch->mark = mark;
+        scratch->capacity = size;
+        scratch->generation = 0;
+    }
+    scratch->generation++;
+    if (scratch->generation == 0)
+    {
+        memset(scratch->mark, 0, scratch->capacity * sizeof(unsigned int));
+        scratch->generation = 1;
+    }
+    marks->mark = scratch->mark;
+    marks->generation = scratch->generation;
+    
+    return 0;
+    
+out_of_memory:
+    return -1;
+}
+
+static void makethreadmarkskey(void)
+{
+    if (pthread_key_create(&threadmarkskey, killthreadmarks))
+        threadmarkserror = 1;
+}
+
+static void killthreadmarks(void *ptr)
+{
+    THREADMARKS *scratch = ptr;
+    
+    free(scratch->mark);
+    free(scratch);
+}
+#endif
+
+static int ismarked(MARKS *marks, XMLNODE *node)
+{
+    return marks->mark[node->preorder] == marks->generation;
+}
+
+static void setmark(MARKS *marks, XMLNODE *node)
+{
+    marks->mark[node->preorder] = marks->generation;
+}
+
+static void clearmark(MARKS *marks, XMLNODE *node)
+{
+    marks->mark[node->preorder] = 0;
+}
+
+/*
+    Run a compiled expression which may be a union.
+ 
+    Notes: each path gives its nodes in document order, so we merge
+    them in one pass, comparing preorder numbers and dropping the
+    nodes both sides have. No sort is needed.
+ */
+static int unite(const XPATH *xp, XMLDOC *doc, int Nthreads, NODESET *result)
+{
+    NODESET branch = {0};
+    NODESET merged = {0};
+    NODESET temp;
+    
+    if (execute(xp, doc, xp->Nsteps, Nthreads, result))
+        return -1;
+    for (xp = xp->next; xp; xp = xp->next)
+    {
+        if (execute(xp, doc, xp->Nsteps, Nthreads, &branch))
+            goto out_of_memory;
+        if (nodeset_merge(result, &branch, &merged))
+            goto out_of_memory;
+        temp = *result;
+        *result = merged;
+        merged = temp;
+        merged.N = 0;
+        branch.N = 0;
+    }
+    free(branch.nodes);
+    free(merged.nodes);
+    
+    return 0;
+    
+out_of_memory:
+    free(branch.nodes);
+    free(merged.nodes);
+    return -1;
+}
+
+/*
+    Run the first Nsteps steps of a compiled expression.
+ 
+    Params: xp - the compiled expression
+            doc - the document
+            Nsteps - the number of steps to run
+            Nthreads - threads to share big steps between, 1 for none
+            result - return for the selected nodes
+    Returns: 0 on success, -1 on out of memory.
+ 
+    Notes: the selection is held as a set of nodes in document order,
+    and each step maps it to the next set, so the cost is proportional
+    to the nodes the steps touch, not the size of the document.
+    The set starts off containing only the document node, which we
+    represent as a null, unless pickpivot() finds it cheaper to start
+    further down the path.
+ */
+static int execute(const XPATH *xp, XMLDOC *doc, int Nsteps, int Nthreads, NODESET *result)
+{
+    NODESET context = {0};
+    NODESET temp;
+    NODESINK sink;
+    int pivot;
+    int i;
+    
+    pivot = pickpivot(xp, doc, Nsteps);
+    if (pivot > 0)
+    {
+        if (pivotstep(xp, doc, pivot, &context))
+            goto out_of_memory;
+    }
+    else if (nodeset_add(&context, 0))
+        goto out_of_memory;
+    
+    for (i = pivot > 0 ? pivot + 1 : 0; i < Nsteps; i++)
+    {
+        result->N = 0;
+        sink.set = result;
+        sink.callback = 0;
+        sink.ptr = 0;
+#ifdef XPATH_THREADS
+        if (Nthreads > 1 && canparallel(doc, &xp->steps[i], &context))
+        {
+            if (parallelstep(doc, &xp->steps[i], &context, &sink, Nthreads))
+                goto out_of_memory;
+        }
+        else
+#endif
+        if (runstep(doc, &xp->steps[i], &context, &sink))
+            goto out_of_memory;
+        
+        temp = context;
+        context = *result;
+        *result = temp;
+    }
+    
+    temp = context;
+    context = *result;
+    *result = temp;
+    free(context.nodes);
+    
+    return 0;
+    
+out_of_memory:
+    free(context.nodes);
+    return -1;
+}
+
+/*
+    Choose where to start a path, from the document's tag counts.
+ 
+    Returns: the step to start from, or 0 to run the path from the top.
+ 
+    Notes: a path of child and descendant steps can also be run from
+    the bottom, by taking the nodes with one step's tag from the tag
+    index and checking that their ancestors match the steps above it.
+    Going down costs about as much as the nodes with each step's tag,
+    going up about the nodes with the pivot's tag times the steps we
+    check, so for //common/rare on a skewed document we start at rare.
+    Without a tag index there are no counts, and we don't guess.
+ */
+static int pickpivot(const XPATH *xp, XMLDOC *doc, int Nsteps)
+{
+    const XPATHSTEP *step;
+    double down = 0;
+    double up;
+    double best = -1;
+    int pivot = 0;
+    int count;
+    int i;
+    
+    if (xmldoc_tagcount(doc, 0) < 0 || !doc->root)
+        return 0;
+    for (i = 0; i < Nsteps; i++)
+    {
+        step = &xp->steps[i];
+        if (step->axis != AXIS_CHILD && step->axis != AXIS_DESCENDANT)
+            break;
+        if (step->positional)
+            break;
+        count = xmldoc_tagcount(doc, step->name);
+        down += count;
+        up = (double) count * (i + 1);
+        if (i > 0 && step->name && up < down && (best < 0 || up < best))
+        {
+            best = up;
+            pivot = i;
+        }
+    }
+    
+    return pivot;
+}
+
+/*
+    Run the steps up to the pivot from the bottom. The pivot's tag
+    list is in document order, so what passes is too.
+ */
+static int pivotstep(const XPATH *xp, XMLDOC *doc, int pivot, NODESET *result)
+{
+    XMLNODE **nodes;
+    int N;
+    int i;
+    int j = 0;
+    
+    nodes = xmldoc_getdescendants(doc, doc->root, xp->steps[pivot].name, &N);
+    if (!nodes)
+    {
+        if (N < 0)
+            return -1;
+        result->N = 0;
+        return 0;
+    }
+    for (i = 0; i < N; i++)
+        if (matchupwards(xp->steps, pivot, nodes[i]))
+            nodes[j++] = nodes[i];
+    free(result->nodes);
+    result->nodes = nodes;
+    result->N = j;
+    result->capacity = N;
+    
+    return 0;
+}
+
+/*
+    Test whether a node is selected by the steps up to last, looking
+    at its ancestors.
+ 
+    Returns: the node, or 0 if it isn't selected.
+ 
+    Notes: the steps split into runs which start with a descendant step
+    and continue with child steps. Each run has to match a chain of
+    parents, and the chains must come one above another. We fit the
+    runs from the bottom, each one as low as it will go, which leaves
+    the most room for the runs above, so we never have to go back.
+    A path which starts with a child step has its first run pinned to
+    the root.
+ */
+static XMLNODE *matchupwards(const XPATHSTEP *steps, int last, XMLNODE *node)
+{
+    XMLNODE *top;
+    XMLNODE *ancestor;
+    int first;
+    
+    first = last;
+    while (first > 0 && steps[first].axis == AXIS_CHILD)
+        first--;
+    top = matchsegment(steps, first, last, node);
+    
+    while (top)
+    {
+        if (first == 0)
+            return steps[0].axis == AXIS_CHILD && top->parent ? 0 : node;
+        last = first - 1;
+        first = last;
+        while (first > 0 && steps[first].axis == AXIS_CHILD)
+            first--;
+        for (ancestor = top->parent; ancestor; ancestor = ancestor->parent)
+        {
+            top = matchsegment(steps, first, last, ancestor);
+            if (top && (first > 0 || steps[0].axis != AXIS_CHILD || !top->parent))
+                break;
+        }
+        if (!ancestor)
+            return 0;
+    }
+    
+    return 0;
+}
+
+/*
+    Match a run of child steps to a node and its parents.
+ 
+    Returns: the node matched by the first step, 0 if they don't match.
+ */
+static XMLNODE *matchsegment(const XPATHSTEP *steps, int first, int last, XMLNODE *node)
+{
+    XMLNODE *top = 0;
+    int i;
+    
+    for (i = last; i >= first; i--)
+    {
+        if (!node || !matchstep(node, (void *) &steps[i]) || !matchpredicates(&steps[i], node))
+            return 0;
+        top = node;
+        node = node->parent;
+    }
+    
+    return top;
+}
+
+/*
+    Run a compiled expression, passing the nodes to a callback.
+ 
+    Notes: where we can, the last step is evaluated lazily, with the
+    nodes passed on as they are found, so stopping early saves the
+    rest of the search. Child steps from nested context nodes and
+    parent steps have to be sorted, and positional predicates use the
+    document marks, so there we build the set first.
+ */
+static int iterate(const XPATH *xp, XMLDOC *doc, int (*callback)(XMLNODE *node, void *ptr), void *ptr)
+{
+    NODESET context = {0};
+    NODESET result = {0};
+    NODESINK sink;
+    const XPATHSTEP *last;
+    XMLNODE **nodes;
+    int err;
+    int i;
+    
+    if (xp->program)
+    {
+        nodes = xpathvm_selectnodes(xp->program, doc, 0, 0);
+        if (!nodes)
+            goto out_of_memory;
+        for (i = 0; nodes[i]; i++)
+            if ((*callback)(nodes[i], ptr))
+                break;
+        free(nodes);
+        return 0;
+    }
+    if (xp->next)
+    {
+        if (unite(xp, doc, 1, &result))
+            goto out_of_memory;
+        deliver(doc, &result, callback, ptr);
+        free(result.nodes);
+        return 0;
+    }
+    if (xp->Nsteps == 0)
+    {
+        if (doc->root)
+            (*callback)(doc->root, ptr);
+        return 0;
+    }
+    
+    if (pickpivot(xp, doc, xp->Nsteps) == xp->Nsteps - 1)
+    {
+        if (execute(xp, doc, xp->Nsteps, 1, &result))
+            goto out_of_memory;
+        deliver(doc, &result, callback, ptr);
+        free(result.nodes);
+        return 0;
+    }
+    
+    last = &xp->steps[xp->Nsteps-1];
+    if (execute(xp, doc, xp->Nsteps - 1, 1, &context))
+        goto out_of_memory;
+    
+    if (last->axis == AXIS_PARENT || last->positional || (last->axis == AXIS_CHILD && isnested(&context)))
+    {
+        sink.set = &result;
+        sink.callback = 0;
+        sink.ptr = 0;
+        if (runstep(doc, last, &context, &sink))
+            goto out_of_memory;
+        deliver(doc, &result, callback, ptr);
+    }
+    else
+    {
+        sink.set = 0;
+        sink.callback = callback;
+        sink.ptr = ptr;
+        err = runstep(doc, last, &context, &sink);
+        if (err < 0)
+            goto out_of_memory;
+    }
+    
+    free(context.nodes);
+    free(result.nodes);
+    return 0;
+    
+out_of_memory:
+    free(context.nodes);
+    free(result.nodes);
+    return -1;
+}
+
+/*
+    Pass a set of nodes to a callback, with the document node as the
+    root, until the callback asks to stop.
+ */
+static int deliver(XMLDOC *doc, NODESET *set, int (*callback)(XMLNODE *node, void *ptr), void *ptr)
+{
+    int i;
+    
+    for (i = 0; i < set->N; i++)
+    {
+        if (set->nodes[i] == 0)
+        {
+            if (set->N > 1 && set->nodes[1] == doc->root)
+                continue;
+            if (!doc->root)
+                continue;
+            if ((*callback)(doc->root, ptr))
+                return 1;
+        }
+        else if ((*callback)(set->nodes[i], ptr))
+            return 1;
+    }
+    
+    return 0;
+}
+
+/*
+    Run one step, sending the nodes it selects to the sink.
+    Returns: 0 on success, -1 on out of memory, 1 if the sink asked to stop.
+ */
+static int runstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink)
+{
+    if (step->axis == AXIS_CHILD)
+        return childstep(doc, step, context, sink);
+    else if (step->axis == AXIS_DESCENDANT)
+        return descendantstep(doc, step, context, sink, 0);
+    else if (step->axis == AXIS_DESCENDANTORSELF)
+        return descendantstep(doc, step, context, sink, 1);
+    else if (step->axis == AXIS_PARENT)
+        return parentstep(doc, step, context, sink);
+    else if (step->axis == AXIS_ATTRIBUTE)
+        return attributestep(step, context, sink);
+    
+    return 0;
+}
+
+/*
+    child::name. If the context nodes are nested, the children can come
+    out of order, so we sort them, which is rare. Positional predicates
+    count along the children of each context node.
+ */
+static int childstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink)
+{
+    MARKS marks;
+    XMLNODE *child;
+    int sorted = 1;
+    int err;
+    int i;
+    
+    if (step->positional && initmarks(doc, &marks))
+        return -1;
+    
+    for (i = 0; i < context->N; i++)
+    {
+        child = context->nodes[i] ? context->nodes[i]->child : doc->root;
+        if (step->positional)
+            selectsiblings(&marks, step, child);
+        for (; child; child = child->next)
+        {
+            if (step->positional ? ismarked(&marks, child) : matchstep(child, (void *) step))
+            {
+                if (sink->set && sink->set->N > 0 && sink->set->nodes[sink->set->N-1]->preorder > child->preorder)
+                    sorted = 0;
+                err = emit(sink, step, child);
+                if (err)
+                    return err;
+            }
+        }
+    }
+    if (!sorted)
+        nodeset_sort(sink->set);
+    
+    return 0;
+}
+
+/*
+    descendant::name, or descendant-or-self::node() if includeself is set.
+ 
+    Notes: a context node inside the subtree of the one before it
+    has been covered already, so we skip it. That keeps the results in
+    document order and without duplicates. A step with an
+    [@attr='value'] predicate looks the value up in the document's
+    attribute index instead of walking the subtree. Otherwise, if the
+    document has a tag index, we join the context nodes against the
+    tag's postings: the descendants of a node are the postings whose
+    preorder numbers fall between the node's preorder and subtreeend,
+    so each context node costs a binary search.
+ */
+static int descendantstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink, int includeself)
+{
+    MARKS marks;
+    MARKS *positional = 0;
+    const XPATHPREDICATE *pred;
+    XMLNODE *node;
+    int joined = 0;
+    int end = -1;
+    int err;
+    int i;
+    
+    pred = indexedpredicate(step);
+    if (pred && xmldoc_buildattributeindex(doc, pred->name))
+        return -1;
+    if (!step->positional && step->name && xmldoc_tagcount(doc, 0) >= 0)
+        joined = 1;
+    if (step->positional)
+    {
+        if (initmarks(doc, &marks))
+            return -1;
+        positional = &marks;
+    }
+    
+    for (i = 0; i < context->N; i++)
+    {
+        node = context->nodes[i];
+        if (!node)
+        {
+            if (pred || joined)
+                return indexeddescendants(doc, doc->root, 1, step, pred, sink);
+            return descendants_r(doc->root, step, positional, sink);
+        }
+        if (node->preorder <= end)
+            continue;
+        end = node->subtreeend;
+        if (pred || joined)
+        {
+            err = indexeddescendants(doc, node, includeself, step, pred, sink);
+            if (err)
+                return err;
+            continue;
+        }
+        if (includeself && matchstep(node, (void *) step))
+        {
+            err = emit(sink, step, node);
+            if (err)
+                return err;
+        }
+        err = descendants_r(node->child, step, positional, sink);
+        if (err)
+            return err;
+    }
+    
+    return 0;
+}
+
+/*
+    Walk the subtrees, passing on the nodes which match the step.
+    marks is 0 unless the step has positional predicates. We don't go
+    into a subtree whose tag filter says the name isn't there.
+ */
+static int descendants_r(XMLNODE *node, const XPATHSTEP *step, MARKS *marks, NODESINK *sink)
+{
+    int err;
+    
+    if (marks)
+        selectsiblings(marks, step, node);
     while (node)
     {
-        cell = ht_get(ht, node);
-        if (cell->deleted == 0)
+        if (marks ? ismarked(marks, node) : matchstep(node, (void *) step))
+        {
+            err = emit(sink, step, node);
+            if (err)
+                return err;
+        }
+        if (node->child && xml_maycontaintag(node, step->tagfilter))
+        {
+            err = descendants_r(node->child, step, marks, sink);
+            if (err)
+                return err;
+        }
+        node = node->next;
+    }
+    
+    return 0;
+}
+
+/*
+    Pass on the nodes under node which match the step, from the
+    document's indexes. If pred is set, we use the attribute index to
+    find the nodes with the value it asks for, otherwise the tag index.
+ */
+static int indexeddescendants(XMLDOC *doc, XMLNODE *node, int includeself, const XPATHSTEP *step, const XPATHPREDICATE *pred, NODESINK *sink)
+{
+    XMLNODE **nodes;
+    int N;
+    int err = 0;
+    int i;
+    
+    if (pred)
+        nodes = xmldoc_getnodesbyattribute(doc, node, pred->name, pred->value, &N);
+    else
+        nodes = xmldoc_getdescendants(doc, node, step->name, &N);
+    if (N < 0)
+        return -1;
+    for (i = 0; i < N; i++)
+    {
+        if (nodes[i] == node && !includeself)
+            continue;
+        if (!matchstep(nodes[i], (void *) step))
+            continue;
+        err = emit(sink, step, nodes[i]);
+        if (err)
+            break;
+    }
+    free(nodes);
+    
+    return err;
+}
+
+/*
+    Get an [@attr='value'] predicate we can look up in the index.
+ */
+static const XPATHPREDICATE *indexedpredicate(const XPATHSTEP *step)
+{
+    int i;
+    
+    if (step->positional)
+        return 0;
+    for (i = 0; i < step->Npredicates; i++)
+        if (step->predicates[i].type == PREDICATE_ATTRIBUTEEQUALS)
+            return &step->predicates[i];
+    
+    return 0;
+}
+
+#ifdef XPATH_THREADS
+/*
+    Test whether a step is big enough to be worth running in parallel.
+ 
+    Notes: positional predicates use the document marks, and the indexed
+    searches are fast anyway, so we leave those alone.
+ */
+static int canparallel(XMLDOC *doc, const XPATHSTEP *step, NODESET *context)
+{
+    double work = 0;
+    int end = -1;
+    int i;
+    
+    if (step->positional || context->N == 0)
+        return 0;
+    if (step->axis == AXIS_DESCENDANT || step->axis == AXIS_DESCENDANTORSELF)
+    {
+        if (indexedpredicate(step) || (step->name && xmldoc_tagcount(doc, 0) >= 0))
+            return 0;
+        for (i = 0; i < context->N; i++)
+        {
+            if (!context->nodes[i])
+                return doc->Nnodes >= PARALLEL_MINNODES;
+            if (context->nodes[i]->preorder <= end)
+                continue;
+            end = context->nodes[i]->subtreeend;
+            work += end - context->nodes[i]->preorder + 1;
+        }
+        return work >= PARALLEL_MINNODES;
+    }
+    if (step->axis == AXIS_CHILD)
+        return context->N >= PARALLEL_MINCONTEXT && context->nodes[0] && !isnested(context);
+    
+    return 0;
+}
+
+/*
+    Run a descendant or child step with a pool of threads.
+    Returns: 0 on success, -1 on out of memory.
+ 
+    Notes: big subtrees are split into the top node on its own, then the
+    children's subtrees, until the pieces are small, so the list of tasks
+    is in document order and the tasks select disjoint runs of nodes.
+    Each thread starts on its own block of tasks and steals from the end
+    of the others' blocks. A child step needs context nodes which aren't
+    nested, so the children of each block come out in order too.
+ */
+static int parallelstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink, int Nthreads)
+{
+    WORKPOOL pool;
+    WORKER *workers = 0;
+    pthread_t *threads = 0;
+    XPATHTASK *tasks = 0;
+    XMLNODE *node;
+    XMLNODE *child;
+    int Ntasks = 0;
+    int capacity = 0;
+    int Nstarted = 0;
+    double work = 0;
+    int grain;
+    int chunk;
+    int end = -1;
+    int total;
+    int err = 0;
+    int i;
+    
+    pool.queues = 0;
+    pool.Nqueues = 0;
+    
+    if (step->axis == AXIS_CHILD)
+    {
+        chunk = (context->N + Nthreads * PARALLEL_TASKSPERTHREAD - 1) / (Nthreads * PARALLEL_TASKSPERTHREAD);
+        for (i = 0; i < context->N; i += chunk)
+        {
+            if (addtask(&tasks, &Ntasks, &capacity, TASK_CHILDREN, 0))
+                goto out_of_memory;
+            tasks[Ntasks-1].context = context->nodes + i;
+            tasks[Ntasks-1].Ncontext = context->N - i < chunk ? context->N - i : chunk;
+        }
+    }
+    else
+    {
+        for (i = 0; i < context->N; i++)
+        {
+            if (!context->nodes[i])
+            {
+                work = doc->Nnodes;
+                break;
+            }
+            if (context->nodes[i]->preorder <= end)
+                continue;
+            end = context->nodes[i]->subtreeend;
+            work += end - context->nodes[i]->preorder + 1;
+        }
+        grain = (int) (work / (Nthreads * PARALLEL_TASKSPERTHREAD));
+        if (grain < 1024)
+            grain = 1024;
+        end = -1;
+        for (i = 0; i < context->N; i++)
+        {
+            node = context->nodes[i];
+            if (!node)
+            {
+                if (splitsubtree_r(doc->root, grain, &tasks, &Ntasks, &capacity))
+                    goto out_of_memory;
+                break;
+            }
+            if (node->preorder <= end)
+                continue;
+            end = node->subtreeend;
+            if (step->axis == AXIS_DESCENDANTORSELF && addtask(&tasks, &Ntasks, &capacity, TASK_NODE, node))
+                goto out_of_memory;
+            for (child = node->child; child; child = child->next)
+                if (splitsubtree_r(child, grain, &tasks, &Ntasks, &capacity))
+                    goto out_of_memory;
+        }
+    }
+    
+    if (Nthreads > Ntasks)
+        Nthreads = Ntasks;
+    pool.step = step;
+    pool.tasks = tasks;
+    pool.queues = malloc(Nthreads * sizeof(WORKQUEUE));
+    workers = malloc(Nthreads * sizeof(WORKER));
+    threads = malloc(Nthreads * sizeof(pthread_t));
+    if (!pool.queues || !workers || !threads)
+        goto out_of_memory;
+    for (i = 0; i < Nthreads; i++)
+    {
+        pthread_mutex_init(&pool.queues[i].lock, 0);
+        pool.queues[i].head = (int) ((long long) Ntasks * i / Nthreads);
+        pool.queues[i].tail = (int) ((long long) Ntasks * (i + 1) / Nthreads);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+    pool.Nqueues = Nthreads;
+    
+    /* if a thread won't start, the others steal its work */
+    for (i = 1; i < Nthreads; i++)
+    {
+        if (pthread_create(&threads[i], 0, worker, &workers[i]))
+            break;
+        Nstarted++;
+    }
+    worker(&workers[0]);
+    for (i = 1; i <= Nstarted; i++)
+        pthread_join(threads[i], 0);
+    
+    total = sink->set->N;
+    for (i = 0; i < Ntasks; i++)
+    {
+        if (tasks[i].err)
+            goto out_of_memory;
+        total += tasks[i].result.N;
+    }
+    if (total > sink->set->capacity)
+    {
+        XMLNODE **temp = realloc(sink->set->nodes, total * sizeof(XMLNODE *));
+        if (!temp)
+            goto out_of_memory;
+        sink->set->nodes = temp;
+        sink->set->capacity = total;
+    }
+    for (i = 0; i < Ntasks; i++)
+    {
+        if (tasks[i].result.N == 0)
+            continue;
+        memcpy(sink->set->nodes + sink->set->N, tasks[i].result.nodes, tasks[i].result.N * sizeof(XMLNODE *));
+        sink->set->N += tasks[i].result.N;
+    }
+    goto done;
+    
+out_of_memory:
+    err = -1;
+done:
+    for (i = 0; i < pool.Nqueues; i++)
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    for (i = 0; i < Ntasks; i++)
+        free(tasks[i].result.nodes);
+    free(tasks);
+    free(pool.queues);
+    free(workers);
+    free(threads);
+    return err;
+}
+
+/*
+    Cut a subtree into tasks of no more than about grain nodes.
+ */
+static int splitsubtree_r(XMLNODE *node, int grain, XPATHTASK **tasks, int *N, int *capacity)
+{
+    XMLNODE *child;
+    
+    if (node->subtreeend - node->preorder < grain)
+        return addtask(tasks, N, capacity, TASK_SUBTREE, node);
+    if (addtask(tasks, N, capacity, TASK_NODE, node))
+        return -1;
+    for (child = node->child; child; child = child->next)
+        if (splitsubtree_r(child, grain, tasks, N, capacity))
+            return -1;
+    
+    return 0;
+}
+
+static int addtask(XPATHTASK **tasks, int *N, int *capacity, int type, XMLNODE *node)
+{
+    XPATHTASK *temp;
+    XPATHTASK *task;
+    
+    if (*N == *capacity)
+    {
+        temp = realloc(*tasks, (*capacity ? *capacity * 2 : 64) * sizeof(XPATHTASK));
+        if (!temp)
+            return -1;
+        *tasks = temp;
+        *capacity = *capacity ? *capacity * 2 : 64;
+    }
+    task = &(*tasks)[(*N)++];
+    task->type = type;
+    task->node = node;
+    task->context = 0;
+    task->Ncontext = 0;
+    task->result.nodes = 0;
+    task->result.N = 0;
+    task->result.capacity = 0;
+    task->err = 0;
+    
+    return 0;
+}
+
+static void *worker(void *ptr)
+{
+    WORKER *w = ptr;
+    int i;
+    
+    while ((i = takework(w->pool, w->id)) >= 0)
+        runtask(w->pool->step, &w->pool->tasks[i]);
+    
+    return 0;
+}
+
+/*
+    Get the next task from our own queue, or steal one from the back
+    of another. Returns -1 when there is nothing left.
+ */
+static int takework(WORKPOOL *pool, int id)
+{
+    WORKQUEUE *queue;
+    int answer = -1;
+    int i;
+    
+    for (i = 0; i < pool->Nqueues && answer < 0; i++)
+    {
+        queue = &pool->queues[(id + i) % pool->Nqueues];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail)
+        {
+            if (i == 0)
+                answer = queue->head++;
+            else
+                answer = --queue->tail;
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    
+    return answer;
+}
+
+/*
+    Run one piece of a step. Only reads the tree, so tasks can run at
+    the same time.
+ */
+static void runtask(const XPATHSTEP *step, XPATHTASK *task)
+{
+    NODESINK sink;
+    XMLNODE *child;
+    int err = 0;
+    int i;
+    
+    sink.set = &task->result;
+    sink.callback = 0;
+    sink.ptr = 0;
+    
+    if (task->type == TASK_CHILDREN)
+    {
+        for (i = 0; i < task->Ncontext && !err; i++)
+        {
+            for (child = task->context[i]->child; child && !err; child = child->next)
+                if (matchstep(child, (void *) step))
+                    err = emit(&sink, step, child);
+        }
+    }
+    else
+    {
+        if (matchstep(task->node, (void *) step))
+            err = emit(&sink, step, task->node);
+        if (!err && task->type == TASK_SUBTREE && task->node->child)
+            err = descendants_r(task->node->child, step, 0, &sink);
+    }
+    task->err = err;
+}
+#endif
+
+/*
+    parent::node(). Siblings share a parent, so we use the marks to
+    throw out the duplicates. Always collects into a set.
+ */
+static int parentstep(XMLDOC *doc, const XPATHSTEP *step, NODESET *context, NODESINK *sink)
+{
+    MARKS marks;
+    XMLNODE *parent;
+    NODESET *result = sink->set;
+    int hasdocument = 0;
+    int sorted = 1;
+    int i;
+    
+    if (initmarks(doc, &marks))
+        return -1;
+    
+    for (i = 0; i < context->N; i++)
+    {
+        if (!context->nodes[i])
+            continue;
+        parent = context->nodes[i]->parent;
+        if (!parent)
+        {
+            hasdocument = step->Npredicates == 0;
+            continue;
+        }
+        if (ismarked(&marks, parent))
+            continue;
+        setmark(&marks, parent);
+        if (!matchpredicates(step, parent))
+            continue;
+        if (result->N > 0 && result->nodes[result->N-1]->preorder > parent->preorder)
+            sorted = 0;
+        if (nodeset_add(result, parent))
+            return -1;
+    }
+    if (!sorted)
+        nodeset_sort(result);
+    if (hasdocument)
+    {
+        if (nodeset_add(result, 0))
+            return -1;
+        memmove(result->nodes + 1, result->nodes, (result->N - 1) * sizeof(XMLNODE *));
+        result->nodes[0] = 0;
+    }
+    
+    return 0;
+}
+
+/*
+    Keep the context nodes which have the attribute.
+ */
+static int attributestep(const XPATHSTEP *step, NODESET *context, NODESINK *sink)
+{
+    int err;
+    int i;
+    
+    for (i = 0; i < context->N; i++)
+    {
+        if (context->nodes[i] && matchattribute(context->nodes[i], (void *) step))
+        {
+            err = emit(sink, step, context->nodes[i]);
+            if (err)
+                return err;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+    Pass a node which a step has selected on to the sink, if it passes
+    the step's predicates. (Positional predicates have been applied
+    already, by selectsiblings()).
+    Returns: 0 to continue, -1 on out of memory, 1 to stop.
+ */
+static int emit(NODESINK *sink, const XPATHSTEP *step, XMLNODE *node)
+{
+    if (!step->positional && !matchpredicates(step, node))
+        return 0;
+    if (sink->callback)
+        return (*sink->callback)(node, sink->ptr) ? 1 : 0;
+    return nodeset_add(sink->set, node);
+}
+
+/*
+    Test the predicates which can be decided from the start tag alone.
+ */
+static int matchattributepredicates(const XPATHSTEP *step, XMLNODE *node)
+{
+    int i;
+    
+    for (i = 0; i < step->Npredicates; i++)
+    {
+        if (step->predicates[i].type == PREDICATE_HASATTRIBUTE ||
+            step->predicates[i].type == PREDICATE_ATTRIBUTEEQUALS)
+        {
+            if (!matchpredicate(&step->predicates[i], node))
+                return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/*
+    Test a node against all a step's predicates.
+ 
+    Notes: this is for nodes which are alone on their axis, such as a
+    parent, so position() and last() are both 1.
+ */
+static int matchpredicates(const XPATHSTEP *step, XMLNODE *node)
+{
+    int i;
+    
+    for (i = 0; i < step->Npredicates; i++)
+    {
+        if (step->predicates[i].type == PREDICATE_POSITION)
+        {
+            if (step->predicates[i].position != 1)
+                return 0;
+        }
+        else if (step->predicates[i].type != PREDICATE_LAST)
+        {
+            if (!matchpredicate(&step->predicates[i], node))
+                return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/*
+    Test a node against one predicate which doesn't depend on position.
+ */
+static int matchpredicate(const XPATHPREDICATE *pred, XMLNODE *node)
+{
+    XMLNODE *child;
+    const char *value;
+    int len;
+    
+    switch (pred->type)
+    {
+        case PREDICATE_HASCHILD:
+            return matchhaschild(node, pred->name);
+        case PREDICATE_HASANYCHILD:
+            return matchhasanychild(node, 0);
+        case PREDICATE_HASATTRIBUTE:
+            return xml_getattributebykey(node, pred->name, pred->key) ? 1 : 0;
+        case PREDICATE_ATTRIBUTEEQUALS:
+            value = xml_getattributebykey(node, pred->name, pred->key);
+            return value && !strcmp(value, pred->value);
+        case PREDICATE_CHILDEQUALS:
+            len = (int) strlen(pred->value);
+            for (child = node->child; child; child = child->next)
+            {
+                if (!strcmp(child->tag, pred->name) && child->datalen == len &&
+                    !memcmp(child->data, pred->value, len))
+                    return 1;
+            }
+            return 0;
+    }
+    
+    return 1;
+}
+
+/*
+    Mark the nodes in a chain of siblings which pass the step, applying
+    the predicates in turn, so [@x][2] is the second of the siblings
+    with an x attribute.
+ */
+static void selectsiblings(MARKS *marks, const XPATHSTEP *step, XMLNODE *first)
+{
+    const XPATHPREDICATE *pred;
+    XMLNODE *node;
+    int position;
+    int last = 0;
+    int i;
+    
+    for (node = first; node; node = node->next)
+    {
+        if (matchstep(node, (void *) step))
+            setmark(marks, node);
+    }
+    
+    for (i = 0; i < step->Npredicates; i++)
+    {
+        pred = &step->predicates[i];
+        if (pred->type == PREDICATE_POSITION || pred->type == PREDICATE_LAST)
+        {
+            if (pred->type == PREDICATE_LAST)
+            {
+                last = 0;
+                for (node = first; node; node = node->next)
+                    if (ismarked(marks, node))
+                        last++;
+            }
+            position = 0;
+            for (node = first; node; node = node->next)
+            {
+                if (!ismarked(marks, node))
+                    continue;
+                position++;
+                if (position != (pred->type == PREDICATE_LAST ? last : pred->position))
+                    clearmark(marks, node);
+            }
+        }
+        else
+        {
+            for (node = first; node; node = node->next)
+            {
+                if (ismarked(marks, node) && !matchpredicate(pred, node))
+                    clearmark(marks, node);
+            }
+        }
+    }
+}
+
+/*
+    Is any node in the set inside the subtree of an earlier one?
+ */
+static int isnested(NODESET *set)
+{
+    int end = -1;
+    int i;
+    
+    for (i = 0; i < set->N; i++)
+    {
+        if (!set->nodes[i])
+            return set->N > 1;
+        if (set->nodes[i]->preorder <= end)
+            return 1;
+        if (set->nodes[i]->subtreeend > end)
+            end = set->nodes[i]->subtreeend;
+    }
+    
+    return 0;
+}
+
+static int nodeset_add(NODESET *set, XMLNODE *node)
+{
+    XMLNODE **temp;
+    int capacity;
+    
+    if (set->N == set->capacity)
+    {
+        capacity = set->capacity ? set->capacity * 2 : 16;
+        temp = realloc(set->nodes, capacity * sizeof(XMLNODE *));
+        if (!temp)
+            return -1;
+        set->nodes = temp;
+        set->capacity = capacity;
+    }
+    set->nodes[set->N++] = node;
+    
+    return 0;
+}
+
+/*
+    Merge two sets in document order into result, without duplicates.
+ */
+static int nodeset_merge(NODESET *a, NODESET *b, NODESET *result)
+{
+    int i = 0;
+    int j = 0;
+    int cmp;
+    
+    result->N = 0;
+    while (i < a->N || j < b->N)
+    {
+        if (i == a->N)
+            cmp = 1;
+        else if (j == b->N)
+            cmp = -1;
+        else
+            cmp = comparenodes(a->nodes[i], b->nodes[j]);
+        if (cmp <= 0)
+        {
+            if (nodeset_add(result, a->nodes[i]))
+                return -1;
+            if (cmp == 0)
+                j++;
+            i++;
+        }
+        else
+        {
+            if (nodeset_add(result, b->nodes[j++]))
+                return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+    Compare nodes in document order. The document node (0) comes first.
+ */
+static int comparenodes(XMLNODE *a, XMLNODE *b)
+{
+    int pa = a ? a->preorder : -1;
+    int pb = b ? b->preorder : -1;
+    
+    return pa < pb ? -1 : pa > pb ? 1 : 0;
+}
+
+static void nodeset_sort(NODESET *set)
+{
+    qsort(set->nodes, set->N, sizeof(XMLNODE *), compareorder);
+}
+
+static int countnode(XMLNODE *node, void *ptr)
+{
+    int *N = ptr;
+    
+    (*N)++;
+    return 0;
+}
+
+static int firstnode(XMLNODE *node, void *ptr)
+{
+    XMLNODE **answer = ptr;
+    
+    *answer = node;
+    return 1;
+}
+
+static int compareorder(const void *e1, const void *e2)
+{
+    XMLNODE *const *a = e1;
+    XMLNODE *const *b = e2;
+    
+    return (*a)->preorder - (*b)->preorder;
+}
+
+/*
+    Convert the final set to the null-terminated list we return.
+    The document node is reported as the root, as "/" selects the root.
+ */
+static XMLNODE **getselectednodes(XMLDOC *doc, NODESET *set, int *Nret)
+{
+    XMLNODE **answer;
+    
+    if (set->N > 0 && set->nodes[0] == 0)
+    {
+        if (set->N > 1 && set->nodes[1] == doc->root)
+            memmove(set->nodes, set->nodes + 1, --set->N * sizeof(XMLNODE *));
+        else
+            set->nodes[0] = doc->root;
+    }
+    if (set->N > 0 && set->nodes[0] == 0)
+        set->N = 0;
+    answer = realloc(set->nodes, (set->N + 1) * sizeof(XMLNODE *));
+    if (!answer)
+        goto out_of_memory;
+    answer[set->N] = 0;
+    if (Nret)
+        *Nret = set->N;
+    set->nodes = 0;
+    set->N = 0;
+    set->capacity = 0;
+    
+    return answer;
+    
+out_of_memory:
+    return 0;
+}
+
+/*
+    Get the attributes a path selects, in document order.
+ 
+    Notes: we run the path up to the attribute step, and take the
+    attribute from each node, which is a hash lookup for nodes with a
+    lot of attributes. If the attribute has an index and that looks
+    cheaper, we take the nodes which have the attribute from the index
+    instead, and check them against the steps from below.
+ */
+static XMLATTRIBUTE **getpathattributes(const XPATH *xp, XMLDOC *doc, int *Nret)
+{
+    const XPATHSTEP *step = &xp->steps[xp->Nsteps-1];
+    NODESET context = {0};
+    XMLATTRIBUTE **answer = 0;
+    XMLATTRIBUTE *attr;
+    int indexed;
+    int N = 0;
+    int i;
+    
+    indexed = attributesfromindex(xp, doc);
+    if (indexed)
+    {
+        context.nodes = xmldoc_getnodeswithattribute(doc, doc->root, step->name, &context.N);
+        if (context.N < 0)
+            goto out_of_memory;
+    }
+    else if (execute(xp, doc, xp->Nsteps - 1, 1, &context))
+        goto out_of_memory;
+    
+    answer = malloc((context.N + 1) * sizeof(XMLATTRIBUTE *));
+    if (!answer)
+        goto out_of_memory;
+    for (i = 0; i < context.N; i++)
+    {
+        if (!context.nodes[i])
+            continue;
+        if (indexed && xp->steps[0].axis != AXIS_DESCENDANTORSELF &&
+            !matchupwards(xp->steps, xp->Nsteps - 2, context.nodes[i]))
+            continue;
+        attr = xml_getattributenode(context.nodes[i], step->name, step->key);
+        if (attr)
+            answer[N++] = attr;
+    }
+    answer[N] = 0;
+    free(context.nodes);
+    *Nret = N;
+    
+    return answer;
+    
+out_of_memory:
+    free(context.nodes);
+    return 0;
+}
+
+/*
+    Should we start an attribute path from the attribute's index?
+    For "//@attr" the index lists the answer. Otherwise we compare the
+    cost, as pickpivot() does for tags.
+ */
+static int attributesfromindex(const XPATH *xp, XMLDOC *doc)
+{
+    const XPATHSTEP *step;
+    double down = 0;
+    int last = xp->Nsteps - 2;
+    int count;
+    int tags;
+    int i;
+    
+    if (last < 0)
+        return 0;
+    count = xmldoc_attributecount(doc, xp->steps[last+1].name);
+    if (count < 0)
+        return 0;
+    if (last == 0 && xp->steps[0].axis == AXIS_DESCENDANTORSELF && !xp->steps[0].name)
+        return 1;
+    for (i = 0; i <= last; i++)
+    {
+        step = &xp->steps[i];
+        if (step->axis != AXIS_CHILD && step->axis != AXIS_DESCENDANT)
+            return 0;
+        if (step->positional)
+            return 0;
+        tags = xmldoc_tagcount(doc, step->name);
+        if (tags < 0)
+            tags = step->axis == AXIS_DESCENDANT ? doc->Nnodes : 0;
+        down += tags;
+    }
+    
+    return (double) count * (last + 1) < down;
+}
+
+/*
+    Get the attributes a union selects, in document order.
+ 
+    Notes: each path which selects attributes is run up to its
+    attribute step, then the node lists are merged, taking each path's
+    attribute from the node as it comes past. The document node has no
+    attributes, and paths which select elements add nothing. Two
+    attributes of the same node come out in the node's order.
+ */
+static XMLATTRIBUTE **getunionattributes(const XPATH *xp, XMLDOC *doc, int *Nret)
+{
+    NODESET *sets = 0;
+    const XPATH *branch;
+    XMLATTRIBUTE **answer = 0;
+    XMLATTRIBUTE *attr;
+    XMLNODE *node;
+    int *pos = 0;
+    int Nbranches = 0;
+    int total = 0;
+    int N = 0;
+    int first;
+    int i, j;
+    
+    for (branch = xp; branch; branch = branch->next)
+        Nbranches++;
+    sets = calloc(Nbranches, sizeof(NODESET));
+    pos = calloc(Nbranches, sizeof(int));
+    if (!sets || !pos)
+        goto out_of_memory;
+    
+    for (branch = xp, i = 0; branch; branch = branch->next, i++)
+    {
+        if (!selectsattributes(branch))
+            continue;
+        if (execute(branch, doc, branch->Nsteps - 1, 1, &sets[i]))
+            goto out_of_memory;
+        if (sets[i].N > 0 && sets[i].nodes[0] == 0)
+            memmove(sets[i].nodes, sets[i].nodes + 1, --sets[i].N * sizeof(XMLNODE *));
+        total += sets[i].N;
+    }
+    answer = malloc((total + 1) * sizeof(XMLATTRIBUTE *));
+    if (!answer)
+        goto out_of_memory;
+    
+    while (1)
+    {
+        node = 0;
+        for (i = 0; i < Nbranches; i++)
+            if (pos[i] < sets[i].N && (!node || comparenodes(sets[i].nodes[pos[i]], node) < 0))
+                node = sets[i].nodes[pos[i]];
+        if (!node)
+            break;
+        first = N;
+        for (branch = xp, i = 0; branch; branch = branch->next, i++)
         {
-            if (!(*predicate)(node, ptr))
-            {
-                cell->deleted = 1;
-                markdeleted_r(node->child, ht);
-            }
+            if (pos[i] == sets[i].N || sets[i].nodes[pos[i]] != node)
+                continue;
+            pos[i]++;
+            attr = xml_getattributenode(node, branch->steps[branch->Nsteps-1].name, branch->steps[branch->Nsteps-1].key);
+            if (!attr)
+                continue;
+            for (j = first; j < N; j++)
+                if (answer[j] == attr)
+                    break;
+            if (j == N)
+                answer[N++] = attr;
         }
-        else
+        if (N - first > 1)
         {
-            if (node->child)
-                select_r(node->child, ht, predicate, ptr);
+            j = first;
+            for (attr = node->attributes; attr && j < N; attr = attr->next)
+                for (i = j; i < N; i++)
+                    if (answer[i] == attr)
+                    {
+                        answer[i] = answer[j];
+                        answer[j++] = attr;
+                        break;
+                    }
         }
-        node = node->next;
     }
+    answer[N] = 0;
+    *Nret = N;
+    
+    for (i = 0; i < Nbranches; i++)
+        free(sets[i].nodes);
+    free(sets);
+    free(pos);
+    return answer;
+    
+out_of_memory:
+    for (i = 0; sets && i < Nbranches; i++)
+        free(sets[i].nodes);
+    free(sets);
+    free(pos);
+    free(answer);
+    return 0;
+}
+
+/*
+    Does the expression select attributes? (Is the last step an attribute step)
+ */
+static int selectsattributes(const XPATH *xp)
+{
+    if (xp->program)
+        return xpathvm_selectsattributes(xp->program);
+    for (; xp; xp = xp->next)
+    {
+        if (xp->Nsteps > 0 && xp->steps[xp->Nsteps-1].axis == AXIS_ATTRIBUTE)
+            return 1;
+    }
+    return 0;
 }
 
-static void fish_r(XMLNODE *node, HASHTABLE *ht, int (*predicate)(XMLNODE *node, void *ptr), void *ptr)
+/*
+    A path, or several joined with "|".
+ 
+    Notes: union := path ( '|' path )*
+ */
+static XPATH *unionexpr(LEXER *lex)
 {
-    HASHCELL *cell;
+    XPATH *xp;
+    XPATH *last;
+    
+    xp = locationpath(lex);
+    if (!xp || haserror(lex))
+        return xp;
+    xp->source = mystrdup(lex->input);
+    if (!xp->source)
+        goto out_of_memory;
     
-    while (node)
+    last = xp;
+    while (gettoken(lex) == PIPE)
+    {
+        match(lex, PIPE);
+        last->next = locationpath(lex);
+        if (!last->next || haserror(lex))
+            return xp;
+        last = last->next;
+    }
+    
+    match(lex, NUL);
+    
+    return xp;
+    
+out_of_memory:
+    writeerror(lex, "Out of memory");
+    return xp;
+}
+
+/*
+    Parse a location path.
+ 
+    Notes: the grammar we accept is
+        path := ( '/' step | '//' step )+
+        step := ( name | '*' | '..' ) predicate* [ '@' name ] | '@' name
+        predicate := '[' ( number | 'last()' | '*'
+                         | name [ '=' literal ] | '@' name [ '=' literal ] ) ']'
+    "/" on its own selects the root. An attribute step must be the last,
+    and '..' must follow '/'.
+ */
+static XPATH *locationpath(LEXER *lex)
+{
+    XPATH *xp;
+    int token;
+    
+    xp = malloc(sizeof(XPATH));
+    if (!xp)
+        goto out_of_memory;
+    xp->source = 0;
+    xp->steps = 0;
+    xp->Nsteps = 0;
+    xp->next = 0;
+    xp->program = 0;
+    xp->serial = 0;
+    
+    token = gettoken(lex);
+    if (token != SLASH && token != SLASHSLASH)
+    {
+        writeerror(lex, "Can't recognise path");
+        return xp;
+    }
+    
+    while (token == SLASH || token == SLASHSLASH)
+    {
+        match(lex, token);
+        if (token == SLASH && xp->Nsteps == 0 && (gettoken(lex) == NUL || gettoken(lex) == PIPE))
+            break;
+        step(xp, lex, token == SLASH ? AXIS_CHILD : AXIS_DESCENDANT);
+        if (haserror(lex))
+            return xp;
+        if (selectsattributes(xp))
+            break;
+        token = gettoken(lex);
+    }
+    
+    return xp;
+    
+out_of_memory:
+    writeerror(lex, "Out of memory");
+    return xp;
+}
+
+static void step(XPATH *xp, LEXER *lex, int axis)
+{
+    int token;
+    char eqname[1024];
+    XPATHSTEP *answer = 0;
+    
+    token = gettoken(lex);
+    if (token == EQNAME)
+    {
+        getvalue(lex, eqname, 1024);
+        match(lex, EQNAME);
+        answer = addstep(xp, lex, axis, eqname);
+    }
+    else if (token == ASTERISK)
+    {
+        match(lex, ASTERISK);
+        answer = addstep(xp, lex, axis, 0);
+    }
+    else if (token == DOTDOT && axis == AXIS_CHILD)
+    {
+        match(lex, DOTDOT);
+        answer = addstep(xp, lex, AXIS_PARENT, 0);
+    }
+    else if (token == STRUDEL)
+    {
+        if (axis == AXIS_DESCENDANT)
+            addstep(xp, lex, AXIS_DESCENDANTORSELF, 0);
+    }
+    else
+    {
+        match(lex, EQNAME);
+        return;
+    }
+    
+    if (answer)
+    {
+        while (gettoken(lex) == OPENSQUARE)
+            predicate(&xp->steps[xp->Nsteps-1], lex);
+        orderpredicates(&xp->steps[xp->Nsteps-1]);
+    }
+    
+    if (gettoken(lex) == STRUDEL)
+    {
+        match(lex, STRUDEL);
+        token = gettoken(lex);
+        if (token == EQNAME)
+        {
+            getvalue(lex, eqname, 1024);
+            match(lex, EQNAME);
+            addstep(xp, lex, AXIS_ATTRIBUTE, eqname);
+        }
+        else
+            match(lex, EQNAME);
+    }
+}
+
+static void predicate(XPATHSTEP *step, LEXER *lex)
+{
+    int token;
+    char eqname[1024];
+    XPATHPREDICATE *temp;
+    XPATHPREDICATE *pred;
+    
+    match(lex, OPENSQUARE);
+    
+    temp = realloc(step->predicates, (step->Npredicates + 1) * sizeof(XPATHPREDICATE));
+    if (!temp)
+        goto out_of_memory;
+    step->predicates = temp;
+    pred = &step->predicates[step->Npredicates++];
+    pred->type = 0;
+    pred->name = 0;
+    pred->key = 0;
+    pred->value = 0;
+    pred->position = 0;
+    
+    token = gettoken(lex);
+    if (token == NUMBER)
     {
-        cell = ht_get(ht, node);
-        if (cell->deleted == 0)
+        getvalue(lex, eqname, 1024);
+        match(lex, NUMBER);
+        pred->type = PREDICATE_POSITION;
+        pred->position = atoi(eqname);
+        step->positional = 1;
+    }
+    else if (token == STRUDEL)
+    {
+        match(lex, STRUDEL);
+        getvalue(lex, eqname, 1024);
+        if (!match(lex, EQNAME))
+            return;
+        pred->type = PREDICATE_HASATTRIBUTE;
+        pred->name = mystrdup(eqname);
+        if (!pred->name)
+            goto out_of_memory;
+        pred->key = xml_attributekey(eqname);
+        if (gettoken(lex) == EQUALS)
+        {
+            if (!literal(pred, lex))
+                return;
+            pred->type = PREDICATE_ATTRIBUTEEQUALS;
+        }
+    }
+    else if (token == EQNAME)
+    {
+        getvalue(lex, eqname, 1024);
+        match(lex, EQNAME);
+        if (gettoken(lex) == OPENPAREN)
         {
-            if (!(*predicate)(node, ptr))
+            if (strcmp(eqname, "last"))
             {
-                cell->deleted = 1;
+                writeerror(lex, "Unsupported function %s()", eqname);
+                return;
             }
+            match(lex, OPENPAREN);
+            match(lex, CLOSEPAREN);
+            pred->type = PREDICATE_LAST;
+            step->positional = 1;
         }
-        if (cell->deleted)
+        else
         {
-            if (node->child)
-                fish_r(node->child, ht, predicate, ptr);
+            pred->type = PREDICATE_HASCHILD;
+            pred->name = mystrdup(eqname);
+            if (!pred->name)
+                goto out_of_memory;
+            if (gettoken(lex) == EQUALS)
+            {
+                if (!literal(pred, lex))
+                    return;
+                pred->type = PREDICATE_CHILDEQUALS;
+            }
         }
-        node = node->next;
     }
+    else if (token == ASTERISK)
+    {
+        match(lex, ASTERISK);
+        pred->type = PREDICATE_HASANYCHILD;
+    }
+    else
+    {
+        writeerror(lex, "Unsupported predicate");
+    }
+    
+    match(lex, CLOSESQUARE);
+    return;
+    
+out_of_memory:
+    writeerror(lex, "Out of memory");
 }
 
-static void markdeleted_r(XMLNODE *node, HASHTABLE *ht)
+/*
+    Put a step's predicates in order of cost, so the cheap tests can
+    throw a node out before the dear ones are tried.
+ 
+    Notes: [n] and last() count the nodes which passed the predicates
+    before them, so we only move predicates between those.
+ */
+static void orderpredicates(XPATHSTEP *step)
 {
-    HASHCELL *cell;
+    XPATHPREDICATE temp;
+    int i;
+    int j;
     
-    while (node)
+    for (i = 1; i < step->Npredicates; i++)
     {
-        cell = ht_get(ht, node);
-        cell->deleted = 1;
-        if (node->child)
-            markdeleted_r(node->child, ht);
-        node = node->next;
+        temp = step->predicates[i];
+        if (temp.type == PREDICATE_POSITION || temp.type == PREDICATE_LAST)
+            continue;
+        for (j = i; j > 0; j--)
+        {
+            if (step->predicates[j-1].type == PREDICATE_POSITION ||
+                step->predicates[j-1].type == PREDICATE_LAST)
+                break;
+            if (predicatecost(&step->predicates[j-1]) <= predicatecost(&temp))
+                break;
+            step->predicates[j] = step->predicates[j-1];
+        }
+        step->predicates[j] = temp;
     }
 }
 
-static int countselectednodes_r(XMLNODE *node, HASHTABLE *ht)
+/*
+    Rough cost of testing a predicate. Attributes are a hash lookup,
+    children mean a walk along the child list.
+ */
+static int predicatecost(const XPATHPREDICATE *pred)
 {
-    int answer = 0;
-    HASHCELL *cell;
+    switch (pred->type)
+    {
+        case PREDICATE_HASANYCHILD:
+            return 0;
+        case PREDICATE_HASATTRIBUTE:
+            return 1;
+        case PREDICATE_ATTRIBUTEEQUALS:
+            return 2;
+        case PREDICATE_HASCHILD:
+            return 3;
+        case PREDICATE_CHILDEQUALS:
+            return 4;
+    }
     
-    while (node)
+    return 0;
+}
+
+/*
+    Parse "= 'value'" into the predicate.
+    Returns: 1 on success, 0 on error.
+ */
+static int literal(XPATHPREDICATE *pred, LEXER *lex)
+{
+    char value[1024];
+    
+    match(lex, EQUALS);
+    getvalue(lex, value, 1024);
+    if (!match(lex, STRING))
+        return 0;
+    pred->value = mystrdup(value);
+    if (!pred->value)
     {
-        cell = ht_get(ht, node);
-        if (!cell->deleted)
-            answer++;
-        else if (node->child)
-            answer += countselectednodes_r(node->child, ht);
-        node = node->next;
+        writeerror(lex, "Out of memory");
+        return 0;
+    }
+    
+    return 1;
+}
+
+static XPATHSTEP *addstep(XPATH *xp, LEXER *lex, int axis, const char *name)
+{
+    XPATHSTEP *temp;
+    XPATHSTEP *answer;
+    
+    temp = realloc(xp->steps, (xp->Nsteps + 1) * sizeof(XPATHSTEP));
+    if (!temp)
+        goto out_of_memory;
+    xp->steps = temp;
+    answer = &xp->steps[xp->Nsteps++];
+    answer->axis = axis;
+    answer->name = 0;
+    answer->key = 0;
+    answer->tagfilter = 0;
+    answer->predicates = 0;
+    answer->Npredicates = 0;
+    answer->positional = 0;
+    if (name)
+    {
+        answer->name = mystrdup(name);
+        if (!answer->name)
+            goto out_of_memory;
+        if (axis == AXIS_ATTRIBUTE)
+            answer->key = xml_attributekey(name);
+        else
+            answer->tagfilter = xml_tagfilterbits(name);
     }
     
     return answer;
+    
+out_of_memory:
+    writeerror(lex, "Out of memory");
+    return 0;
 }
 
-static XMLNODE **getselectednodes_r(XMLNODE *node, HASHTABLE *ht, XMLNODE **out)
+
+/*
+    Can the automaton run this query? It handles child and
+    descendant steps, attribute tests and predicates which don't
+    depend on position.
+ */
+static int nfa_canrun(const XPATH *xp)
 {
-    HASHCELL *cell;
+    int i;
     
-    while (node)
+    if (xp->Nsteps == 0 || xp->next || xp->program)
+        return 0;
+    for (i = 0; i < xp->Nsteps; i++)
     {
-        cell = ht_get(ht, node);
-        if (!cell->deleted)
-            *out++ = node;
-        else if (node->child)
-            out = getselectednodes_r(node->child, ht, out);
-        node = node->next;
+        if (xp->steps[i].axis == AXIS_PARENT || xp->steps[i].positional)
+            return 0;
     }
     
-    return out;
+    return 1;
 }
 
-static int getnodepath_r(XMLNODE *node, char *path, int len, XMLNODE *reference)
+static NFASTATE *nfa_newstate(XPATHSET *set)
 {
-    int taglen;
+    NFASTATE *state;
+    NFASTATE **temp;
     
-    while (node)
+    temp = realloc(set->states, (set->Nstates + 1) * sizeof(NFASTATE *));
+    if (!temp)
+        return 0;
+    set->states = temp;
+    state = malloc(sizeof(NFASTATE));
+    if (!state)
+        return 0;
+    state->id = set->Nstates;
+    state->transitions = 0;
+    state->Ntransitions = 0;
+    state->descendant = 0;
+    state->selfloop = 0;
+    state->accepts = 0;
+    state->Naccepts = 0;
+    state->table = 0;
+    state->capacity = 0;
+    state->others = 0;
+    state->Nothers = 0;
+    set->states[set->Nstates++] = state;
+    
+    return state;
+}
+
+/*
+    Get the state reached from state by a step's node test. Steps
+    without predicates share transitions, so paths with a common
+    prefix share states.
+ */
+static NFASTATE *nfa_transition(XPATHSET *set, NFASTATE *state, const XPATHSTEP *step)
+{
+    NFATRANSITION *temp;
+    NFATRANSITION *trans;
+    NFASTATE *target;
+    int i;
+    
+    if (step->Npredicates == 0)
     {
-        if (node == reference)
+        for (i = 0; i < state->Ntransitions; i++)
         {
-            path[len++] = '/';
-            strcpy(path + len, node->tag);
-            return 1;
+            trans = &state->transitions[i];
+            if (trans->step->Npredicates > 0)
+                continue;
+            if (!trans->step->name && !step->name)
+                return trans->target;
+            if (trans->step->name && step->name && !strcmp(trans->step->name, step->name))
+                return trans->target;
         }
-        
-        if (node->child)
+    }
+    
+    target = nfa_newstate(set);
+    if (!target)
+        return 0;
+    temp = realloc(state->transitions, (state->Ntransitions + 1) * sizeof(NFATRANSITION));
+    if (!temp)
+        return 0;
+    state->transitions = temp;
+    trans = &state->transitions[state->Ntransitions++];
+    trans->step = step;
+    trans->target = target;
+    
+    return target;
+}
+
+/*
+    Get the state for "//" after state. It loops to itself on any node,
+    so it stays active all the way down the subtree.
+ */
+static NFASTATE *nfa_descendant(XPATHSET *set, NFASTATE *state)
+{
+    if (!state->descendant)
+    {
+        state->descendant = nfa_newstate(set);
+        if (!state->descendant)
+            return 0;
+        state->descendant->selfloop = 1;
+    }
+    
+    return state->descendant;
+}
+
+/*
+    Hash the plain named transitions of states with a lot of them, so
+    a node doesn't have to be tested against each in turn. The
+    wildcards and transitions with predicates are listed separately.
+ */
+static int nfa_buildtables(XPATHSET *set)
+{
+    NFASTATE *state;
+    NFATRANSITION *trans;
+    unsigned int h;
+    int i, j;
+    
+    for (i = 0; i < set->Nstates; i++)
+    {
+        state = set->states[i];
+        if (state->Ntransitions < NFATABLETHRESHOLD)
+            continue;
+        state->capacity = 16;
+        while (state->capacity < state->Ntransitions * 2)
+            state->capacity *= 2;
+        state->table = malloc(state->capacity * sizeof(int));
+        state->others = malloc(state->Ntransitions * sizeof(int));
+        if (!state->table || !state->others)
+            return -1;
+        for (j = 0; j < state->capacity; j++)
+            state->table[j] = -1;
+        for (j = 0; j < state->Ntransitions; j++)
         {
-            path[len] = '/';
-            strcpy(path + len + 1, node->tag);
-            taglen = (int) strlen(node->tag);
-            if (getnodepath_r(node->child, path, len + taglen +1, reference))
-               return 1;
-            path[len] = 0;
+            trans = &state->transitions[j];
+            if (!trans->step->name || trans->step->Npredicates > 0)
+            {
+                state->others[state->Nothers++] = j;
+                continue;
+            }
+            h = strhash(trans->step->name) & (state->capacity - 1);
+            while (state->table[h] >= 0)
+                h = (h + 1) & (state->capacity - 1);
+            state->table[h] = j;
         }
-        
-        node = node->next;
     }
     
     return 0;
 }
 
-static int pathdepth_r(XMLNODE *node)
+static int nfa_accept(NFASTATE *state, int query, const XPATHSTEP *attribute)
 {
-    int answer = 0;
-    int path;
+    NFAACCEPT *temp;
     
-    while (node)
-    {
-        if (node->tag)
-            path = (int) strlen(node->tag) + 1;
-        if (node->child)
-            path += pathdepth_r(node->child);
-        if (path > answer)
-            answer = path;
-        node = node->next;
-    }
+    temp = realloc(state->accepts, (state->Naccepts + 1) * sizeof(NFAACCEPT));
+    if (!temp)
+        return -1;
+    state->accepts = temp;
+    state->accepts[state->Naccepts].query = query;
+    state->accepts[state->Naccepts].attribute = attribute;
+    state->Naccepts++;
     
-    return answer;
+    return 0;
 }
 
-
-static int countnodes_r(XMLNODE *node)
+/*
+    Add a state to the active set for the node with the given preorder
+    number, together with its "//" state.
+ */
+static int nfa_add(NFARUN *run, NFASTATE *state, int preorder)
 {
-    int answer = 0;
+    NFASTATE **temp;
+    int capacity;
     
-    while (node)
+    while (state)
     {
-        if (node->child)
-            answer += countnodes_r(node->child);
-        answer++;
-        node = node->next;
+        if (run->stamp[state->id] == preorder + 2)
+            return 0;
+        run->stamp[state->id] = preorder + 2;
+        if (run->N == run->capacity)
+        {
+            capacity = run->capacity ? run->capacity * 2 : 64;
+            temp = realloc(run->active, capacity * sizeof(NFASTATE *));
+            if (!temp)
+                return -1;
+            run->active = temp;
+            run->capacity = capacity;
+        }
+        run->active[run->N++] = state;
+        state = state->descendant;
     }
     
-    return answer;
+    return 0;
 }
 
-static void fillhashtable_r(XMLNODE *node, HASHTABLE *ht)
+/*
+    Walk the document, running the automaton.
+ 
+    Notes: the active states for the parent are run->active[from] to
+    run->active[to-1]. The states for each node go on the end of the
+    array, and are popped when we have finished its subtree. If no
+    states are active, the subtree can't match, and we skip it.
+ */
+static void nfa_run_r(const XPATHSET *set, XMLNODE *node, NFARUN *run, int from, int to)
 {
-    while (node)
+    NFASTATE *state;
+    NFAACCEPT *accept;
+    int start;
+    int i, j;
+    
+    while (node && !run->err)
     {
-        ht_addentry(ht, node);
-        if (node->child)
-            fillhashtable_r(node->child, ht);
+        start = run->N;
+        if (nfa_advance(run, node, from, to, matchpredicates))
+            goto out_of_memory;
+        
+        for (i = start; i < run->N; i++)
+        {
+            state = run->active[i];
+            for (j = 0; j < state->Naccepts; j++)
+            {
+                accept = &state->accepts[j];
+                if (accept->attribute && !matchattribute(node, (void *) accept->attribute))
+                    continue;
+                if (run->results[accept->query].N > 0 &&
+                    run->results[accept->query].nodes[run->results[accept->query].N-1] == node)
+                    continue;
+                if (nodeset_add(&run->results[accept->query], node))
+                    goto out_of_memory;
+            }
+        }
+        
+        if (node->child && run->N > start)
+            nfa_run_r(set, node->child, run, start, run->N);
+        run->N = start;
         node = node->next;
     }
+    return;
+    
+out_of_memory:
+    run->err = -1;
 }
 
-
-static XMLATTRIBUTE **simplexpression(XMLNODE *root, HASHTABLE *ht, LEXER *lex)
+/*
+    Add the states reached from the parent's active states on a node.
+ 
+    Notes: the parent's states are run->active[from] to run->active[to-1],
+    and the new states go on the end of the array. Predicates are tested
+    with the function passed, so a streaming parse can leave the tests on
+    children until the element is complete.
+ */
+static int nfa_advance(NFARUN *run, XMLNODE *node, int from, int to, int (*predicates)(const XPATHSTEP *step, XMLNODE *node))
 {
-    XMLATTRIBUTE **answer = 0;
-    int token = gettoken(lex);
-    
-    while (token != NUL)
+    NFASTATE *state;
+    NFATRANSITION *trans;
+    unsigned int hash = 0;
+    int hashed = 0;
+    unsigned int h;
+    int i, j;
+    
+    for (i = from; i < to; i++)
     {
-        if (token == SLASH)
+        state = run->active[i];
+        if (state->selfloop && nfa_add(run, state, node->preorder))
+            return -1;
+        if (state->table)
         {
-            if (answer)
-                free(answer);
-            answer = pathexpression(root, ht, lex, 0);
-        }
-        else if (token == SLASHSLASH)
-        {
-            if (answer)
-                free(answer);
-            answer = postfixexpression(root, ht, lex);
-        }
-        else if (token == OPENSQUARE)
-        {
-            predicate(root, ht, lex);
+            if (!hashed)
+            {
+                hash = strhash(node->tag);
+                hashed = 1;
+            }
+            for (h = hash & (state->capacity - 1); state->table[h] >= 0; h = (h + 1) & (state->capacity - 1))
+            {
+                trans = &state->transitions[state->table[h]];
+                if (!strcmp(trans->step->name, node->tag))
+                {
+                    if (nfa_add(run, trans->target, node->preorder))
+                        return -1;
+                }
+            }
+            for (j = 0; j < state->Nothers; j++)
+            {
+                trans = &state->transitions[state->others[j]];
+                if (matchstep(node, (void *) trans->step) && (*predicates)(trans->step, node))
+                {
+                    if (nfa_add(run, trans->target, node->preorder))
+                        return -1;
+                }
+            }
+            continue;
         }
-        else
+        for (j = 0; j < state->Ntransitions; j++)
         {
-            writeerror(lex, "Can't recognise path");
-            break;
+            trans = &state->transitions[j];
+            if (matchstep(node, (void *) trans->step) && (*predicates)(trans->step, node))
+            {
+                if (nfa_add(run, trans->target, node->preorder))
+                    return -1;
+            }
         }
-        
-        token = gettoken(lex);
     }
     
-    match(lex, NUL);
-    
-    return answer;
+    return 0;
 }
 
-static XMLATTRIBUTE **pathexpression(XMLNODE *root, HASHTABLE *ht, LEXER *lex, int level)
+/*
+    Test whether a query can be run on a streaming parse. Everything
+    but a test on children of the last element must be decided when the
+    start tag is read.
+ */
+static int nfa_canstream(const XPATH *xp)
 {
-    int token;
-    char eqname[1024];
-    XMLATTRIBUTE **answer = 0;
-    
-    if (match(lex, SLASH) == 0)
-        return;
-
-    if (level)
-        stepdown_r(root, ht);
+    int i, j;
     
-    token = gettoken(lex);
-    if (token == EQNAME)
-    {
-        getvalue(lex, eqname , 1024);
-        match(lex, EQNAME);
-        select_r(root, ht, matchtag, eqname);
-    }
-    else if (token == ASTERISK)
-    {
-        match(lex, ASTERISK);
-        select_r(root, ht, matchall, eqname);
-    }
-    else if (token == DOTDOT)
-    {
-        match(lex, DOTDOT);
-        if (level)
-            stepup_r(root, ht);
-        stepup_r(root, ht);
-    }
-    token = gettoken(lex);
-    if (token == SLASH)
-    {
-        answer = pathexpression(root, ht, lex, 1);
-    }
-    else if (token == STRUDEL)
+    if (!nfa_canrun(xp))
+        return 0;
+    for (i = 0; i < xp->Nsteps; i++)
     {
-        match(lex, STRUDEL);
-        token = gettoken(lex);
-        if (token == EQNAME)
+        if (i == xp->Nsteps - 1 && xp->steps[i].axis != AXIS_ATTRIBUTE)
+            break;
+        for (j = 0; j < xp->steps[i].Npredicates; j++)
         {
-            getvalue(lex, eqname, 1024);
-            match(lex, EQNAME);
-            select_r(root, ht, matchattribute, eqname);
-            answer = getselectedattributes(root, ht, pickattribute, eqname);
+            if (xp->steps[i].predicates[j].type != PREDICATE_HASATTRIBUTE &&
+                xp->steps[i].predicates[j].type != PREDICATE_ATTRIBUTEEQUALS)
+                return 0;
         }
     }
     
-    return answer;
+    return 1;
 }
 
-static XMLATTRIBUTE **postfixexpression(XMLNODE *root, HASHTABLE *ht, LEXER *lex)
+static int nfa_stream(const XPATHSET *set, FILE *fp, const char *str, void (*callback)(XMLNODE *node, int query, void *ptr), void *ptr, char *errormessage, int Nerr)
 {
-    int token;
-    char eqname[1024];
-    XMLATTRIBUTE **answer = 0;
-
-    
-    if (match(lex, SLASHSLASH) == 0)
-        return answer;
+    NFASTREAM st;
+    XMLHANDLER handler;
+    int answer = -1;
+    int err;
+    int i;
     
-    token = gettoken(lex);
-    if (token == EQNAME)
-    {
-        getvalue(lex, eqname, 1024);
-        match(lex, EQNAME);
-        fish_r(root, ht, matchtag, eqname);
-    }
-    else if(token == STRUDEL)
+    if (errormessage && Nerr > 0)
+        errormessage[0] = 0;
+    for (i = 0; i < set->N; i++)
     {
-        match(lex, STRUDEL);
-        token = gettoken(lex);
-        if (token == EQNAME)
+        if (!nfa_canstream(set->xpaths[i]))
         {
-            getvalue(lex, eqname, 1024);
-            match(lex, EQNAME);
-            fish_r(root, ht, matchattribute, eqname);
-            answer = getselectedattributes(root, ht, pickattribute, eqname);
+            snprintf(errormessage, Nerr, "Can't stream %s", set->xpaths[i]->source);
+            return -1;
         }
-        
     }
     
-    token = gettoken(lex);
-    if (token == SLASH)
+    st.set = set;
+    st.run.active = 0;
+    st.run.N = 0;
+    st.run.capacity = 0;
+    st.run.stamp = 0;
+    st.run.results = 0;
+    st.run.err = 0;
+    st.frames = 0;
+    st.Nframes = 0;
+    st.framecapacity = 0;
+    st.pending = 0;
+    st.Npending = 0;
+    st.pendingcapacity = 0;
+    st.delivered = 0;
+    st.callback = callback;
+    st.ptr = ptr;
+    
+    st.run.stamp = calloc(set->Nstates, sizeof(int));
+    st.delivered = malloc((set->N + 1) * sizeof(int));
+    st.frames = malloc(64 * sizeof(NFAFRAME));
+    if (!st.run.stamp || !st.delivered || !st.frames)
+        goto out_of_memory;
+    st.framecapacity = 64;
+    for (i = 0; i < set->N; i++)
+        st.delivered[i] = -1;
+    if (nfa_add(&st.run, set->start, -1))
+        goto out_of_memory;
+    st.frames[0].from = 0;
+    st.frames[0].pending = 0;
+    st.frames[0].keep = 0;
+    st.Nframes = 1;
+    
+    handler.opennode = nfa_streamopen;
+    handler.closenode = nfa_streamclose;
+    handler.ptr = &st;
+    if (fp)
+        err = fstreamxmldoc(fp, &handler, errormessage, Nerr);
+    else
+        err = streamxmldocfromstring(str, &handler, errormessage, Nerr);
+    if (st.run.err)
+        goto out_of_memory;
+    answer = err ? -1 : 0;
+    goto done;
+    
+out_of_memory:
+    snprintf(errormessage, Nerr, "out of memory");
+done:
+    free(st.run.active);
+    free(st.run.stamp);
+    free(st.frames);
+    free(st.pending);
+    free(st.delivered);
+    return answer;
+}
+
+/*
+    Start tag read. Work out the element's active states, pass on
+    attribute matches, and note queries waiting for the element to close.
+ */
+static void nfa_streamopen(XMLNODE *node, void *ptr)
+{
+    NFASTREAM *st = ptr;
+    NFAFRAME *frame;
+    NFASTATE *state;
+    NFAACCEPT *accept;
+    void *temp;
+    int start;
+    int capacity;
+    int i, j;
+    
+    if (st->run.err)
+        return;
+    if (st->Nframes == st->framecapacity)
     {
-        if (answer)
-            free(answer);
-        answer = pathexpression(root, ht, lex, 1);
+        capacity = st->framecapacity * 2;
+        temp = realloc(st->frames, capacity * sizeof(NFAFRAME));
+        if (!temp)
+            goto out_of_memory;
+        st->frames = temp;
+        st->framecapacity = capacity;
     }
-    else if (token == STRUDEL)
+    
+    frame = &st->frames[st->Nframes - 1];
+    start = st->run.N;
+    if (nfa_advance(&st->run, node, frame->from, start, matchattributepredicates))
+        goto out_of_memory;
+    st->frames[st->Nframes].from = start;
+    st->frames[st->Nframes].pending = st->Npending;
+    
+    for (i = start; i < st->run.N; i++)
     {
-        match(lex, STRUDEL);
-        token = gettoken(lex);
-        if (token == EQNAME)
+        state = st->run.active[i];
+        for (j = 0; j < state->Naccepts; j++)
         {
-            getvalue(lex, eqname, 1024);
-            match(lex, EQNAME);
-            select_r(root, ht, matchattribute, eqname);
-            if (answer)
-                free(answer);
-            answer = getselectedattributes(root, ht, pickattribute, eqname);
+            accept = &state->accepts[j];
+            if (accept->attribute)
+            {
+                if (!matchattribute(node, (void *) accept->attribute) ||
+                    st->delivered[accept->query] == node->preorder)
+                    continue;
+                st->delivered[accept->query] = node->preorder;
+                (*st->callback)(node, accept->query, st->ptr);
+                continue;
+            }
+            if (st->Npending == st->pendingcapacity)
+            {
+                capacity = st->pendingcapacity ? st->pendingcapacity * 2 : 64;
+                temp = realloc(st->pending, capacity * sizeof(int));
+                if (!temp)
+                    goto out_of_memory;
+                st->pending = temp;
+                st->pendingcapacity = capacity;
+            }
+            st->pending[st->Npending++] = accept->query;
         }
     }
     
-    return answer;
+    st->frames[st->Nframes].keep = frame->keep || st->Npending > st->frames[st->Nframes].pending;
+    st->Nframes++;
+    return;
+    
+out_of_memory:
+    st->run.err = -1;
 }
 
-static void predicate(XMLNODE *root, HASHTABLE *ht, LEXER *lex)
+/*
+    Element complete. Pass on the matches waiting for it, and keep it
+    only if an ancestor is still waiting.
+ */
+static int nfa_streamclose(XMLNODE *node, void *ptr)
 {
+    NFASTREAM *st = ptr;
+    NFAFRAME *frame;
+    const XPATH *xp;
+    int query;
+    int i;
     
-    int token;
-    char eqname[1024];
-    
-    match(lex, OPENSQUARE);
-    
-    token = gettoken(lex);
+    if (st->run.err)
+        return 0;
     
-    if (token == EQNAME)
+    frame = &st->frames[--st->Nframes];
+    for (i = frame->pending; i < st->Npending; i++)
     {
-        getvalue(lex, eqname, 1024);
-        match(lex, EQNAME);
-        select_r(root, ht, matchhaschild, eqname);
+        query = st->pending[i];
+        xp = st->set->xpaths[query];
+        if (st->delivered[query] == node->preorder ||
+            !matchpredicates(&xp->steps[xp->Nsteps-1], node))
+            continue;
+        st->delivered[query] = node->preorder;
+        (*st->callback)(node, query, st->ptr);
     }
-    else if (token == ASTERISK)
+    st->Npending = frame->pending;
+    st->run.N = frame->from;
+    
+    return st->frames[st->Nframes - 1].keep;
+}
+
+static unsigned int strhash(const char *str)
+{
+    unsigned int answer = 2166136261u;
+    
+    while (*str)
     {
-        match(lex, ASTERISK);
-        select_r(root, ht, matchhasanychild, 0);
+        answer ^= (unsigned char) *str++;
+        answer *= 16777619u;
     }
     
-    match(lex, CLOSESQUARE);
+    return answer;
 }
-   
-
 
 static int matchhaschild(XMLNODE *node, void *ptr)
 {
@@ -802,40 +3710,26 @@ static int matchhasanychild(XMLNODE *node, void *ptr)
 
 static int matchattribute(XMLNODE *node, void *ptr)
 {
-    char *name = ptr;
-    XMLATTRIBUTE *attr = node->attributes;
+    XPATHSTEP *step = ptr;
     
-    while (attr)
-    {
-        if (!strcmp(attr->name, name))
-            return 1;
-        attr = attr->next;
-    }
-    return 0;
-}
-
-static int matchtag(XMLNODE *node, void *ptr)
-{
-    char *tag = ptr;
-    return strcmp(node->tag, tag) ? 0 : 1;
+    COUNTVISIT();
+    return xml_getattributebykey(node, step->name, step->key) ? 1 : 0;
 }
 
-static int matchall(XMLNODE *node, void *ptr)
+static int matchstep(XMLNODE *node, void *ptr)
 {
-    return 1;
+    XPATHSTEP *step = ptr;
+    
+    COUNTVISIT();
+    if (!step->name)
+        return 1;
+    return strcmp(node->tag, step->name) ? 0 : 1;
 }
 
-
-static int pickattribute(XMLATTRIBUTE *attr, void *ptr)
+static int matchtag(XMLNODE *node, void *ptr)
 {
-    char *name = ptr;
-    
-    if (!attr)
-        return 0;
-    
-    if (!strcmp(attr->name, name))
-        return 1;
-    return  0;
+    char *tag = ptr;
+    return strcmp(node->tag, tag) ? 0 : 1;
 }
 
 
@@ -859,7 +3753,7 @@ static int getvalue(LEXER *lex, char *value, int Nvalue)
 {
     int i;
     
-    for (i = 0; i < lex->pos - lex->tokenpos; i++)
+    for (i = 0; i < lex->tokenend - lex->tokenpos; i++)
     {
         value[i] = lex->input[i +lex->tokenpos];
         if ( i == Nvalue - 1)
@@ -877,17 +3771,58 @@ static int match(LEXER *lex, int token)
 {
     if (lex->token == token)
     {
+        while (isspace((unsigned char) lex->input[lex->pos]))
+            lex->pos++;
         if (lex->input[lex->pos] == 0)
             lex->token = NUL;
         else if (isalpha(lex->input[lex->pos]) || lex->input[lex->pos] == '_')
         {
             lex->tokenpos = lex->pos;
-            while (iselementchar(lex->input[lex->pos]) || lex->input[lex->pos] == ':')
+            while (iselementchar(lex->input[lex->pos]) ||
+                   (lex->input[lex->pos] == ':' && lex->input[lex->pos+1] != ':'))
             {
                 lex->pos++;
             }
+            lex->tokenend = lex->pos;
             lex->token = EQNAME;
         }
+        else if (isdigit((unsigned char) lex->input[lex->pos]))
+        {
+            lex->tokenpos = lex->pos;
+            while (isdigit((unsigned char) lex->input[lex->pos]))
+                lex->pos++;
+            lex->tokenend = lex->pos;
+            lex->token = NUMBER;
+        }
+        else if (lex->input[lex->pos] == '\'' || lex->input[lex->pos] == '"')
+        {
+            int quote = lex->input[lex->pos++];
+            
+            lex->tokenpos = lex->pos;
+            while (lex->input[lex->pos] && lex->input[lex->pos] != quote)
+                lex->pos++;
+            lex->tokenend = lex->pos;
+            if (lex->input[lex->pos] == quote)
+                lex->pos++;
+            else
+                writeerror(lex, "Unterminated string");
+            lex->token = STRING;
+        }
+        else if (lex->input[lex->pos] == '=')
+        {
+            lex->token = EQUALS;
+            lex->pos++;
+        }
+        else if (lex->input[lex->pos] == '(')
+        {
+            lex->token = OPENPAREN;
+            lex->pos++;
+        }
+        else if (lex->input[lex->pos] == ')')
+        {
+            lex->token = CLOSEPAREN;
+            lex->pos++;
+        }
         else if (lex->input[lex->pos] == '/')
         {
             lex->token = SLASH;
@@ -908,6 +3843,11 @@ static int match(LEXER *lex, int token)
             lex->token = ASTERISK;
             lex->pos++;
         }
+        else if (lex->input[lex->pos] == '|')
+        {
+            lex->token = PIPE;
+            lex->pos++;
+        }
         else if (lex->input[lex->pos] == '@')
         {
             lex->token = STRUDEL;
@@ -988,97 +3928,39 @@ static int iselementchar(int ch)
     return 0;
 }
 
-static HASHTABLE *inithashtable(int N)
-{
-    HASHTABLE *ht;
-    int i;
-    
-    ht = malloc(sizeof(HASHTABLE));
-    ht->pool = 0;
-    ht->table = 0;
-    ht->N = 0;
-    ht->Nallocated = 0;
-    
-    ht->pool = malloc(N * sizeof(HASHCELL));
-    if (!ht->pool)
-        goto out_of_memory;
-    
-    ht->table = malloc(N * sizeof(HASHCELL *));
-    if (!ht->table)
-        goto out_of_memory;
-    ht->N = N;
-    
-    for (i = 0 ; i <N; i++)
-        ht->table[i] = 0;
-    
-    return ht;
-out_of_memory:
-    killhashtable(ht);
-    return 0;
-}
-
-static void killhashtable(HASHTABLE *ht)
-{
-    if (ht)
-    {
-        free(ht->table);
-        free(ht->pool);
-        free(ht);
-    }
-}
-
-static void ht_addentry(HASHTABLE *ht, void *address)
-{
-    HASHCELL *cell;
-    unsigned int index;
-    
-    cell = &ht->pool[ht->Nallocated++];
-    cell->key = address;
-    index = hash(address) % ht->N;
-    cell->next = ht->table[index];
-    ht->table[index] = cell;
-    
-    cell->deleted = 0;
-}
-
-static HASHCELL *ht_get(HASHTABLE *ht, void *address)
+static char *mystrdup(const char *str)
 {
-    HASHCELL *cell;
-    unsigned int index;
+    char *answer;
     
-    index = hash(address) % ht->N;
-    cell = ht->table[index];
-    while (cell)
-    {
-        if (cell->key == address)
-            return cell;
-        cell = cell->next;
-    }
+    answer = malloc(strlen(str) + 1);
+    if (answer)
+        strcpy(answer, str);
     
-    return 0;
-}
-
-static unsigned int xhash(void *address)
-{
-    return (unsigned int) (unsigned long)(address) >> 4;
+    return answer;
 }
 
-static unsigned int hash(void *address)
+/*
+    Hand out a new identity for a compiled query. Serials are never
+    reused, so a cached result can't be mistaken for another query's
+    even after the first XPATH is killed and its memory recycled.
+ */
+static unsigned long newserial(void)
 {
-    int i;
-    unsigned long answer = 2166136261;
-    unsigned char *byte = (unsigned char *) &address;
+    static unsigned long counter = 0;
+    unsigned long answer;
+#ifdef XPATH_THREADS
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    
+    pthread_mutex_lock(&lock);
+    answer = ++counter;
+    pthread_mutex_unlock(&lock);
+#else
+    answer = ++counter;
+#endif
     
-    for (i =0; i < sizeof(void *); i++)
-    {
-        answer *= 16777619;
-        answer ^= byte[i];
-    }
-    return (unsigned int) (answer & 0xFFFFFFFF);
+    return answer;
 }
 
-
-
 static void printattributes(XMLATTRIBUTE *attr)
 {
     while (attr)
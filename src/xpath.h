@@ -11,11 +11,41 @@
 #include <stdio.h>
 #include "xmlparser2.h"
 
+typedef struct xpath XPATH;
+typedef struct xpathset XPATHSET;
+
 XMLNODE **xml_xpath_select(XMLDOC *doc, const char *xpath, int *Nselected, char *errormessage, int Nerr);
 XMLATTRIBUTE **xml_xpath_selectattributes(XMLDOC *doc, const char *xpath, char *errormessage, int Nerr);
+XMLATTRIBUTE **xml_xpath_selectattributes_len(XMLDOC *doc, const char *xpath, int *Nselected, char *errormessage, int Nerr);
+XMLNODE *xml_xpath_selectfirst(XMLDOC *doc, const char *xpath, char *errormessage, int Nerr);
+int xml_xpath_count(XMLDOC *doc, const char *xpath, char *errormessage, int Nerr);
 int xml_xpath_selectsattributes(const char *xpath, char *errormessage, int Nerr);
 int xml_xpath_isvalid(const char *xpath, char *errormessage, int Nerr);
 char *xml_xpath_getnodepath(XMLDOC *doc, XMLNODE *node);
+char *xml_xpath_getuniquenodepath(XMLDOC *doc, XMLNODE *node);
+
+XPATH *xml_xpath_compile(const char *xpath, char *errormessage, int Nerr);
+XMLNODE **xml_xpath_exec(const XPATH *xp, XMLDOC *doc, int *Nselected);
+XMLNODE **xml_xpath_execparallel(const XPATH *xp, XMLDOC *doc, int Nthreads, int *Nselected);
+XMLATTRIBUTE **xml_xpath_execattributes(const XPATH *xp, XMLDOC *doc);
+XMLATTRIBUTE **xml_xpath_execattributes_len(const XPATH *xp, XMLDOC *doc, int *Nselected);
+int xml_xpath_foreach(const XPATH *xp, XMLDOC *doc, int (*callback)(XMLNODE *node, void *ptr), void *ptr);
+XMLNODE *xml_xpath_execfirst(const XPATH *xp, XMLDOC *doc);
+int xml_xpath_execcount(const XPATH *xp, XMLDOC *doc);
+int xml_xpath_evalnumber(const XPATH *xp, XMLDOC *doc, XMLNODE *context, double *result);
+int xml_xpath_evalboolean(const XPATH *xp, XMLDOC *doc, XMLNODE *context, int *result);
+char *xml_xpath_evalstring(const XPATH *xp, XMLDOC *doc, XMLNODE *context);
+void killxpath(XPATH *xp);
+
+XPATHSET *xml_xpath_compileset(XPATH **xps, int N);
+int xml_xpath_execset(const XPATHSET *set, XMLDOC *doc, XMLNODE ***results, int *Nresults);
+int xml_xpath_streamfile(const XPATHSET *set, FILE *fp, void (*callback)(XMLNODE *node, int query, void *ptr), void *ptr, char *errormessage, int Nerr);
+int xml_xpath_streamstring(const XPATHSET *set, const char *str, void (*callback)(XMLNODE *node, int query, void *ptr), void *ptr, char *errormessage, int Nerr);
+void killxpathset(XPATHSET *set);
+
+#ifdef XPATH_STATS
+extern unsigned long xml_xpath_nodesvisited;
+#endif
 
 
 #endif /* xpath_h */
@@ -0,0 +1,3653 @@
+//
+//  xpathvm.c
+//  babyxrc
+//
+//  XPath 1.0 compiler and bytecode machine.
+//
+
+#include "xpathvm.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <limits.h>
+#include <locale.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+    The compiler parses the expression by recursive descent and emits
+    code for a register machine directly, without building a tree.
+    Each subexpression is told which register to leave its value in,
+    and uses the registers above it as temporaries. Predicates compile
+    to small subprograms, jumped over in the main code, which run in a
+    register frame of their own with the candidate node as the context.
+
+    At run time a node-set is a range of one growing array of items,
+    and strings made by functions live in an arena of blocks. A
+    predicate hands back all the items and strings it used when it
+    returns, so once the buffers have grown nothing more is allocated.
+ */
+
+#define NUL 0
+#define NAME 1
+#define NUMBER 2
+#define LITERAL 3
+#define SLASH 4
+#define SLASHSLASH 5
+#define DOT 6
+#define DOTDOT 7
+#define STRUDEL 8
+#define COMMA 9
+#define COLONCOLON 10
+#define OPENPAREN 11
+#define CLOSEPAREN 12
+#define OPENSQUARE 13
+#define CLOSESQUARE 14
+#define PIPE 15
+#define PLUS 16
+#define MINUS 17
+#define EQUALS 18
+#define NOTEQUALS 19
+#define LESS 20
+#define LESSEQUALS 21
+#define GREATER 22
+#define GREATEREQUALS 23
+#define ASTERISK 24
+#define MULTIPLY 25
+#define AND 26
+#define OR 27
+#define DIV 28
+#define MOD 29
+#define FUNCTIONNAME 30
+#define AXISNAME 31
+#define NODETYPE 32
+#define DOLLAR 33
+
+#define AXIS_CHILD 1
+#define AXIS_DESCENDANT 2
+#define AXIS_DESCENDANTORSELF 3
+#define AXIS_PARENT 4
+#define AXIS_ATTRIBUTE 5
+#define AXIS_SELF 6
+#define AXIS_ANCESTOR 7
+#define AXIS_ANCESTORORSELF 8
+#define AXIS_FOLLOWINGSIBLING 9
+#define AXIS_PRECEDINGSIBLING 10
+#define AXIS_FOLLOWING 11
+#define AXIS_PRECEDING 12
+
+#define TEST_NAME 1                 /* name */
+#define TEST_PREFIX 2               /* prefix:* */
+#define TEST_ANY 3                  /* * */
+#define TEST_NODE 4                 /* node() */
+#define TEST_TEXT 5                 /* text() */
+#define TEST_NONE 6                 /* comment(), processing-instruction() */
+
+#define OP_NUMBER 1                 /* dst = numbers[arg] */
+#define OP_STRING 2                 /* dst = strings[arg] */
+#define OP_CONTEXT 3                /* dst = the context node */
+#define OP_ROOT 4                   /* dst = the document node */
+#define OP_STEP 5                   /* dst = steps[arg] from the nodes in a */
+#define OP_FILTER 6                 /* dst = a, filtered by b predicates from predicates[arg] */
+#define OP_UNION 7                  /* dst = a | b */
+#define OP_BOOLEAN 8                /* dst = boolean(a) */
+#define OP_JUMP 9                   /* go to arg */
+#define OP_JUMPIFTRUE 10            /* go to arg if the boolean a is true */
+#define OP_JUMPIFFALSE 11           /* go to arg if the boolean a is false */
+#define OP_EQUALS 12                /* dst = a = b */
+#define OP_NOTEQUALS 13             /* dst = a != b */
+#define OP_LESS 14                  /* dst = a < b */
+#define OP_LESSEQUALS 15            /* dst = a <= b */
+#define OP_GREATER 16               /* dst = a > b */
+#define OP_GREATEREQUALS 17         /* dst = a >= b */
+#define OP_ADD 18                   /* dst = a + b */
+#define OP_SUBTRACT 19              /* dst = a - b */
+#define OP_MULTIPLY 20              /* dst = a * b */
+#define OP_DIVIDE 21                /* dst = a div b */
+#define OP_MODULO 22                /* dst = a mod b */
+#define OP_NEGATE 23                /* dst = -a */
+#define OP_CALL 24                  /* dst = function arg, b arguments from a */
+#define OP_RETURN 25                /* return a */
+
+#define FN_LAST 1
+#define FN_POSITION 2
+#define FN_COUNT 3
+#define FN_ID 4
+#define FN_LOCALNAME 5
+#define FN_NAMESPACEURI 6
+#define FN_NAME 7
+#define FN_STRING 8
+#define FN_CONCAT 9
+#define FN_STARTSWITH 10
+#define FN_CONTAINS 11
+#define FN_SUBSTRINGBEFORE 12
+#define FN_SUBSTRINGAFTER 13
+#define FN_SUBSTRING 14
+#define FN_STRINGLENGTH 15
+#define FN_NORMALIZESPACE 16
+#define FN_TRANSLATE 17
+#define FN_BOOLEAN 18
+#define FN_NOT 19
+#define FN_TRUE 20
+#define FN_FALSE 21
+#define FN_LANG 22
+#define FN_NUMBER 23
+#define FN_SUM 24
+#define FN_FLOOR 25
+#define FN_CEILING 26
+#define FN_ROUND 27
+
+#define VALUE_NODESET 1
+#define VALUE_NUMBER 2
+#define VALUE_STRING 3
+#define VALUE_BOOLEAN 4
+
+#define ITEM_DOCUMENT 0
+#define ITEM_ELEMENT 1
+#define ITEM_ATTRIBUTE 2
+#define ITEM_TEXT 3
+
+#define VM_OUTOFMEMORY 1
+#define VM_TYPEERROR 2
+
+#define ARENA_BLOCKSIZE 4096
+
+typedef struct
+{
+    const char *name;
+    int id;
+    int minargs;
+    int maxargs;                /* -1 for any number */
+} FUNCTION;
+
+static const FUNCTION functions[] =
+{
+    {"last", FN_LAST, 0, 0},
+    {"position", FN_POSITION, 0, 0},
+    {"count", FN_COUNT, 1, 1},
+    {"id", FN_ID, 1, 1},
+    {"local-name", FN_LOCALNAME, 0, 1},
+    {"namespace-uri", FN_NAMESPACEURI, 0, 1},
+    {"name", FN_NAME, 0, 1},
+    {"string", FN_STRING, 0, 1},
+    {"concat", FN_CONCAT, 2, -1},
+    {"starts-with", FN_STARTSWITH, 2, 2},
+    {"contains", FN_CONTAINS, 2, 2},
+    {"substring-before", FN_SUBSTRINGBEFORE, 2, 2},
+    {"substring-after", FN_SUBSTRINGAFTER, 2, 2},
+    {"substring", FN_SUBSTRING, 2, 3},
+    {"string-length", FN_STRINGLENGTH, 0, 1},
+    {"normalize-space", FN_NORMALIZESPACE, 0, 1},
+    {"translate", FN_TRANSLATE, 3, 3},
+    {"boolean", FN_BOOLEAN, 1, 1},
+    {"not", FN_NOT, 1, 1},
+    {"true", FN_TRUE, 0, 0},
+    {"false", FN_FALSE, 0, 0},
+    {"lang", FN_LANG, 1, 1},
+    {"number", FN_NUMBER, 0, 1},
+    {"sum", FN_SUM, 1, 1},
+    {"floor", FN_FLOOR, 1, 1},
+    {"ceiling", FN_CEILING, 1, 1},
+    {"round", FN_ROUND, 1, 1},
+    {0, 0, 0, 0}
+};
+
+typedef struct
+{
+    const char *name;
+    int axis;
+} AXISNAMES;
+
+static const AXISNAMES axes[] =
+{
+    {"child", AXIS_CHILD},
+    {"descendant", AXIS_DESCENDANT},
+    {"descendant-or-self", AXIS_DESCENDANTORSELF},
+    {"parent", AXIS_PARENT},
+    {"attribute", AXIS_ATTRIBUTE},
+    {"self", AXIS_SELF},
+    {"ancestor", AXIS_ANCESTOR},
+    {"ancestor-or-self", AXIS_ANCESTORORSELF},
+    {"following-sibling", AXIS_FOLLOWINGSIBLING},
+    {"preceding-sibling", AXIS_PRECEDINGSIBLING},
+    {"following", AXIS_FOLLOWING},
+    {"preceding", AXIS_PRECEDING},
+    {0, 0}
+};
+
+typedef struct
+{
+    int op;                     /* OP_STEP, OP_ADD etc */
+    int dst;                    /* register for the result */
+    int a;                      /* first operand register */
+    int b;                      /* second operand register, or a count */
+    int arg;                    /* constant, step, function or jump target */
+} INSTRUCTION;
+
+typedef struct
+{
+    char *str;                  /* the string (nul-terminated) */
+    int len;                    /* its length */
+} CONSTSTRING;
+
+typedef struct
+{
+    int axis;                   /* AXIS_CHILD, AXIS_PRECEDING etc */
+    int test;                   /* TEST_NAME, TEST_NODE etc */
+    char *name;                 /* name, or prefix with the colon for TEST_PREFIX */
+    int namelen;                /* length of the name */
+    uint64_t tagfilter;         /* tag filter bits of the name, 0 for any */
+    int predicates;             /* index of the first predicate entry point */
+    int Npredicates;            /* number of predicates */
+    int positional;             /* set if a predicate may depend on position */
+    int textmatch;              /* XML_TEXT_CONTAINS etc if the first predicate is a text query */
+    int textstep;               /* the text() or attribute step the query tests */
+    int textstring;             /* the string the query looks for */
+    int keylookup;              /* set if the query is @attr = literal */
+} STEP;
+
+struct xpathprogram
+{
+    INSTRUCTION *code;          /* the main program, then predicate bodies */
+    int Ncode;
+    double *numbers;            /* numeric constants */
+    int Nnumbers;
+    CONSTSTRING *strings;       /* string literals */
+    int Nstrings;
+    STEP *steps;                /* location steps */
+    int Nsteps;
+    int *predicates;            /* entry points of the predicate bodies */
+    int Npredicates;
+    int Nregisters;             /* registers needed by a frame */
+    int selectsattributes;      /* set if the result is likely to be attributes */
+};
+
+typedef struct
+{
+    const char *input;
+    int tokenpos;
+    int tokenend;
+    int pos;
+    int token;
+    int previous;               /* token before this one, to tell "*" and names apart */
+    char error[256];
+} LEXER;
+
+typedef struct
+{
+    LEXER lex;
+    XPATHPROGRAM *prog;
+    int codecapacity;
+    int numbercapacity;
+    int stringcapacity;
+    int stepcapacity;
+    int predicatecapacity;
+} COMPILER;
+
+typedef struct
+{
+    XMLNODE *node;              /* the element, or the owner of an attribute or text */
+    XMLATTRIBUTE *attr;         /* the attribute, for ITEM_ATTRIBUTE */
+    int type;                   /* ITEM_ELEMENT, ITEM_DOCUMENT etc */
+    int index;                  /* place in the attribute list, for document order */
+} ITEM;
+
+typedef struct
+{
+    int type;                   /* VALUE_NODESET, VALUE_NUMBER etc */
+    double number;              /* the number, or 0 / 1 for a boolean */
+    const char *str;            /* the string, not nul-terminated */
+    int len;                    /* length of the string */
+    int start;                  /* first item of a node-set */
+    int N;                      /* number of items in a node-set */
+} VALUE;
+
+typedef struct
+{
+    char **blocks;              /* blocks of string space */
+    int *sizes;                 /* size of each block */
+    int Nblocks;                /* number of blocks */
+    int current;                /* block being used */
+    int used;                   /* bytes used in the current block */
+} ARENA;
+
+typedef struct
+{
+    int current;
+    int used;
+} ARENAMARK;
+
+typedef struct
+{
+    const XPATHPROGRAM *prog;
+    XMLDOC *doc;
+    VALUE *registers;           /* register frames, one per running (sub)program */
+    int Nregisters;
+    int registercapacity;
+    ITEM *items;                /* node-set storage */
+    int Nitems;
+    int itemcapacity;
+    ARENA arena;                /* string storage */
+    int err;                    /* VM_OUTOFMEMORY or VM_TYPEERROR */
+} MACHINE;
+
+static void expr(COMPILER *c, int reg);
+static void andexpr(COMPILER *c, int reg);
+static void equalityexpr(COMPILER *c, int reg);
+static void relationalexpr(COMPILER *c, int reg);
+static void additiveexpr(COMPILER *c, int reg);
+static void multiplicativeexpr(COMPILER *c, int reg);
+static void unaryexpr(COMPILER *c, int reg);
+static void unionexpr(COMPILER *c, int reg);
+static void pathexpr(COMPILER *c, int reg);
+static void filterexpr(COMPILER *c, int reg);
+static void primaryexpr(COMPILER *c, int reg);
+static void functioncall(COMPILER *c, int reg);
+static void relativepath(COMPILER *c, int reg, int descend);
+static void step(COMPILER *c, int reg, int descend);
+static void nodetest(COMPILER *c, STEP *st);
+static int predicates(COMPILER *c, int *Npredicates, int *positional);
+static int ispositional(COMPILER *c, int entry);
+static void textquery(COMPILER *c, STEP *st);
+static int startsstep(int token);
+static int emit(COMPILER *c, int op, int dst, int a, int b, int arg);
+static void patch(COMPILER *c, int jump);
+static int addnumber(COMPILER *c, double x);
+static int addstring(COMPILER *c, const char *str, int len);
+static int addstep(COMPILER *c, STEP *st);
+
+static int evaluate(MACHINE *vm, const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, VALUE *result);
+static void freemachine(MACHINE *vm);
+static int run(MACHINE *vm, int pc, const ITEM *context, int position, int size, VALUE *result);
+static int predicate(MACHINE *vm, int pc, const ITEM *context, int position, int size, int *truth);
+static int filter(MACHINE *vm, const int *entries, int N, int first);
+static int runstep(MACHINE *vm, const STEP *st, const VALUE *context, VALUE *result);
+static int indexedstep(MACHINE *vm, const STEP *st, const VALUE *context, VALUE *result);
+static int nodeslowerbound(XMLNODE **nodes, int N, int preorder);
+static int runfilter(MACHINE *vm, const int *entries, int N, const VALUE *set, VALUE *result);
+static int unionsets(MACHINE *vm, const VALUE *a, const VALUE *b, VALUE *result);
+static int axis(MACHINE *vm, const STEP *st, const ITEM *item);
+static int following(MACHINE *vm, const STEP *st, const ITEM *item);
+static int preceding(MACHINE *vm, const STEP *st, const ITEM *item);
+static int subtree(MACHINE *vm, const STEP *st, XMLNODE *top);
+static int element(MACHINE *vm, const STEP *st, XMLNODE *node);
+static int text(MACHINE *vm, const STEP *st, XMLNODE *node);
+static int matchitem(const STEP *st, const ITEM *item);
+static int matchelement(const STEP *st, XMLNODE *node);
+static int matchattribute(const STEP *st, XMLATTRIBUTE *attr);
+static int parentitem(const ITEM *item, ITEM *parent);
+static int isreverse(int axis);
+static int additem(MACHINE *vm, int type, XMLNODE *node, XMLATTRIBUTE *attr, int index);
+static void reverseitems(MACHINE *vm, int start, int end);
+static void normalise(MACHINE *vm, VALUE *set);
+static int compareitems(const ITEM *a, const ITEM *b);
+static int compareitemsqsort(const void *e1, const void *e2);
+
+static int callfunction(MACHINE *vm, int fn, VALUE *args, int N, const ITEM *context, int position, int size, VALUE *result);
+static int idfunction(MACHINE *vm, VALUE *arg, VALUE *result);
+static int langfunction(MACHINE *vm, VALUE *arg, const ITEM *context);
+static int nodename(MACHINE *vm, VALUE *args, int N, const ITEM *context, const char **str, int *len);
+static int translate(MACHINE *vm, const VALUE *s, const VALUE *from, const VALUE *to, VALUE *result);
+static int normalizespace(MACHINE *vm, const char *str, int len, VALUE *result);
+static int substring(VALUE *args, int N, VALUE *result);
+static int compare(MACHINE *vm, int op, const VALUE *a, const VALUE *b);
+static int comparewithset(MACHINE *vm, int op, const VALUE *set, const VALUE *other);
+static int comparesets(MACHINE *vm, int op, const VALUE *a, const VALUE *b);
+static int comparenumbers(int op, double x, double y);
+static int swapop(int op);
+static int stringvalue(MACHINE *vm, const ITEM *item, const char **str, int *len);
+static int textlength_r(XMLNODE *node);
+static int copytext_r(XMLNODE *node, char *out);
+static double tonumber(MACHINE *vm, const VALUE *v);
+static int toboolean(const VALUE *v);
+static int tostring(MACHINE *vm, const VALUE *v, const char **str, int *len);
+static int requirenodeset(MACHINE *vm, const VALUE *v);
+static void setnumber(VALUE *v, double x);
+static void setboolean(VALUE *v, int truth);
+static void setstring(VALUE *v, const char *str, int len);
+static double xround(double x);
+static int formatnumber(double x, char *out);
+static double convertnumber(const char *str, int len);
+static int findstring(const char *str, int len, const char *sub, int sublen);
+static int utf8length(const char *str, int len);
+static int utf8decode(const char *str, int len, int *ch);
+static int utf8encode(int ch, char *out);
+static char *arena_alloc(MACHINE *vm, int size);
+static ARENAMARK arena_mark(MACHINE *vm);
+static void arena_reset(MACHINE *vm, ARENAMARK mark);
+
+static void initlexer(LEXER *lex, const char *xpath);
+static int readtoken(LEXER *lex);
+static void advance(LEXER *lex);
+static int match(LEXER *lex, int token);
+static int operatorcontext(LEXER *lex);
+static int isnamestart(int ch);
+static int isnamechar(int ch);
+static int haserror(LEXER *lex);
+static void writeerror(LEXER *lex, const char *fmt, ...);
+
+/*
+    Compile an XPath 1.0 expression to bytecode.
+
+    Params: xpath - the expression
+            errormessage - return buffer for error diagnostics
+            Nerr - size of the errormessage buffer
+    Returns: the program, 0 on error.
+
+    Notes: the whole of XPath 1.0 is accepted except variables and
+    the namespace axis. The document has no comments or processing
+    instructions, so comment() and processing-instruction() match
+    nothing, and an element's character data is seen as one text node,
+    which comes before the element's children.
+ */
+XPATHPROGRAM *xpathvm_compile(const char *xpath, char *errormessage, int Nerr)
+{
+    COMPILER c;
+    XPATHPROGRAM *prog;
+    const INSTRUCTION *last;
+    int i;
+
+    memset(&c, 0, sizeof(COMPILER));
+    initlexer(&c.lex, xpath);
+    prog = calloc(1, sizeof(XPATHPROGRAM));
+    if (!prog)
+    {
+        writeerror(&c.lex, "Out of memory");
+        goto error_exit;
+    }
+    c.prog = prog;
+
+    expr(&c, 0);
+    match(&c.lex, NUL);
+    emit(&c, OP_RETURN, 0, 0, 0, 0);
+    if (haserror(&c.lex))
+        goto error_exit;
+
+    if (prog->Ncode > 1)
+    {
+        last = &prog->code[prog->Ncode - 2];
+        if (last->op == OP_STEP && prog->steps[last->arg].axis == AXIS_ATTRIBUTE)
+            prog->selectsattributes = 1;
+        else if (last->op == OP_UNION)
+        {
+            for (i = 0; i < prog->Nsteps; i++)
+                if (prog->steps[i].axis == AXIS_ATTRIBUTE)
+                    prog->selectsattributes = 1;
+        }
+    }
+    if (errormessage)
+        errormessage[0] = 0;
+
+    return prog;
+
+error_exit:
+    if (errormessage)
+        snprintf(errormessage, Nerr, "%s", c.lex.error);
+    killxpathprogram(prog);
+    return 0;
+}
+
+/*
+    Is the program's result likely to be a set of attributes?
+ */
+int xpathvm_selectsattributes(const XPATHPROGRAM *prog)
+{
+    return prog->selectsattributes;
+}
+
+/*
+    Run a program and get the nodes it selects.
+
+    Params: prog - the program
+            doc - the document
+            context - the context node, 0 for the document
+            Nselected - return for the number of nodes
+    Returns: the nodes as a list in document order, terminated by a NULL,
+    0 on out of memory or a type error.
+
+    Notes: attributes and text are reported as the element they belong
+    to, and the document node as the root. If the expression isn't a
+    node-set, the list is empty.
+ */
+XMLNODE **xpathvm_selectnodes(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, int *Nselected)
+{
+    MACHINE vm;
+    VALUE result;
+    XMLNODE **answer = 0;
+    XMLNODE *node;
+    int N = 0;
+    int i;
+
+    if (evaluate(&vm, prog, doc, context, &result))
+        goto error_exit;
+    if (result.type != VALUE_NODESET)
+        result.N = 0;
+    answer = malloc((result.N + 1) * sizeof(XMLNODE *));
+    if (!answer)
+        goto error_exit;
+    for (i = 0; i < result.N; i++)
+    {
+        node = vm.items[result.start + i].node;
+        if (!node)
+            node = doc->root;
+        if (node && (N == 0 || answer[N-1] != node))
+            answer[N++] = node;
+    }
+    answer[N] = 0;
+    if (Nselected)
+        *Nselected = N;
+    freemachine(&vm);
+
+    return answer;
+
+error_exit:
+    freemachine(&vm);
+    return 0;
+}
+
+/*
+    Run a program and get the attributes it selects.
+
+    Params: prog - the program
+            doc - the document
+            context - the context node, 0 for the document
+            Nselected - return for the number of attributes
+    Returns: the attributes as a list in document order, terminated by
+    a NULL, 0 on out of memory or a type error.
+ */
+XMLATTRIBUTE **xpathvm_selectattributes(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, int *Nselected)
+{
+    MACHINE vm;
+    VALUE result;
+    XMLATTRIBUTE **answer = 0;
+    int N = 0;
+    int i;
+
+    if (evaluate(&vm, prog, doc, context, &result))
+        goto error_exit;
+    if (result.type != VALUE_NODESET)
+        result.N = 0;
+    answer = malloc((result.N + 1) * sizeof(XMLATTRIBUTE *));
+    if (!answer)
+        goto error_exit;
+    for (i = 0; i < result.N; i++)
+    {
+        if (vm.items[result.start + i].type == ITEM_ATTRIBUTE)
+            answer[N++] = vm.items[result.start + i].attr;
+    }
+    answer[N] = 0;
+    if (Nselected)
+        *Nselected = N;
+    freemachine(&vm);
+
+    return answer;
+
+error_exit:
+    freemachine(&vm);
+    return 0;
+}
+
+/*
+    Run a program and convert the result to a number, as number() does.
+
+    Returns: 0 on success, -1 on out of memory or a type error.
+ */
+int xpathvm_evalnumber(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, double *result)
+{
+    MACHINE vm;
+    VALUE value;
+
+    if (evaluate(&vm, prog, doc, context, &value))
+        goto error_exit;
+    *result = tonumber(&vm, &value);
+    if (vm.err)
+        goto error_exit;
+    freemachine(&vm);
+    return 0;
+
+error_exit:
+    freemachine(&vm);
+    return -1;
+}
+
+/*
+    Run a program and convert the result to a boolean, as boolean() does.
+
+    Returns: 0 on success, -1 on out of memory or a type error.
+ */
+int xpathvm_evalboolean(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, int *result)
+{
+    MACHINE vm;
+    VALUE value;
+
+    if (evaluate(&vm, prog, doc, context, &value))
+        goto error_exit;
+    *result = toboolean(&value);
+    freemachine(&vm);
+    return 0;
+
+error_exit:
+    freemachine(&vm);
+    return -1;
+}
+
+/*
+    Run a program and convert the result to a string, as string() does.
+
+    Returns: the string, allocated with malloc(), 0 on out of memory or
+    a type error.
+ */
+char *xpathvm_evalstring(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context)
+{
+    MACHINE vm;
+    VALUE value;
+    const char *str;
+    int len;
+    char *answer;
+
+    if (evaluate(&vm, prog, doc, context, &value))
+        goto error_exit;
+    if (tostring(&vm, &value, &str, &len))
+        goto error_exit;
+    answer = malloc(len + 1);
+    if (!answer)
+        goto error_exit;
+    memcpy(answer, str, len);
+    answer[len] = 0;
+    freemachine(&vm);
+
+    return answer;
+
+error_exit:
+    freemachine(&vm);
+    return 0;
+}
+
+/*
+    Convert a string to a number, by the XPath rules.
+
+    Params: str - the string
+            len - its length
+    Returns: the number, NaN if the string isn't one.
+
+    Notes: XPath allows only an optional minus sign, digits and a
+    decimal point, with whitespace around. No exponents, no plus
+    sign, and no "inf".
+ */
+double xpathvm_number(const char *str, int len)
+{
+    int i = 0;
+    int start, end;
+    int digits = 0;
+
+    while (i < len && isspace((unsigned char) str[i]))
+        i++;
+    start = i;
+    if (i < len && str[i] == '-')
+        i++;
+    while (i < len && isdigit((unsigned char) str[i]))
+    {
+        i++;
+        digits++;
+    }
+    if (i < len && str[i] == '.')
+    {
+        i++;
+        while (i < len && isdigit((unsigned char) str[i]))
+        {
+            i++;
+            digits++;
+        }
+    }
+    if (digits == 0)
+        return NAN;
+    end = i;
+    while (i < len && isspace((unsigned char) str[i]))
+        i++;
+    if (i != len)
+        return NAN;
+
+    return convertnumber(str + start, end - start);
+}
+
+/*
+    Compiled program destructor.
+ */
+void killxpathprogram(XPATHPROGRAM *prog)
+{
+    int i;
+
+    if (!prog)
+        return;
+    for (i = 0; i < prog->Nstrings; i++)
+        free(prog->strings[i].str);
+    for (i = 0; i < prog->Nsteps; i++)
+        free(prog->steps[i].name);
+    free(prog->code);
+    free(prog->numbers);
+    free(prog->strings);
+    free(prog->steps);
+    free(prog->predicates);
+    free(prog);
+}
+
+/*
+    Expr := OrExpr, OrExpr := AndExpr ( 'or' AndExpr )*
+
+    "or" and "and" jump past the right hand side once the answer
+    is known.
+ */
+static void expr(COMPILER *c, int reg)
+{
+    int jump;
+
+    andexpr(c, reg);
+    while (c->lex.token == OR && !haserror(&c->lex))
+    {
+        advance(&c->lex);
+        emit(c, OP_BOOLEAN, reg, reg, 0, 0);
+        jump = emit(c, OP_JUMPIFTRUE, 0, reg, 0, 0);
+        andexpr(c, reg);
+        emit(c, OP_BOOLEAN, reg, reg, 0, 0);
+        patch(c, jump);
+    }
+}
+
+static void andexpr(COMPILER *c, int reg)
+{
+    int jump;
+
+    equalityexpr(c, reg);
+    while (c->lex.token == AND && !haserror(&c->lex))
+    {
+        advance(&c->lex);
+        emit(c, OP_BOOLEAN, reg, reg, 0, 0);
+        jump = emit(c, OP_JUMPIFFALSE, 0, reg, 0, 0);
+        equalityexpr(c, reg);
+        emit(c, OP_BOOLEAN, reg, reg, 0, 0);
+        patch(c, jump);
+    }
+}
+
+static void equalityexpr(COMPILER *c, int reg)
+{
+    int op;
+
+    relationalexpr(c, reg);
+    while ((c->lex.token == EQUALS || c->lex.token == NOTEQUALS) && !haserror(&c->lex))
+    {
+        op = c->lex.token == EQUALS ? OP_EQUALS : OP_NOTEQUALS;
+        advance(&c->lex);
+        relationalexpr(c, reg + 1);
+        emit(c, op, reg, reg, reg + 1, 0);
+    }
+}
+
+static void relationalexpr(COMPILER *c, int reg)
+{
+    int op;
+
+    additiveexpr(c, reg);
+    for (;;)
+    {
+        switch (c->lex.token)
+        {
+            case LESS: op = OP_LESS; break;
+            case LESSEQUALS: op = OP_LESSEQUALS; break;
+            case GREATER: op = OP_GREATER; break;
+            case GREATEREQUALS: op = OP_GREATEREQUALS; break;
+            default: return;
+        }
+        if (haserror(&c->lex))
+            return;
+        advance(&c->lex);
+        additiveexpr(c, reg + 1);
+        emit(c, op, reg, reg, reg + 1, 0);
+    }
+}
+
+static void additiveexpr(COMPILER *c, int reg)
+{
+    int op;
+
+    multiplicativeexpr(c, reg);
+    while ((c->lex.token == PLUS || c->lex.token == MINUS) && !haserror(&c->lex))
+    {
+        op = c->lex.token == PLUS ? OP_ADD : OP_SUBTRACT;
+        advance(&c->lex);
+        multiplicativeexpr(c, reg + 1);
+        emit(c, op, reg, reg, reg + 1, 0);
+    }
+}
+
+static void multiplicativeexpr(COMPILER *c, int reg)
+{
+    int op;
+
+    unaryexpr(c, reg);
+    for (;;)
+    {
+        switch (c->lex.token)
+        {
+            case MULTIPLY: op = OP_MULTIPLY; break;
+            case DIV: op = OP_DIVIDE; break;
+            case MOD: op = OP_MODULO; break;
+            default: return;
+        }
+        if (haserror(&c->lex))
+            return;
+        advance(&c->lex);
+        unaryexpr(c, reg + 1);
+        emit(c, op, reg, reg, reg + 1, 0);
+    }
+}
+
+static void unaryexpr(COMPILER *c, int reg)
+{
+    if (c->lex.token == MINUS)
+    {
+        advance(&c->lex);
+        unaryexpr(c, reg);
+        emit(c, OP_NEGATE, reg, reg, 0, 0);
+    }
+    else
+        unionexpr(c, reg);
+}
+
+static void unionexpr(COMPILER *c, int reg)
+{
+    pathexpr(c, reg);
+    while (c->lex.token == PIPE && !haserror(&c->lex))
+    {
+        advance(&c->lex);
+        pathexpr(c, reg + 1);
+        emit(c, OP_UNION, reg, reg, reg + 1, 0);
+    }
+}
+
+/*
+    PathExpr := LocationPath | FilterExpr ( ( '/' | '//' ) RelativeLocationPath )?
+ */
+static void pathexpr(COMPILER *c, int reg)
+{
+    switch (c->lex.token)
+    {
+        case SLASH:
+            advance(&c->lex);
+            emit(c, OP_ROOT, reg, 0, 0, 0);
+            if (startsstep(c->lex.token))
+                relativepath(c, reg, 0);
+            break;
+        case SLASHSLASH:
+            advance(&c->lex);
+            emit(c, OP_ROOT, reg, 0, 0, 0);
+            relativepath(c, reg, 1);
+            break;
+        case LITERAL:
+        case NUMBER:
+        case OPENPAREN:
+        case FUNCTIONNAME:
+        case DOLLAR:
+            filterexpr(c, reg);
+            if (c->lex.token == SLASH || c->lex.token == SLASHSLASH)
+            {
+                int descend = c->lex.token == SLASHSLASH;
+                advance(&c->lex);
+                relativepath(c, reg, descend);
+            }
+            break;
+        default:
+            emit(c, OP_CONTEXT, reg, 0, 0, 0);
+            relativepath(c, reg, 0);
+            break;
+    }
+}
+
+static void filterexpr(COMPILER *c, int reg)
+{
+    int first, N;
+
+    primaryexpr(c, reg);
+    if (c->lex.token == OPENSQUARE)
+    {
+        first = predicates(c, &N, 0);
+        emit(c, OP_FILTER, reg, reg, N, first);
+    }
+}
+
+static void primaryexpr(COMPILER *c, int reg)
+{
+    LEXER *lex = &c->lex;
+    int index;
+
+    switch (lex->token)
+    {
+        case LITERAL:
+            index = addstring(c, lex->input + lex->tokenpos + 1, lex->tokenend - lex->tokenpos - 2);
+            emit(c, OP_STRING, reg, 0, 0, index);
+            advance(lex);
+            break;
+        case NUMBER:
+            index = addnumber(c, xpathvm_number(lex->input + lex->tokenpos, lex->tokenend - lex->tokenpos));
+            emit(c, OP_NUMBER, reg, 0, 0, index);
+            advance(lex);
+            break;
+        case OPENPAREN:
+            advance(lex);
+            expr(c, reg);
+            match(lex, CLOSEPAREN);
+            break;
+        case FUNCTIONNAME:
+            functioncall(c, reg);
+            break;
+        case DOLLAR:
+            writeerror(lex, "Variables are not supported");
+            break;
+        default:
+            match(lex, LITERAL);
+            break;
+    }
+}
+
+static void functioncall(COMPILER *c, int reg)
+{
+    LEXER *lex = &c->lex;
+    const FUNCTION *fn;
+    int len = lex->tokenend - lex->tokenpos;
+    int N = 0;
+
+    for (fn = functions; fn->name; fn++)
+    {
+        if ((int) strlen(fn->name) == len && !strncmp(fn->name, lex->input + lex->tokenpos, len))
+            break;
+    }
+    if (!fn->name)
+    {
+        writeerror(lex, "Unknown function[%.*s]", len, lex->input + lex->tokenpos);
+        return;
+    }
+    advance(lex);
+    match(lex, OPENPAREN);
+    if (lex->token != CLOSEPAREN)
+    {
+        expr(c, reg + N++);
+        while (lex->token == COMMA && !haserror(lex))
+        {
+            advance(lex);
+            expr(c, reg + N++);
+        }
+    }
+    match(lex, CLOSEPAREN);
+    if (N < fn->minargs || (fn->maxargs >= 0 && N > fn->maxargs))
+        writeerror(lex, "Wrong number of arguments to %s()", fn->name);
+    emit(c, OP_CALL, reg, reg, N, fn->id);
+}
+
+/*
+    Steps, separated by '/' or '//'. descend is set if the first step
+    was introduced by '//'.
+ */
+static void relativepath(COMPILER *c, int reg, int descend)
+{
+    step(c, reg, descend);
+    while ((c->lex.token == SLASH || c->lex.token == SLASHSLASH) && !haserror(&c->lex))
+    {
+        descend = c->lex.token == SLASHSLASH;
+        advance(&c->lex);
+        step(c, reg, descend);
+    }
+}
+
+/*
+    A location step.
+
+    Notes: '//' is short for /descendant-or-self::node()/, but where the
+    step after it has no predicates which depend on position, //name is
+    the same as /descendant::name, which is one step rather than two.
+ */
+static void step(COMPILER *c, int reg, int descend)
+{
+    LEXER *lex = &c->lex;
+    STEP st;
+    STEP anynode;
+    const AXISNAMES *ax;
+    int len;
+    int index;
+
+    memset(&st, 0, sizeof(STEP));
+    memset(&anynode, 0, sizeof(STEP));
+    anynode.axis = AXIS_DESCENDANTORSELF;
+    anynode.test = TEST_NODE;
+
+    if (lex->token == DOT)
+    {
+        advance(lex);
+        if (descend)
+            emit(c, OP_STEP, reg, reg, 0, addstep(c, &anynode));
+        return;
+    }
+    if (lex->token == DOTDOT)
+    {
+        advance(lex);
+        st.axis = AXIS_PARENT;
+        st.test = TEST_NODE;
+    }
+    else
+    {
+        st.axis = AXIS_CHILD;
+        if (lex->token == STRUDEL)
+        {
+            advance(lex);
+            st.axis = AXIS_ATTRIBUTE;
+        }
+        else if (lex->token == AXISNAME)
+        {
+            len = lex->tokenend - lex->tokenpos;
+            for (ax = axes; ax->name; ax++)
+            {
+                if ((int) strlen(ax->name) == len && !strncmp(ax->name, lex->input + lex->tokenpos, len))
+                    break;
+            }
+            if (!ax->name)
+            {
+                writeerror(lex, "Unsupported axis[%.*s]", len, lex->input + lex->tokenpos);
+                return;
+            }
+            st.axis = ax->axis;
+            advance(lex);
+            match(lex, COLONCOLON);
+        }
+        nodetest(c, &st);
+        if (lex->token == OPENSQUARE)
+        {
+            st.predicates = predicates(c, &st.Npredicates, &st.positional);
+            if (!haserror(lex))
+                textquery(c, &st);
+        }
+    }
+
+    if (descend)
+    {
+        if (!st.positional && (st.axis == AXIS_CHILD || st.axis == AXIS_DESCENDANT))
+            st.axis = AXIS_DESCENDANT;
+        else if (st.positional || st.axis != AXIS_DESCENDANTORSELF)
+            emit(c, OP_STEP, reg, reg, 0, addstep(c, &anynode));
+    }
+    index = addstep(c, &st);
+    emit(c, OP_STEP, reg, reg, 0, index);
+}
+
+static void nodetest(COMPILER *c, STEP *st)
+{
+    LEXER *lex = &c->lex;
+    const char *name = lex->input + lex->tokenpos;
+    int len = lex->tokenend - lex->tokenpos;
+
+    switch (lex->token)
+    {
+        case ASTERISK:
+            st->test = TEST_ANY;
+            advance(lex);
+            break;
+        case NAME:
+            if (len > 2 && name[len-1] == '*')
+            {
+                st->test = TEST_PREFIX;
+                len--;
+            }
+            else
+                st->test = TEST_NAME;
+            st->name = malloc(len + 1);
+            if (!st->name)
+            {
+                writeerror(lex, "Out of memory");
+                return;
+            }
+            memcpy(st->name, name, len);
+            st->name[len] = 0;
+            st->namelen = len;
+            if (st->test == TEST_NAME)
+                st->tagfilter = xml_tagfilterbits(st->name);
+            advance(lex);
+            break;
+        case NODETYPE:
+            if (len == 4 && !strncmp(name, "node", 4))
+                st->test = TEST_NODE;
+            else if (len == 4 && !strncmp(name, "text", 4))
+                st->test = TEST_TEXT;
+            else
+                st->test = TEST_NONE;
+            advance(lex);
+            match(lex, OPENPAREN);
+            if (lex->token == LITERAL && st->test == TEST_NONE)
+                advance(lex);
+            match(lex, CLOSEPAREN);
+            break;
+        default:
+            match(lex, NAME);
+            break;
+    }
+}
+
+/*
+    Compile a run of predicates.
+
+    Params: c - the compiler
+            Npredicates - return for the number of predicates
+            positional - return for whether any may depend on position (may be 0)
+    Returns: the index of the first entry point.
+
+    Notes: each body is jumped over in the code around it, and leaves
+    its value in register 0 of its own frame.
+ */
+static int predicates(COMPILER *c, int *Npredicates, int *positional)
+{
+    LEXER *lex = &c->lex;
+    XPATHPROGRAM *prog = c->prog;
+    int entries[64];
+    int N = 0;
+    int jump;
+    int first;
+    int i;
+
+    while (lex->token == OPENSQUARE && !haserror(lex))
+    {
+        advance(lex);
+        jump = emit(c, OP_JUMP, 0, 0, 0, 0);
+        if (N == 64)
+        {
+            writeerror(lex, "Too many predicates");
+            break;
+        }
+        entries[N++] = prog->Ncode;
+        expr(c, 0);
+        if (positional && !haserror(lex) && ispositional(c, entries[N-1]))
+            *positional = 1;
+        emit(c, OP_RETURN, 0, 0, 0, 0);
+        patch(c, jump);
+        match(lex, CLOSESQUARE);
+    }
+
+    first = prog->Npredicates;
+    for (i = 0; i < N; i++)
+    {
+        if (prog->Npredicates == c->predicatecapacity)
+        {
+            int newcapacity = c->predicatecapacity ? c->predicatecapacity * 2 : 8;
+            int *temp = realloc(prog->predicates, newcapacity * sizeof(int));
+            if (!temp)
+            {
+                writeerror(lex, "Out of memory");
+                break;
+            }
+            prog->predicates = temp;
+            c->predicatecapacity = newcapacity;
+        }
+        prog->predicates[prog->Npredicates++] = entries[i];
+    }
+    *Npredicates = prog->Npredicates - first;
+
+    return first;
+}
+
+/*
+    Might a predicate body depend on the candidate's position? It does
+    if it calls position() or last(), or if it may give a number.
+ */
+static int ispositional(COMPILER *c, int entry)
+{
+    const INSTRUCTION *code = c->prog->code;
+    int end = c->prog->Ncode;
+    int i;
+
+    for (i = entry; i < end; i++)
+    {
+        if (code[i].op == OP_CALL && (code[i].arg == FN_LAST || code[i].arg == FN_POSITION))
+            return 1;
+    }
+    switch (code[end-1].op)
+    {
+        case OP_STRING:
+        case OP_CONTEXT:
+        case OP_ROOT:
+        case OP_STEP:
+        case OP_FILTER:
+        case OP_UNION:
+        case OP_BOOLEAN:
+        case OP_EQUALS:
+        case OP_NOTEQUALS:
+        case OP_LESS:
+        case OP_LESSEQUALS:
+        case OP_GREATER:
+        case OP_GREATEREQUALS:
+            return 0;
+        case OP_CALL:
+            switch (code[end-1].arg)
+            {
+                case FN_COUNT:
+                case FN_SUM:
+                case FN_NUMBER:
+                case FN_STRINGLENGTH:
+                case FN_FLOOR:
+                case FN_CEILING:
+                case FN_ROUND:
+                    return 1;
+            }
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+    Is the step's first predicate a query an index can answer? That is
+    contains() or starts-with() of text() or an attribute and a
+    literal, or text() = literal, for the text index, or @attr =
+    literal, for the attribute index. They compile to
+
+        context, step, string, call / equals, return
+
+    For the text index the literal must not be empty, as then the
+    predicate holds for nodes with no text, which the index does not
+    list.
+ */
+static void textquery(COMPILER *c, STEP *st)
+{
+    const XPATHPROGRAM *prog = c->prog;
+    const INSTRUCTION *code = prog->code + prog->predicates[st->predicates];
+    const STEP *tested;
+
+    if (prog->Ncode - prog->predicates[st->predicates] < 5)
+        return;
+    if (st->axis != AXIS_CHILD && st->axis != AXIS_DESCENDANT)
+        return;
+    if (st->test != TEST_NAME && st->test != TEST_PREFIX && st->test != TEST_ANY)
+        return;
+    if (code[0].op != OP_CONTEXT || code[1].op != OP_STEP || code[2].op != OP_STRING ||
+        code[4].op != OP_RETURN || code[0].dst != 0 || code[1].a != 0 || code[2].dst != 1)
+        return;
+    tested = &prog->steps[code[1].arg];
+    if (tested->Npredicates != 0)
+        return;
+    if (code[3].op == OP_EQUALS && code[3].a == 0 && code[3].b == 1 &&
+        tested->axis == AXIS_ATTRIBUTE && tested->test == TEST_NAME)
+    {
+        st->textmatch = XML_TEXT_EQUALS;
+        st->keylookup = 1;
+    }
+    else if (prog->strings[code[2].arg].len == 0)
+        return;
+    else if (code[3].op == OP_CALL && code[3].a == 0 && code[3].b == 2 &&
+        (code[3].arg == FN_CONTAINS || code[3].arg == FN_STARTSWITH))
+    {
+        if (tested->axis == AXIS_ATTRIBUTE && tested->test == TEST_NAME)
+            st->textmatch = code[3].arg == FN_CONTAINS ? XML_TEXT_CONTAINS : XML_TEXT_STARTSWITH;
+        else if (tested->axis == AXIS_CHILD && tested->test == TEST_TEXT)
+            st->textmatch = code[3].arg == FN_CONTAINS ? XML_TEXT_CONTAINS : XML_TEXT_STARTSWITH;
+    }
+    else if (code[3].op == OP_EQUALS && code[3].a == 0 && code[3].b == 1 &&
+             tested->axis == AXIS_CHILD && tested->test == TEST_TEXT)
+        st->textmatch = XML_TEXT_EQUALS;
+    if (st->textmatch)
+    {
+        st->textstep = code[1].arg;
+        st->textstring = code[2].arg;
+    }
+}
+
+static int startsstep(int token)
+{
+    switch (token)
+    {
+        case NAME:
+        case ASTERISK:
+        case STRUDEL:
+        case DOT:
+        case DOTDOT:
+        case AXISNAME:
+        case NODETYPE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+    Append an instruction.
+
+    Returns: its address, -1 on out of memory.
+ */
+static int emit(COMPILER *c, int op, int dst, int a, int b, int arg)
+{
+    XPATHPROGRAM *prog = c->prog;
+    INSTRUCTION *in;
+
+    if (prog->Ncode == c->codecapacity)
+    {
+        int newcapacity = c->codecapacity ? c->codecapacity * 2 : 32;
+        INSTRUCTION *temp = realloc(prog->code, newcapacity * sizeof(INSTRUCTION));
+        if (!temp)
+        {
+            writeerror(&c->lex, "Out of memory");
+            return -1;
+        }
+        prog->code = temp;
+        c->codecapacity = newcapacity;
+    }
+    in = &prog->code[prog->Ncode];
+    in->op = op;
+    in->dst = dst;
+    in->a = a;
+    in->b = b;
+    in->arg = arg;
+    if (dst >= prog->Nregisters)
+        prog->Nregisters = dst + 1;
+    if (op != OP_CALL && b >= prog->Nregisters)
+        prog->Nregisters = b + 1;
+
+    return prog->Ncode++;
+}
+
+/*
+    Point a jump at the next instruction.
+ */
+static void patch(COMPILER *c, int jump)
+{
+    if (jump >= 0)
+        c->prog->code[jump].arg = c->prog->Ncode;
+}
+
+static int addnumber(COMPILER *c, double x)
+{
+    XPATHPROGRAM *prog = c->prog;
+
+    if (prog->Nnumbers == c->numbercapacity)
+    {
+        int newcapacity = c->numbercapacity ? c->numbercapacity * 2 : 8;
+        double *temp = realloc(prog->numbers, newcapacity * sizeof(double));
+        if (!temp)
+        {
+            writeerror(&c->lex, "Out of memory");
+            return 0;
+        }
+        prog->numbers = temp;
+        c->numbercapacity = newcapacity;
+    }
+    prog->numbers[prog->Nnumbers] = x;
+
+    return prog->Nnumbers++;
+}
+
+static int addstring(COMPILER *c, const char *str, int len)
+{
+    XPATHPROGRAM *prog = c->prog;
+    char *copy;
+
+    if (prog->Nstrings == c->stringcapacity)
+    {
+        int newcapacity = c->stringcapacity ? c->stringcapacity * 2 : 8;
+        CONSTSTRING *temp = realloc(prog->strings, newcapacity * sizeof(CONSTSTRING));
+        if (!temp)
+            goto out_of_memory;
+        prog->strings = temp;
+        c->stringcapacity = newcapacity;
+    }
+    copy = malloc(len + 1);
+    if (!copy)
+        goto out_of_memory;
+    memcpy(copy, str, len);
+    copy[len] = 0;
+    prog->strings[prog->Nstrings].str = copy;
+    prog->strings[prog->Nstrings].len = len;
+
+    return prog->Nstrings++;
+
+out_of_memory:
+    writeerror(&c->lex, "Out of memory");
+    return 0;
+}
+
+/*
+    Add a step to the program, which takes ownership of its name.
+ */
+static int addstep(COMPILER *c, STEP *st)
+{
+    XPATHPROGRAM *prog = c->prog;
+
+    if (prog->Nsteps == c->stepcapacity)
+    {
+        int newcapacity = c->stepcapacity ? c->stepcapacity * 2 : 8;
+        STEP *temp = realloc(prog->steps, newcapacity * sizeof(STEP));
+        if (!temp)
+        {
+            free(st->name);
+            writeerror(&c->lex, "Out of memory");
+            return 0;
+        }
+        prog->steps = temp;
+        c->stepcapacity = newcapacity;
+    }
+    prog->steps[prog->Nsteps] = *st;
+
+    return prog->Nsteps++;
+}
+
+static int evaluate(MACHINE *vm, const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, VALUE *result)
+{
+    ITEM item;
+
+    memset(vm, 0, sizeof(MACHINE));
+    vm->prog = prog;
+    vm->doc = doc;
+    item.type = context ? ITEM_ELEMENT : ITEM_DOCUMENT;
+    item.node = context;
+    item.attr = 0;
+    item.index = 0;
+
+    return run(vm, 0, &item, 1, 1, result);
+}
+
+static void freemachine(MACHINE *vm)
+{
+    int i;
+
+    for (i = 0; i < vm->arena.Nblocks; i++)
+        free(vm->arena.blocks[i]);
+    free(vm->arena.blocks);
+    free(vm->arena.sizes);
+    free(vm->registers);
+    free(vm->items);
+}
+
+/*
+    Run code, from pc to its OP_RETURN, in a new register frame.
+
+    Params: vm - the machine
+            pc - address to start at
+            context - the context node
+            position - the context position
+            size - the context size
+            result - return for the value
+    Returns: 0 on success, -1 on error (the reason is in vm->err).
+
+    Notes: the register array may move whenever a predicate runs, so
+    operands are copied out before a step or filter, and the result
+    is stored through the array afterwards.
+ */
+static int run(MACHINE *vm, int pc, const ITEM *context, int position, int size, VALUE *result)
+{
+    const XPATHPROGRAM *prog = vm->prog;
+    const INSTRUCTION *in;
+    VALUE *r;
+    VALUE x, y, z;
+    int base = vm->Nregisters;
+
+    if (base + prog->Nregisters > vm->registercapacity)
+    {
+        int newcapacity = (base + prog->Nregisters) * 2;
+        VALUE *temp = realloc(vm->registers, newcapacity * sizeof(VALUE));
+        if (!temp)
+            goto out_of_memory;
+        vm->registers = temp;
+        vm->registercapacity = newcapacity;
+    }
+    vm->Nregisters += prog->Nregisters;
+
+    for (;;)
+    {
+        in = &prog->code[pc++];
+        r = vm->registers + base;
+        switch (in->op)
+        {
+            case OP_NUMBER:
+                setnumber(&r[in->dst], prog->numbers[in->arg]);
+                break;
+            case OP_STRING:
+                setstring(&r[in->dst], prog->strings[in->arg].str, prog->strings[in->arg].len);
+                break;
+            case OP_CONTEXT:
+                r[in->dst].type = VALUE_NODESET;
+                r[in->dst].start = vm->Nitems;
+                r[in->dst].N = 1;
+                if (additem(vm, context->type, context->node, context->attr, context->index))
+                    goto error_exit;
+                break;
+            case OP_ROOT:
+                r[in->dst].type = VALUE_NODESET;
+                r[in->dst].start = vm->Nitems;
+                r[in->dst].N = 1;
+                if (additem(vm, ITEM_DOCUMENT, 0, 0, 0))
+                    goto error_exit;
+                break;
+            case OP_STEP:
+                x = r[in->a];
+                if (requirenodeset(vm, &x))
+                    goto error_exit;
+                if (runstep(vm, &prog->steps[in->arg], &x, &y))
+                    goto error_exit;
+                vm->registers[base + in->dst] = y;
+                break;
+            case OP_FILTER:
+                x = r[in->a];
+                if (requirenodeset(vm, &x))
+                    goto error_exit;
+                if (runfilter(vm, prog->predicates + in->arg, in->b, &x, &y))
+                    goto error_exit;
+                vm->registers[base + in->dst] = y;
+                break;
+            case OP_UNION:
+                x = r[in->a];
+                y = r[in->b];
+                if (requirenodeset(vm, &x) || requirenodeset(vm, &y))
+                    goto error_exit;
+                if (unionsets(vm, &x, &y, &z))
+                    goto error_exit;
+                r[in->dst] = z;
+                break;
+            case OP_BOOLEAN:
+                setboolean(&r[in->dst], toboolean(&r[in->a]));
+                break;
+            case OP_JUMP:
+                pc = in->arg;
+                break;
+            case OP_JUMPIFTRUE:
+                if (r[in->a].number != 0)
+                    pc = in->arg;
+                break;
+            case OP_JUMPIFFALSE:
+                if (r[in->a].number == 0)
+                    pc = in->arg;
+                break;
+            case OP_EQUALS:
+            case OP_NOTEQUALS:
+            case OP_LESS:
+            case OP_LESSEQUALS:
+            case OP_GREATER:
+            case OP_GREATEREQUALS:
+                setboolean(&r[in->dst], compare(vm, in->op, &r[in->a], &r[in->b]));
+                break;
+            case OP_ADD:
+                setnumber(&r[in->dst], tonumber(vm, &r[in->a]) + tonumber(vm, &r[in->b]));
+                break;
+            case OP_SUBTRACT:
+                setnumber(&r[in->dst], tonumber(vm, &r[in->a]) - tonumber(vm, &r[in->b]));
+                break;
+            case OP_MULTIPLY:
+                setnumber(&r[in->dst], tonumber(vm, &r[in->a]) * tonumber(vm, &r[in->b]));
+                break;
+            case OP_DIVIDE:
+                setnumber(&r[in->dst], tonumber(vm, &r[in->a]) / tonumber(vm, &r[in->b]));
+                break;
+            case OP_MODULO:
+                setnumber(&r[in->dst], fmod(tonumber(vm, &r[in->a]), tonumber(vm, &r[in->b])));
+                break;
+            case OP_NEGATE:
+                setnumber(&r[in->dst], -tonumber(vm, &r[in->a]));
+                break;
+            case OP_CALL:
+                if (callfunction(vm, in->arg, &r[in->a], in->b, context, position, size, &x))
+                    goto error_exit;
+                r[in->dst] = x;
+                break;
+            case OP_RETURN:
+                *result = r[in->a];
+                vm->Nregisters = base;
+                return vm->err ? -1 : 0;
+        }
+        if (vm->err)
+            goto error_exit;
+    }
+
+out_of_memory:
+    vm->err = VM_OUTOFMEMORY;
+error_exit:
+    vm->Nregisters = base;
+    return -1;
+}
+
+/*
+    Run a predicate body on a candidate.
+
+    Notes: a number is true if it is the candidate's position, anything
+    else is converted to a boolean. Everything the body allocated is
+    given back.
+ */
+static int predicate(MACHINE *vm, int pc, const ITEM *context, int position, int size, int *truth)
+{
+    VALUE value;
+    ARENAMARK mark = arena_mark(vm);
+    int Nitems = vm->Nitems;
+
+    if (run(vm, pc, context, position, size, &value))
+        return -1;
+    if (value.type == VALUE_NUMBER)
+        *truth = value.number == position;
+    else
+        *truth = toboolean(&value);
+    vm->Nitems = Nitems;
+    arena_reset(vm, mark);
+
+    return 0;
+}
+
+/*
+    Filter the items from first to the end by each predicate in turn,
+    in place. Positions count in the order the items are stored.
+ */
+static int filter(MACHINE *vm, const int *entries, int N, int first)
+{
+    ITEM item;
+    int end, keep;
+    int i, j;
+    int truth;
+
+    for (j = 0; j < N; j++)
+    {
+        end = vm->Nitems;
+        keep = first;
+        for (i = first; i < end; i++)
+        {
+            item = vm->items[i];
+            if (predicate(vm, entries[j], &item, i - first + 1, end - first, &truth))
+                return -1;
+            if (truth)
+                vm->items[keep++] = item;
+        }
+        vm->Nitems = keep;
+    }
+
+    return 0;
+}
+
+/*
+    Run a location step from each node of a node-set.
+
+    Notes: the axis gives the candidates for each context node in
+    document order. Predicates count positions along the axis, so for
+    the reverse axes the candidates are turned round to filter them.
+    A context inside the subtree of the one before adds nothing new to
+    a plain descendant step, so it is skipped.
+ */
+static int runstep(MACHINE *vm, const STEP *st, const VALUE *context, VALUE *result)
+{
+    ITEM item;
+    int coverstart = INT_MAX;
+    int coverend = INT_MIN;
+    int start = vm->Nitems;
+    int first;
+    int reverse = isreverse(st->axis);
+    int i;
+
+    if (st->keylookup || (st->textmatch && xmldoc_hastextindex(vm->doc)))
+        return indexedstep(vm, st, context, result);
+
+    for (i = 0; i < context->N; i++)
+    {
+        item = vm->items[context->start + i];
+        if ((st->axis == AXIS_DESCENDANT || st->axis == AXIS_DESCENDANTORSELF) && st->Npredicates == 0)
+        {
+            if ((item.type == ITEM_ELEMENT || item.type == ITEM_TEXT) &&
+                item.node->preorder >= coverstart && item.node->preorder <= coverend)
+                continue;
+            if (item.type == ITEM_DOCUMENT)
+            {
+                coverstart = INT_MIN;
+                coverend = INT_MAX;
+            }
+            else if (item.type == ITEM_ELEMENT)
+            {
+                coverstart = item.node->preorder;
+                coverend = item.node->subtreeend;
+            }
+        }
+        first = vm->Nitems;
+        if (axis(vm, st, &item))
+            return -1;
+        if (st->Npredicates > 0)
+        {
+            if (reverse)
+                reverseitems(vm, first, vm->Nitems);
+            if (filter(vm, vm->prog->predicates + st->predicates, st->Npredicates, first))
+                return -1;
+            if (reverse)
+                reverseitems(vm, first, vm->Nitems);
+        }
+    }
+    result->type = VALUE_NODESET;
+    result->start = start;
+    result->N = vm->Nitems - start;
+    if (context->N > 1)
+        normalise(vm, result);
+
+    return 0;
+}
+
+/*
+    Run a step whose first predicate is an index query.
+
+    Notes: an @attr = literal query goes to the attribute index, which
+    is built if need be, the others to the text index. The index is
+    asked once for every node in the document which passes the query. For a descendant step each context node then
+    takes the range of them in its subtree, and for a child step each
+    child is looked for in the list, so the first predicate is never
+    run. The rest are, and as the first one does not depend on
+    position, the positions they see are the same.
+ */
+static int indexedstep(MACHINE *vm, const STEP *st, const VALUE *context, VALUE *result)
+{
+    const STEP *tested = &vm->prog->steps[st->textstep];
+    const char *attr = tested->axis == AXIS_ATTRIBUTE ? tested->name : 0;
+    const char *str = vm->prog->strings[st->textstring].str;
+    XMLNODE **nodes = 0;
+    XMLNODE *child;
+    ITEM item;
+    int Nnodes = 0;
+    int start = vm->Nitems;
+    int first;
+    int low, high;
+    int i, j;
+
+    if (st->keylookup && xmldoc_buildattributeindex(vm->doc, attr))
+    {
+        vm->err = VM_OUTOFMEMORY;
+        return -1;
+    }
+    if (vm->doc->root && st->keylookup)
+        nodes = xmldoc_getnodesbyattribute(vm->doc, vm->doc->root, attr, str, &Nnodes);
+    else if (vm->doc->root)
+        nodes = xmldoc_getnodesbytext(vm->doc, vm->doc->root, attr, str, st->textmatch, &Nnodes);
+    if (Nnodes < 0)
+    {
+        vm->err = VM_OUTOFMEMORY;
+        return -1;
+    }
+    for (i = 0; i < context->N; i++)
+    {
+        item = vm->items[context->start + i];
+        if (item.type == ITEM_DOCUMENT)
+        {
+            child = vm->doc->root;
+            low = INT_MIN;
+            high = INT_MAX;
+        }
+        else if (item.type == ITEM_ELEMENT)
+        {
+            child = item.node->child;
+            low = item.node->preorder + 1;
+            high = item.node->subtreeend;
+        }
+        else
+            continue;
+        first = vm->Nitems;
+        if (st->axis == AXIS_CHILD)
+        {
+            for (; child; child = child->next)
+            {
+                j = nodeslowerbound(nodes, Nnodes, child->preorder);
+                if (j < Nnodes && nodes[j] == child && matchelement(st, child) &&
+                    additem(vm, ITEM_ELEMENT, child, 0, 0))
+                    goto error_exit;
+            }
+        }
+        else
+        {
+            for (j = nodeslowerbound(nodes, Nnodes, low); j < Nnodes && nodes[j]->preorder <= high; j++)
+            {
+                if (matchelement(st, nodes[j]) && additem(vm, ITEM_ELEMENT, nodes[j], 0, 0))
+                    goto error_exit;
+            }
+        }
+        if (filter(vm, vm->prog->predicates + st->predicates + 1, st->Npredicates - 1, first))
+            goto error_exit;
+    }
+    free(nodes);
+    result->type = VALUE_NODESET;
+    result->start = start;
+    result->N = vm->Nitems - start;
+    if (context->N > 1)
+        normalise(vm, result);
+
+    return 0;
+
+error_exit:
+    free(nodes);
+    return -1;
+}
+
+/*
+    Index of the first node in a document-ordered list at or after preorder.
+ */
+static int nodeslowerbound(XMLNODE **nodes, int N, int preorder)
+{
+    int low = 0;
+    int high = N;
+    int mid;
+
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        if (nodes[mid]->preorder < preorder)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/*
+    Filter a node-set by predicates, as in (expr)[predicate].
+ */
+static int runfilter(MACHINE *vm, const int *entries, int N, const VALUE *set, VALUE *result)
+{
+    int start = vm->Nitems;
+    int i;
+
+    for (i = 0; i < set->N; i++)
+    {
+        ITEM item = vm->items[set->start + i];
+        if (additem(vm, item.type, item.node, item.attr, item.index))
+            return -1;
+    }
+    if (filter(vm, entries, N, start))
+        return -1;
+    result->type = VALUE_NODESET;
+    result->start = start;
+    result->N = vm->Nitems - start;
+
+    return 0;
+}
+
+/*
+    Merge two node-sets in document order, dropping duplicates.
+ */
+static int unionsets(MACHINE *vm, const VALUE *a, const VALUE *b, VALUE *result)
+{
+    ITEM item;
+    int start = vm->Nitems;
+    int i = 0;
+    int j = 0;
+    int diff;
+
+    while (i < a->N || j < b->N)
+    {
+        if (i == a->N)
+            diff = 1;
+        else if (j == b->N)
+            diff = -1;
+        else
+            diff = compareitems(&vm->items[a->start + i], &vm->items[b->start + j]);
+        if (diff <= 0)
+            item = vm->items[a->start + i++];
+        else
+            item = vm->items[b->start + j++];
+        if (diff == 0)
+            j++;
+        if (additem(vm, item.type, item.node, item.attr, item.index))
+            return -1;
+    }
+    result->type = VALUE_NODESET;
+    result->start = start;
+    result->N = vm->Nitems - start;
+
+    return 0;
+}
+
+/*
+    Add the nodes along an axis which pass the node test, in document order.
+ */
+static int axis(MACHINE *vm, const STEP *st, const ITEM *item)
+{
+    XMLNODE *node = item->node;
+    XMLNODE *sib;
+    XMLATTRIBUTE *attr;
+    ITEM up;
+    int first;
+    int index;
+
+    switch (st->axis)
+    {
+        case AXIS_CHILD:
+            if (item->type == ITEM_DOCUMENT)
+                return vm->doc->root ? element(vm, st, vm->doc->root) : 0;
+            if (item->type != ITEM_ELEMENT)
+                return 0;
+            if (text(vm, st, node))
+                return -1;
+            for (sib = node->child; sib; sib = sib->next)
+                if (element(vm, st, sib))
+                    return -1;
+            return 0;
+        case AXIS_DESCENDANTORSELF:
+            if (matchitem(st, item) && additem(vm, item->type, node, item->attr, item->index))
+                return -1;
+            /* fall through */
+        case AXIS_DESCENDANT:
+            if (item->type == ITEM_DOCUMENT)
+                return vm->doc->root ? subtree(vm, st, vm->doc->root) : 0;
+            if (item->type != ITEM_ELEMENT)
+                return 0;
+            if (text(vm, st, node))
+                return -1;
+            for (sib = node->child; sib; sib = sib->next)
+                if (subtree(vm, st, sib))
+                    return -1;
+            return 0;
+        case AXIS_SELF:
+            if (matchitem(st, item))
+                return additem(vm, item->type, node, item->attr, item->index);
+            return 0;
+        case AXIS_PARENT:
+            if (parentitem(item, &up) && matchitem(st, &up))
+                return additem(vm, up.type, up.node, 0, 0);
+            return 0;
+        case AXIS_ANCESTORORSELF:
+        case AXIS_ANCESTOR:
+            first = vm->Nitems;
+            up = *item;
+            if (st->axis == AXIS_ANCESTORORSELF && matchitem(st, &up) &&
+                additem(vm, up.type, up.node, up.attr, up.index))
+                return -1;
+            while (parentitem(&up, &up))
+            {
+                if (matchitem(st, &up) && additem(vm, up.type, up.node, 0, 0))
+                    return -1;
+            }
+            reverseitems(vm, first, vm->Nitems);
+            return 0;
+        case AXIS_FOLLOWINGSIBLING:
+            if (item->type != ITEM_ELEMENT)
+                return 0;
+            for (sib = node->next; sib; sib = sib->next)
+                if (element(vm, st, sib))
+                    return -1;
+            return 0;
+        case AXIS_PRECEDINGSIBLING:
+            if (item->type != ITEM_ELEMENT || !node->parent)
+                return 0;
+            for (sib = node->parent->child; sib && sib != node; sib = sib->next)
+                if (element(vm, st, sib))
+                    return -1;
+            return 0;
+        case AXIS_FOLLOWING:
+            return following(vm, st, item);
+        case AXIS_PRECEDING:
+            return preceding(vm, st, item);
+        case AXIS_ATTRIBUTE:
+            if (item->type != ITEM_ELEMENT)
+                return 0;
+            index = 0;
+            for (attr = node->attributes; attr; attr = attr->next)
+            {
+                if (matchattribute(st, attr) && additem(vm, ITEM_ATTRIBUTE, node, attr, index))
+                    return -1;
+                index++;
+            }
+            return 0;
+    }
+
+    return 0;
+}
+
+/*
+    Everything after the node in document order, except its descendants.
+ */
+static int following(MACHINE *vm, const STEP *st, const ITEM *item)
+{
+    XMLNODE *node = item->node;
+    XMLNODE *sib;
+
+    if (item->type == ITEM_DOCUMENT)
+        return 0;
+    if (item->type == ITEM_ATTRIBUTE && text(vm, st, node))
+        return -1;
+    if (item->type != ITEM_ELEMENT)
+    {
+        for (sib = node->child; sib; sib = sib->next)
+            if (subtree(vm, st, sib))
+                return -1;
+    }
+    for (; node; node = node->parent)
+    {
+        for (sib = node->next; sib; sib = sib->next)
+            if (subtree(vm, st, sib))
+                return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Everything before the node in document order, except its ancestors.
+
+    Notes: the ancestors' text comes before the node, so it is included.
+ */
+static int preceding(MACHINE *vm, const STEP *st, const ITEM *item)
+{
+    XMLNODE *target = item->node;
+    XMLNODE *node;
+
+    if (item->type == ITEM_DOCUMENT)
+        return 0;
+    node = vm->doc->root;
+    while (node && node != target)
+    {
+        if (node->preorder < target->preorder && target->preorder <= node->subtreeend)
+        {
+            if (text(vm, st, node))
+                return -1;
+        }
+        else if (element(vm, st, node) || text(vm, st, node))
+            return -1;
+        if (node->child)
+            node = node->child;
+        else
+        {
+            while (node && !node->next)
+                node = node->parent;
+            if (node)
+                node = node->next;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    A node and everything under it, in document order.
+
+    Notes: for a name test, subtrees whose tag filter rules the name
+    out are passed over.
+ */
+static int subtree(MACHINE *vm, const STEP *st, XMLNODE *top)
+{
+    XMLNODE *node = top;
+
+    for (;;)
+    {
+        if (xml_maycontaintag(node, st->tagfilter))
+        {
+            if (element(vm, st, node) || text(vm, st, node))
+                return -1;
+            if (node->child)
+            {
+                node = node->child;
+                continue;
+            }
+        }
+        while (node != top && !node->next)
+            node = node->parent;
+        if (node == top)
+            break;
+        node = node->next;
+    }
+
+    return 0;
+}
+
+static int element(MACHINE *vm, const STEP *st, XMLNODE *node)
+{
+    if (!matchelement(st, node))
+        return 0;
+    return additem(vm, ITEM_ELEMENT, node, 0, 0);
+}
+
+/*
+    The text of an element, if the test lets text through.
+ */
+static int text(MACHINE *vm, const STEP *st, XMLNODE *node)
+{
+    if ((st->test == TEST_NODE || st->test == TEST_TEXT) && node->datalen > 0)
+        return additem(vm, ITEM_TEXT, node, 0, 0);
+    return 0;
+}
+
+static int matchitem(const STEP *st, const ITEM *item)
+{
+    switch (item->type)
+    {
+        case ITEM_DOCUMENT:
+            return st->test == TEST_NODE;
+        case ITEM_ELEMENT:
+            return matchelement(st, item->node);
+        case ITEM_ATTRIBUTE:
+            if (st->axis == AXIS_ATTRIBUTE)
+                return matchattribute(st, item->attr);
+            return st->test == TEST_NODE;
+        case ITEM_TEXT:
+            return st->test == TEST_NODE || st->test == TEST_TEXT;
+    }
+
+    return 0;
+}
+
+static int matchelement(const STEP *st, XMLNODE *node)
+{
+    COUNTVISIT();
+    switch (st->test)
+    {
+        case TEST_NAME:
+            return node->taglen == st->namelen && !memcmp(node->tag, st->name, st->namelen);
+        case TEST_PREFIX:
+            return node->taglen > st->namelen && !memcmp(node->tag, st->name, st->namelen);
+        case TEST_ANY:
+        case TEST_NODE:
+            return 1;
+    }
+
+    return 0;
+}
+
+static int matchattribute(const STEP *st, XMLATTRIBUTE *attr)
+{
+    COUNTVISIT();
+    switch (st->test)
+    {
+        case TEST_NAME:
+            return !strcmp(attr->name, st->name);
+        case TEST_PREFIX:
+            return !strncmp(attr->name, st->name, st->namelen) && attr->name[st->namelen];
+        case TEST_ANY:
+        case TEST_NODE:
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+    Get the parent of an item. The parent of an attribute or text is the
+    element it belongs to, and of the root, the document.
+
+    Returns: 1 if there is a parent, 0 for the document.
+ */
+static int parentitem(const ITEM *item, ITEM *parent)
+{
+    XMLNODE *node = item->node;
+
+    switch (item->type)
+    {
+        case ITEM_DOCUMENT:
+            return 0;
+        case ITEM_ELEMENT:
+            parent->node = node->parent;
+            parent->type = node->parent ? ITEM_ELEMENT : ITEM_DOCUMENT;
+            break;
+        default:
+            parent->node = node;
+            parent->type = ITEM_ELEMENT;
+            break;
+    }
+    parent->attr = 0;
+    parent->index = 0;
+
+    return 1;
+}
+
+static int isreverse(int axis)
+{
+    return axis == AXIS_ANCESTOR || axis == AXIS_ANCESTORORSELF ||
+        axis == AXIS_PRECEDING || axis == AXIS_PRECEDINGSIBLING;
+}
+
+static int additem(MACHINE *vm, int type, XMLNODE *node, XMLATTRIBUTE *attr, int index)
+{
+    ITEM *item;
+
+    if (vm->Nitems == vm->itemcapacity)
+    {
+        int newcapacity = vm->itemcapacity ? vm->itemcapacity * 2 : 256;
+        ITEM *temp = realloc(vm->items, newcapacity * sizeof(ITEM));
+        if (!temp)
+        {
+            vm->err = VM_OUTOFMEMORY;
+            return -1;
+        }
+        vm->items = temp;
+        vm->itemcapacity = newcapacity;
+    }
+    item = &vm->items[vm->Nitems++];
+    item->node = node;
+    item->attr = attr;
+    item->type = type;
+    item->index = index;
+
+    return 0;
+}
+
+static void reverseitems(MACHINE *vm, int start, int end)
+{
+    ITEM temp;
+
+    for (end--; start < end; start++, end--)
+    {
+        temp = vm->items[start];
+        vm->items[start] = vm->items[end];
+        vm->items[end] = temp;
+    }
+}
+
+/*
+    Put a node-set at the top of the item array into document order
+    and remove duplicates. Sets from one context node are already in
+    order, so the sort is only done if a check finds it is needed.
+ */
+static void normalise(MACHINE *vm, VALUE *set)
+{
+    ITEM *items = vm->items + set->start;
+    int i, j;
+
+    for (i = 1; i < set->N; i++)
+    {
+        if (compareitems(&items[i-1], &items[i]) >= 0)
+            break;
+    }
+    if (i >= set->N)
+        return;
+
+    qsort(items, set->N, sizeof(ITEM), compareitemsqsort);
+    j = 1;
+    for (i = 1; i < set->N; i++)
+    {
+        if (compareitems(&items[j-1], &items[i]) != 0)
+            items[j++] = items[i];
+    }
+    set->N = j;
+    vm->Nitems = set->start + set->N;
+}
+
+/*
+    Document order. An element comes first, then its attributes in the
+    order they were written, then its text, then its children.
+ */
+static int compareitems(const ITEM *a, const ITEM *b)
+{
+    int pa = a->node ? a->node->preorder : -1;
+    int pb = b->node ? b->node->preorder : -1;
+    int sa, sb;
+
+    if (pa != pb)
+        return pa < pb ? -1 : 1;
+    sa = a->type == ITEM_ATTRIBUTE ? 1 + a->index : a->type == ITEM_TEXT ? INT_MAX : 0;
+    sb = b->type == ITEM_ATTRIBUTE ? 1 + b->index : b->type == ITEM_TEXT ? INT_MAX : 0;
+    if (sa != sb)
+        return sa < sb ? -1 : 1;
+
+    return 0;
+}
+
+static int compareitemsqsort(const void *e1, const void *e2)
+{
+    return compareitems((const ITEM *) e1, (const ITEM *) e2);
+}
+
+/*
+    Call a library function.
+
+    Notes: the arguments are in registers, which may be overwritten.
+ */
+static int callfunction(MACHINE *vm, int fn, VALUE *args, int N, const ITEM *context, int position, int size, VALUE *result)
+{
+    const char *str;
+    int len;
+    double sum;
+    ARENAMARK mark;
+    int i, pos;
+
+    switch (fn)
+    {
+        case FN_LAST:
+            setnumber(result, size);
+            break;
+        case FN_POSITION:
+            setnumber(result, position);
+            break;
+        case FN_COUNT:
+            if (requirenodeset(vm, &args[0]))
+                return -1;
+            setnumber(result, args[0].N);
+            break;
+        case FN_ID:
+            return idfunction(vm, &args[0], result);
+        case FN_LOCALNAME:
+        case FN_NAME:
+            if (nodename(vm, args, N, context, &str, &len))
+                return -1;
+            if (fn == FN_LOCALNAME)
+            {
+                for (i = len - 1; i >= 0 && str[i] != ':'; i--)
+                    continue;
+                str += i + 1;
+                len -= i + 1;
+            }
+            setstring(result, str, len);
+            break;
+        case FN_NAMESPACEURI:
+            if (nodename(vm, args, N, context, &str, &len))
+                return -1;
+            setstring(result, "", 0);
+            break;
+        case FN_STRING:
+            if (N == 0 ? stringvalue(vm, context, &str, &len) : tostring(vm, &args[0], &str, &len))
+                return -1;
+            setstring(result, str, len);
+            break;
+        case FN_CONCAT:
+        {
+            char *buff;
+
+            len = 0;
+            for (i = 0; i < N; i++)
+            {
+                if (tostring(vm, &args[i], &str, &args[i].len))
+                    return -1;
+                args[i].str = str;
+                len += args[i].len;
+            }
+            buff = arena_alloc(vm, len + 1);
+            if (!buff)
+                return -1;
+            len = 0;
+            for (i = 0; i < N; i++)
+            {
+                memcpy(buff + len, args[i].str, args[i].len);
+                len += args[i].len;
+            }
+            setstring(result, buff, len);
+            break;
+        }
+        case FN_STARTSWITH:
+        case FN_CONTAINS:
+        case FN_SUBSTRINGBEFORE:
+        case FN_SUBSTRINGAFTER:
+            if (tostring(vm, &args[0], &args[0].str, &args[0].len) ||
+                tostring(vm, &args[1], &args[1].str, &args[1].len))
+                return -1;
+            if (fn == FN_STARTSWITH)
+            {
+                setboolean(result, args[1].len <= args[0].len &&
+                           !memcmp(args[0].str, args[1].str, args[1].len));
+                break;
+            }
+            pos = findstring(args[0].str, args[0].len, args[1].str, args[1].len);
+            if (fn == FN_CONTAINS)
+                setboolean(result, pos >= 0);
+            else if (pos < 0)
+                setstring(result, "", 0);
+            else if (fn == FN_SUBSTRINGBEFORE)
+                setstring(result, args[0].str, pos);
+            else
+                setstring(result, args[0].str + pos + args[1].len, args[0].len - pos - args[1].len);
+            break;
+        case FN_SUBSTRING:
+            if (tostring(vm, &args[0], &args[0].str, &args[0].len))
+                return -1;
+            setnumber(&args[1], tonumber(vm, &args[1]));
+            if (N == 3)
+                setnumber(&args[2], tonumber(vm, &args[2]));
+            return substring(args, N, result);
+        case FN_STRINGLENGTH:
+            if (N == 0 ? stringvalue(vm, context, &str, &len) : tostring(vm, &args[0], &str, &len))
+                return -1;
+            setnumber(result, utf8length(str, len));
+            break;
+        case FN_NORMALIZESPACE:
+            if (N == 0 ? stringvalue(vm, context, &str, &len) : tostring(vm, &args[0], &str, &len))
+                return -1;
+            return normalizespace(vm, str, len, result);
+        case FN_TRANSLATE:
+            for (i = 0; i < 3; i++)
+            {
+                if (tostring(vm, &args[i], &str, &len))
+                    return -1;
+                setstring(&args[i], str, len);
+            }
+            return translate(vm, &args[0], &args[1], &args[2], result);
+        case FN_BOOLEAN:
+            setboolean(result, toboolean(&args[0]));
+            break;
+        case FN_NOT:
+            setboolean(result, !toboolean(&args[0]));
+            break;
+        case FN_TRUE:
+            setboolean(result, 1);
+            break;
+        case FN_FALSE:
+            setboolean(result, 0);
+            break;
+        case FN_LANG:
+            i = langfunction(vm, &args[0], context);
+            if (i < 0)
+                return -1;
+            setboolean(result, i);
+            break;
+        case FN_NUMBER:
+            if (N == 0)
+            {
+                mark = arena_mark(vm);
+                if (stringvalue(vm, context, &str, &len))
+                    return -1;
+                setnumber(result, xpathvm_number(str, len));
+                arena_reset(vm, mark);
+            }
+            else
+                setnumber(result, tonumber(vm, &args[0]));
+            break;
+        case FN_SUM:
+            if (requirenodeset(vm, &args[0]))
+                return -1;
+            sum = 0;
+            mark = arena_mark(vm);
+            for (i = 0; i < args[0].N; i++)
+            {
+                if (stringvalue(vm, &vm->items[args[0].start + i], &str, &len))
+                    return -1;
+                sum += xpathvm_number(str, len);
+                arena_reset(vm, mark);
+            }
+            setnumber(result, sum);
+            break;
+        case FN_FLOOR:
+            setnumber(result, floor(tonumber(vm, &args[0])));
+            break;
+        case FN_CEILING:
+            setnumber(result, ceil(tonumber(vm, &args[0])));
+            break;
+        case FN_ROUND:
+            setnumber(result, xround(tonumber(vm, &args[0])));
+            break;
+    }
+
+    return vm->err ? -1 : 0;
+}
+
+/*
+    id(): the elements whose id is one of the whitespace-separated
+    tokens in the argument (or in the string values of its nodes).
+
+    Notes: the id attribute is "id" unless the document says otherwise.
+    Its index is built before any token is looked up, so running out
+    of memory is an error and a failed lookup only means no such id.
+    Where elements share an id the first one is taken.
+ */
+static int idfunction(MACHINE *vm, VALUE *arg, VALUE *result)
+{
+    const char *idattr = vm->doc->idattribute ? vm->doc->idattribute : "id";
+    XMLNODE *node;
+    const char *str;
+    char *id;
+    int Nids;
+    int start = vm->Nitems;
+    int i, j, k, len;
+
+    if (xmldoc_buildattributeindex(vm->doc, idattr))
+    {
+        vm->err = VM_OUTOFMEMORY;
+        return -1;
+    }
+    Nids = arg->type == VALUE_NODESET ? arg->N : 1;
+    for (i = 0; i < Nids; i++)
+    {
+        if (arg->type == VALUE_NODESET)
+        {
+            if (stringvalue(vm, &vm->items[arg->start + i], &str, &len))
+                return -1;
+        }
+        else if (tostring(vm, arg, &str, &len))
+            return -1;
+        j = 0;
+        while (j < len)
+        {
+            if (isspace((unsigned char) str[j]))
+            {
+                j++;
+                continue;
+            }
+            for (k = j; k < len && !isspace((unsigned char) str[k]); k++)
+                continue;
+            id = arena_alloc(vm, k - j + 1);
+            if (!id)
+                return -1;
+            memcpy(id, str + j, k - j);
+            id[k - j] = 0;
+            node = xmldoc_getnodebykey(vm->doc, idattr, id);
+            if (node && additem(vm, ITEM_ELEMENT, node, 0, 0))
+                return -1;
+            j = k;
+        }
+    }
+    result->type = VALUE_NODESET;
+    result->start = start;
+    result->N = vm->Nitems - start;
+    normalise(vm, result);
+
+    return 0;
+}
+
+/*
+    lang(): is the xml:lang in scope the language asked for, or a
+    sub-language of it?
+
+    Returns: 1 or 0, -1 on error.
+ */
+static int langfunction(MACHINE *vm, VALUE *arg, const ITEM *context)
+{
+    XMLNODE *node;
+    const char *lang;
+    const char *str;
+    int len;
+    int i;
+
+    if (tostring(vm, arg, &str, &len))
+        return -1;
+    node = context->node;
+    for (; node; node = node->parent)
+    {
+        lang = xml_getattribute(node, "xml:lang");
+        if (lang)
+        {
+            for (i = 0; i < len; i++)
+            {
+                if (tolower((unsigned char) lang[i]) != tolower((unsigned char) str[i]))
+                    return 0;
+            }
+            return lang[len] == 0 || lang[len] == '-';
+        }
+    }
+
+    return 0;
+}
+
+/*
+    The name of the first node of the argument, or of the context node.
+ */
+static int nodename(MACHINE *vm, VALUE *args, int N, const ITEM *context, const char **str, int *len)
+{
+    const ITEM *item = context;
+
+    *str = "";
+    *len = 0;
+    if (N > 0)
+    {
+        if (requirenodeset(vm, &args[0]))
+            return -1;
+        if (args[0].N == 0)
+            return 0;
+        item = &vm->items[args[0].start];
+    }
+    if (item->type == ITEM_ELEMENT)
+    {
+        *str = item->node->tag;
+        *len = item->node->taglen;
+    }
+    else if (item->type == ITEM_ATTRIBUTE)
+    {
+        *str = item->attr->name;
+        *len = (int) strlen(item->attr->name);
+    }
+
+    return 0;
+}
+
+/*
+    translate(): characters of s found in from are replaced by the
+    character at the same place in to, or dropped if to is shorter.
+ */
+static int translate(MACHINE *vm, const VALUE *s, const VALUE *from, const VALUE *to, VALUE *result)
+{
+    char *buff;
+    int N = 0;
+    int i, j, k, n, m;
+    int ch, fch, tch;
+    int index;
+
+    buff = arena_alloc(vm, s->len * 4 + 1);
+    if (!buff)
+        return -1;
+    for (i = 0; i < s->len; i += n)
+    {
+        n = utf8decode(s->str + i, s->len - i, &ch);
+        index = -1;
+        for (j = 0, k = 0; j < from->len; j += m, k++)
+        {
+            m = utf8decode(from->str + j, from->len - j, &fch);
+            if (fch == ch)
+            {
+                index = k;
+                break;
+            }
+        }
+        if (index < 0)
+        {
+            memcpy(buff + N, s->str + i, n);
+            N += n;
+            continue;
+        }
+        for (j = 0, k = 0; j < to->len; j += m, k++)
+        {
+            m = utf8decode(to->str + j, to->len - j, &tch);
+            if (k == index)
+            {
+                N += utf8encode(tch, buff + N);
+                break;
+            }
+        }
+    }
+    setstring(result, buff, N);
+
+    return 0;
+}
+
+static int normalizespace(MACHINE *vm, const char *str, int len, VALUE *result)
+{
+    char *buff;
+    int N = 0;
+    int space = 0;
+    int i;
+
+    buff = arena_alloc(vm, len + 1);
+    if (!buff)
+        return -1;
+    for (i = 0; i < len; i++)
+    {
+        if (str[i] == ' ' || str[i] == '\t' || str[i] == '\n' || str[i] == '\r')
+            space = 1;
+        else
+        {
+            if (space && N > 0)
+                buff[N++] = ' ';
+            space = 0;
+            buff[N++] = str[i];
+        }
+    }
+    setstring(result, buff, N);
+
+    return 0;
+}
+
+/*
+    substring(): characters are counted from 1, and the start and
+    length are rounded, with the odd results for NaN and infinity
+    the standard requires.
+ */
+static int substring(VALUE *args, int N, VALUE *result)
+{
+    const char *str = args[0].str;
+    int len = args[0].len;
+    double first = xround(args[1].number);
+    double last = N == 3 ? first + xround(args[2].number) : INFINITY;
+    int start = -1;
+    int end = len;
+    int position = 1;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (((unsigned char) str[i] & 0xC0) == 0x80)
+            continue;
+        if (start < 0 && position >= first && position < last)
+            start = i;
+        else if (start >= 0 && !(position < last))
+        {
+            end = i;
+            break;
+        }
+        position++;
+    }
+    if (start < 0)
+        setstring(result, "", 0);
+    else
+        setstring(result, str + start, end - start);
+
+    return 0;
+}
+
+/*
+    Compare two values by the XPath rules.
+
+    Notes: with node-sets the comparison is true if it is true for any
+    node. Otherwise = and != compare as booleans if either side is one,
+    then as numbers, then as strings, and the others always as numbers.
+ */
+static int compare(MACHINE *vm, int op, const VALUE *a, const VALUE *b)
+{
+    const char *sa, *sb;
+    int la, lb;
+    int equal;
+
+    if (a->type == VALUE_NODESET && b->type == VALUE_NODESET)
+        return comparesets(vm, op, a, b);
+    if (a->type == VALUE_NODESET)
+        return comparewithset(vm, op, a, b);
+    if (b->type == VALUE_NODESET)
+        return comparewithset(vm, swapop(op), b, a);
+
+    if (op == OP_EQUALS || op == OP_NOTEQUALS)
+    {
+        if (a->type == VALUE_BOOLEAN || b->type == VALUE_BOOLEAN)
+            equal = toboolean(a) == toboolean(b);
+        else if (a->type == VALUE_NUMBER || b->type == VALUE_NUMBER)
+            return comparenumbers(op, tonumber(vm, a), tonumber(vm, b));
+        else
+        {
+            if (tostring(vm, a, &sa, &la) || tostring(vm, b, &sb, &lb))
+                return 0;
+            equal = la == lb && !memcmp(sa, sb, la);
+        }
+        return op == OP_EQUALS ? equal : !equal;
+    }
+
+    return comparenumbers(op, tonumber(vm, a), tonumber(vm, b));
+}
+
+static int comparewithset(MACHINE *vm, int op, const VALUE *set, const VALUE *other)
+{
+    ARENAMARK mark;
+    const char *str;
+    int len;
+    int truth = 0;
+    int i;
+
+    if (other->type == VALUE_BOOLEAN)
+        return comparenumbers(op, set->N > 0, other->number);
+
+    mark = arena_mark(vm);
+    for (i = 0; i < set->N && !truth; i++)
+    {
+        if (stringvalue(vm, &vm->items[set->start + i], &str, &len))
+            return 0;
+        if (other->type == VALUE_NUMBER)
+            truth = comparenumbers(op, xpathvm_number(str, len), other->number);
+        else if (op == OP_EQUALS)
+            truth = len == other->len && !memcmp(str, other->str, len);
+        else if (op == OP_NOTEQUALS)
+            truth = len != other->len || memcmp(str, other->str, len);
+        else
+            truth = comparenumbers(op, xpathvm_number(str, len), xpathvm_number(other->str, other->len));
+        arena_reset(vm, mark);
+    }
+
+    return truth;
+}
+
+static int comparesets(MACHINE *vm, int op, const VALUE *a, const VALUE *b)
+{
+    ARENAMARK mark;
+    VALUE value;
+    const char *str;
+    int len;
+    int truth = 0;
+    int i;
+
+    mark = arena_mark(vm);
+    for (i = 0; i < a->N && !truth; i++)
+    {
+        if (stringvalue(vm, &vm->items[a->start + i], &str, &len))
+            return 0;
+        if (op == OP_EQUALS || op == OP_NOTEQUALS)
+            setstring(&value, str, len);
+        else
+            setnumber(&value, xpathvm_number(str, len));
+        truth = comparewithset(vm, swapop(op), b, &value);
+        arena_reset(vm, mark);
+    }
+
+    return truth;
+}
+
+static int comparenumbers(int op, double x, double y)
+{
+    switch (op)
+    {
+        case OP_EQUALS: return x == y;
+        case OP_NOTEQUALS: return x != y;
+        case OP_LESS: return x < y;
+        case OP_LESSEQUALS: return x <= y;
+        case OP_GREATER: return x > y;
+        case OP_GREATEREQUALS: return x >= y;
+    }
+
+    return 0;
+}
+
+/*
+    The operator with its operands swapped round.
+ */
+static int swapop(int op)
+{
+    switch (op)
+    {
+        case OP_LESS: return OP_GREATER;
+        case OP_LESSEQUALS: return OP_GREATEREQUALS;
+        case OP_GREATER: return OP_LESS;
+        case OP_GREATEREQUALS: return OP_LESSEQUALS;
+    }
+
+    return op;
+}
+
+/*
+    The string value of a node. For an element, this is all the text
+    in its subtree. It is only copied if the element has children.
+ */
+static int stringvalue(MACHINE *vm, const ITEM *item, const char **str, int *len)
+{
+    XMLNODE *node = item->node;
+    char *buff;
+
+    switch (item->type)
+    {
+        case ITEM_ATTRIBUTE:
+            *str = item->attr->value;
+            *len = item->attr->valuelen;
+            return 0;
+        case ITEM_DOCUMENT:
+            node = vm->doc->root;
+            break;
+    }
+    if (!node || (item->type != ITEM_TEXT && node->child))
+    {
+        if (!node)
+        {
+            *str = "";
+            *len = 0;
+            return 0;
+        }
+        *len = textlength_r(node);
+        buff = arena_alloc(vm, *len + 1);
+        if (!buff)
+            return -1;
+        copytext_r(node, buff);
+        *str = buff;
+        return 0;
+    }
+    *str = node->data ? node->data : "";
+    *len = node->datalen;
+
+    return 0;
+}
+
+static int textlength_r(XMLNODE *node)
+{
+    XMLNODE *child;
+    int answer = node->datalen;
+
+    for (child = node->child; child; child = child->next)
+        answer += textlength_r(child);
+
+    return answer;
+}
+
+/*
+    Copy the text of a subtree, with each child's text put in at its
+    position in the parent's data, as xml_getnesteddata() does.
+ */
+static int copytext_r(XMLNODE *node, char *out)
+{
+    XMLNODE *child;
+    int N = 0;
+    int i = 0;
+    int end;
+
+    for (child = node->child; child; child = child->next)
+    {
+        end = child->position < node->datalen ? child->position : node->datalen;
+        if (end > i)
+        {
+            memcpy(out + N, node->data + i, end - i);
+            N += end - i;
+            i = end;
+        }
+        N += copytext_r(child, out + N);
+    }
+    if (i < node->datalen)
+    {
+        memcpy(out + N, node->data + i, node->datalen - i);
+        N += node->datalen - i;
+    }
+
+    return N;
+}
+
+static double tonumber(MACHINE *vm, const VALUE *v)
+{
+    ARENAMARK mark;
+    const char *str;
+    int len;
+    double answer;
+
+    switch (v->type)
+    {
+        case VALUE_NUMBER:
+        case VALUE_BOOLEAN:
+            return v->number;
+        case VALUE_STRING:
+            return xpathvm_number(v->str, v->len);
+        case VALUE_NODESET:
+            if (v->N == 0)
+                return NAN;
+            mark = arena_mark(vm);
+            if (stringvalue(vm, &vm->items[v->start], &str, &len))
+                return NAN;
+            answer = xpathvm_number(str, len);
+            arena_reset(vm, mark);
+            return answer;
+    }
+
+    return NAN;
+}
+
+static int toboolean(const VALUE *v)
+{
+    switch (v->type)
+    {
+        case VALUE_NODESET:
+            return v->N > 0;
+        case VALUE_NUMBER:
+            return v->number != 0 && !isnan(v->number);
+        case VALUE_STRING:
+            return v->len > 0;
+        case VALUE_BOOLEAN:
+            return v->number != 0;
+    }
+
+    return 0;
+}
+
+static int tostring(MACHINE *vm, const VALUE *v, const char **str, int *len)
+{
+    char *buff;
+
+    switch (v->type)
+    {
+        case VALUE_NODESET:
+            if (v->N == 0)
+            {
+                *str = "";
+                *len = 0;
+                return 0;
+            }
+            return stringvalue(vm, &vm->items[v->start], str, len);
+        case VALUE_NUMBER:
+            buff = arena_alloc(vm, 400);
+            if (!buff)
+                return -1;
+            *len = formatnumber(v->number, buff);
+            *str = buff;
+            return 0;
+        case VALUE_BOOLEAN:
+            *str = v->number != 0 ? "true" : "false";
+            *len = (int) strlen(*str);
+            return 0;
+        default:
+            *str = v->str;
+            *len = v->len;
+            return 0;
+    }
+}
+
+static int requirenodeset(MACHINE *vm, const VALUE *v)
+{
+    if (v->type == VALUE_NODESET)
+        return 0;
+    vm->err = VM_TYPEERROR;
+    return -1;
+}
+
+static void setnumber(VALUE *v, double x)
+{
+    v->type = VALUE_NUMBER;
+    v->number = x;
+}
+
+static void setboolean(VALUE *v, int truth)
+{
+    v->type = VALUE_BOOLEAN;
+    v->number = truth ? 1 : 0;
+}
+
+static void setstring(VALUE *v, const char *str, int len)
+{
+    v->type = VALUE_STRING;
+    v->str = str;
+    v->len = len;
+}
+
+/*
+    XPath round(): halves go up, and -0.5 to -0 rounds to -0.
+ */
+static double xround(double x)
+{
+    if (isnan(x) || isinf(x))
+        return x;
+    if (x < 0 && x >= -0.5)
+        return -0.0;
+    return floor(x + 0.5);
+}
+
+/*
+    Format a number as XPath string() does: no exponent, no trailing
+    zeros, and the fewest digits which read back as the same number.
+
+    Params: x - the number
+            out - buffer of at least 400 bytes
+    Returns: the length.
+
+    Notes: printf() gives the digits, in whatever locale is set, and
+    the decimal point is placed here by hand.
+ */
+static int formatnumber(double x, char *out)
+{
+    char buff[64];
+    char digits[32];
+    int Ndigits = 0;
+    int exponent;
+    int precision;
+    int N = 0;
+    int i;
+    char *e;
+
+    if (isnan(x))
+        return sprintf(out, "NaN");
+    if (isinf(x))
+        return sprintf(out, x > 0 ? "Infinity" : "-Infinity");
+    if (x == 0)
+        return sprintf(out, "0");
+    if (x == floor(x) && fabs(x) < 1e15)
+        return sprintf(out, "%.0f", x);
+
+    for (precision = 1; precision <= 17; precision++)
+    {
+        snprintf(buff, 64, "%.*e", precision - 1, x);
+        if (strtod(buff, 0) == x)
+            break;
+    }
+    for (i = 0; buff[i] && buff[i] != 'e'; i++)
+    {
+        if (isdigit((unsigned char) buff[i]))
+            digits[Ndigits++] = buff[i];
+    }
+    e = strchr(buff, 'e');
+    exponent = e ? atoi(e + 1) : 0;
+    while (Ndigits > 1 && digits[Ndigits-1] == '0')
+        Ndigits--;
+
+    if (x < 0)
+        out[N++] = '-';
+    if (exponent < 0)
+    {
+        out[N++] = '0';
+        out[N++] = '.';
+        for (i = 0; i < -exponent - 1; i++)
+            out[N++] = '0';
+        for (i = 0; i < Ndigits; i++)
+            out[N++] = digits[i];
+    }
+    else
+    {
+        for (i = 0; i <= exponent; i++)
+            out[N++] = i < Ndigits ? digits[i] : '0';
+        if (Ndigits > exponent + 1)
+        {
+            out[N++] = '.';
+            for (i = exponent + 1; i < Ndigits; i++)
+                out[N++] = digits[i];
+        }
+    }
+    out[N] = 0;
+
+    return N;
+}
+
+/*
+    Convert digits with an optional sign and decimal point. Numbers of
+    up to 15 significant digits and small exponents are exact in
+    doubles, so they are worked out directly, and the rest go through
+    strtod(), with the decimal point the locale expects.
+ */
+static double convertnumber(const char *str, int len)
+{
+    static const double powers[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+        1e21, 1e22
+    };
+    char buff[128];
+    char *copy = buff;
+    const char *point;
+    unsigned long long mantissa = 0;
+    int Ndigits = 0;
+    int exponent = 0;
+    int seenpoint = 0;
+    int negative = 0;
+    double answer;
+    int i;
+
+    i = 0;
+    if (str[i] == '-')
+    {
+        negative = 1;
+        i++;
+    }
+    for (; i < len; i++)
+    {
+        if (str[i] == '.')
+        {
+            seenpoint = 1;
+            continue;
+        }
+        if (mantissa == 0 && str[i] == '0')
+        {
+            if (seenpoint)
+                exponent--;
+            continue;
+        }
+        if (Ndigits < 19)
+        {
+            mantissa = mantissa * 10 + (str[i] - '0');
+            if (seenpoint)
+                exponent--;
+        }
+        else if (!seenpoint)
+            exponent++;
+        Ndigits++;
+    }
+    if (Ndigits <= 15 && exponent >= -22 && exponent <= 22)
+    {
+        answer = (double) mantissa;
+        answer = exponent < 0 ? answer / powers[-exponent] : answer * powers[exponent];
+        return negative ? -answer : answer;
+    }
+
+    if (len + 8 > 128)
+    {
+        copy = malloc(len + 8);
+        if (!copy)
+            return NAN;
+    }
+    point = localeconv()->decimal_point;
+    for (i = 0; i < len && str[i] != '.'; i++)
+        copy[i] = str[i];
+    if (i < len)
+    {
+        strcpy(copy + i, point);
+        strncat(copy, str + i + 1, len - i - 1);
+    }
+    else
+        copy[i] = 0;
+    answer = strtod(copy, 0);
+    if (copy != buff)
+        free(copy);
+
+    return answer;
+}
+
+/*
+    Find a string in another.
+
+    Returns: the offset of the first match, -1 if there is none.
+
+    Notes: with SSE2, sixteen places at a time are tested for both the
+    first and the last byte of the string, and only places which pass
+    are compared in full. That throws out almost every false start,
+    where memchr() alone stops at every occurrence of the first byte.
+ */
+static int findstring(const char *str, int len, const char *sub, int sublen)
+{
+    const char *ptr = str;
+    const char *end = str + len - sublen;
+
+    if (sublen == 0)
+        return 0;
+#if defined(__SSE2__)
+    if (sublen > 1)
+    {
+        __m128i firstbyte = _mm_set1_epi8(sub[0]);
+        __m128i lastbyte = _mm_set1_epi8(sub[sublen-1]);
+        __m128i block1, block2;
+        unsigned int mask;
+        int bit;
+
+        while (ptr + 16 <= end + 1)
+        {
+            block1 = _mm_loadu_si128((const __m128i *) ptr);
+            block2 = _mm_loadu_si128((const __m128i *) (ptr + sublen - 1));
+            mask = (unsigned int) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block1, firstbyte),
+                                                                  _mm_cmpeq_epi8(block2, lastbyte)));
+            while (mask)
+            {
+                bit = __builtin_ctz(mask);
+                if (!memcmp(ptr + bit + 1, sub + 1, sublen - 2))
+                    return (int) (ptr + bit - str);
+                mask &= mask - 1;
+            }
+            ptr += 16;
+        }
+    }
+#endif
+    while (ptr <= end)
+    {
+        ptr = memchr(ptr, sub[0], end - ptr + 1);
+        if (!ptr)
+            break;
+        if (!memcmp(ptr, sub, sublen))
+            return (int) (ptr - str);
+        ptr++;
+    }
+
+    return -1;
+}
+
+static int utf8length(const char *str, int len)
+{
+    int answer = 0;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (((unsigned char) str[i] & 0xC0) != 0x80)
+            answer++;
+    }
+
+    return answer;
+}
+
+/*
+    Decode a UTF-8 character.
+
+    Returns: the number of bytes used. Bad bytes are taken one at a time.
+ */
+static int utf8decode(const char *str, int len, int *ch)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    int N, i;
+
+    if (s[0] < 0x80)
+        N = 1;
+    else if ((s[0] & 0xE0) == 0xC0)
+        N = 2;
+    else if ((s[0] & 0xF0) == 0xE0)
+        N = 3;
+    else if ((s[0] & 0xF8) == 0xF0)
+        N = 4;
+    else
+        N = 1;
+    if (N > len)
+        N = 1;
+    if (N == 1)
+    {
+        *ch = s[0];
+        return 1;
+    }
+    *ch = s[0] & (0x7F >> N);
+    for (i = 1; i < N; i++)
+    {
+        if ((s[i] & 0xC0) != 0x80)
+        {
+            *ch = s[0];
+            return 1;
+        }
+        *ch = (*ch << 6) | (s[i] & 0x3F);
+    }
+
+    return N;
+}
+
+static int utf8encode(int ch, char *out)
+{
+    if (ch < 0x80)
+    {
+        out[0] = (char) ch;
+        return 1;
+    }
+    if (ch < 0x800)
+    {
+        out[0] = (char) (0xC0 | (ch >> 6));
+        out[1] = (char) (0x80 | (ch & 0x3F));
+        return 2;
+    }
+    if (ch < 0x10000)
+    {
+        out[0] = (char) (0xE0 | (ch >> 12));
+        out[1] = (char) (0x80 | ((ch >> 6) & 0x3F));
+        out[2] = (char) (0x80 | (ch & 0x3F));
+        return 3;
+    }
+    out[0] = (char) (0xF0 | (ch >> 18));
+    out[1] = (char) (0x80 | ((ch >> 12) & 0x3F));
+    out[2] = (char) (0x80 | ((ch >> 6) & 0x3F));
+    out[3] = (char) (0x80 | (ch & 0x3F));
+    return 4;
+}
+
+/*
+    Get string space. Blocks are kept until the machine is freed, so
+    strings never move, and space is reused after arena_reset().
+ */
+static char *arena_alloc(MACHINE *vm, int size)
+{
+    ARENA *arena = &vm->arena;
+    char *answer;
+
+    size = (size + 7) & ~7;
+    while (arena->current < arena->Nblocks && arena->sizes[arena->current] - arena->used < size)
+    {
+        arena->current++;
+        arena->used = 0;
+    }
+    if (arena->current == arena->Nblocks)
+    {
+        int blocksize = size > ARENA_BLOCKSIZE ? size : ARENA_BLOCKSIZE;
+        char **blocks = realloc(arena->blocks, (arena->Nblocks + 1) * sizeof(char *));
+        int *sizes;
+
+        if (!blocks)
+            goto out_of_memory;
+        arena->blocks = blocks;
+        sizes = realloc(arena->sizes, (arena->Nblocks + 1) * sizeof(int));
+        if (!sizes)
+            goto out_of_memory;
+        arena->sizes = sizes;
+        arena->blocks[arena->Nblocks] = malloc(blocksize);
+        if (!arena->blocks[arena->Nblocks])
+            goto out_of_memory;
+        arena->sizes[arena->Nblocks++] = blocksize;
+        arena->used = 0;
+    }
+    answer = arena->blocks[arena->current] + arena->used;
+    arena->used += size;
+
+    return answer;
+
+out_of_memory:
+    vm->err = VM_OUTOFMEMORY;
+    return 0;
+}
+
+static ARENAMARK arena_mark(MACHINE *vm)
+{
+    ARENAMARK mark;
+
+    mark.current = vm->arena.current;
+    mark.used = vm->arena.used;
+
+    return mark;
+}
+
+static void arena_reset(MACHINE *vm, ARENAMARK mark)
+{
+    vm->arena.current = mark.current;
+    vm->arena.used = mark.used;
+}
+
+static void initlexer(LEXER *lex, const char *xpath)
+{
+    lex->input = xpath;
+    lex->pos = 0;
+    lex->tokenpos = 0;
+    lex->tokenend = 0;
+    lex->previous = NUL;
+    lex->error[0] = 0;
+    lex->token = readtoken(lex);
+}
+
+/*
+    Read the next token.
+
+    Notes: the standard's rules decide whether "*" is multiplication
+    and whether "and", "div" and so on are operators or names. A
+    name followed by "(" is a function or node type, and by "::" an
+    axis.
+ */
+static int readtoken(LEXER *lex)
+{
+    const char *s = lex->input;
+    int pos = lex->pos;
+    int end;
+    int token;
+    int ch;
+
+    while (isspace((unsigned char) s[pos]))
+        pos++;
+    lex->tokenpos = pos;
+    ch = (unsigned char) s[pos];
+    end = pos + 1;
+
+    if (ch == 0)
+    {
+        token = NUL;
+        end = pos;
+    }
+    else if (ch == '/')
+    {
+        token = SLASH;
+        if (s[pos+1] == '/')
+        {
+            token = SLASHSLASH;
+            end++;
+        }
+    }
+    else if (ch == '.' && s[pos+1] == '.')
+    {
+        token = DOTDOT;
+        end++;
+    }
+    else if (isdigit(ch) || (ch == '.' && isdigit((unsigned char) s[pos+1])))
+    {
+        token = NUMBER;
+        end = pos;
+        while (isdigit((unsigned char) s[end]))
+            end++;
+        if (s[end] == '.')
+        {
+            end++;
+            while (isdigit((unsigned char) s[end]))
+                end++;
+        }
+    }
+    else if (ch == '.')
+        token = DOT;
+    else if (ch == '"' || ch == '\'')
+    {
+        while (s[end] && s[end] != ch)
+            end++;
+        if (!s[end])
+        {
+            writeerror(lex, "Unterminated string");
+            token = NUL;
+            end = pos;
+        }
+        else
+        {
+            end++;
+            token = LITERAL;
+        }
+    }
+    else if (ch == ':' && s[pos+1] == ':')
+    {
+        token = COLONCOLON;
+        end++;
+    }
+    else if (ch == '!' && s[pos+1] == '=')
+    {
+        token = NOTEQUALS;
+        end++;
+    }
+    else if (ch == '<' || ch == '>')
+    {
+        token = ch == '<' ? LESS : GREATER;
+        if (s[pos+1] == '=')
+        {
+            token = ch == '<' ? LESSEQUALS : GREATEREQUALS;
+            end++;
+        }
+    }
+    else if (ch == '*')
+        token = operatorcontext(lex) ? MULTIPLY : ASTERISK;
+    else if (isnamestart(ch))
+    {
+        end = pos;
+        while (isnamechar((unsigned char) s[end]))
+            end++;
+        if (s[end] == ':' && s[end+1] == '*')
+            end += 2;
+        else if (s[end] == ':' && isnamestart((unsigned char) s[end+1]))
+        {
+            end++;
+            while (isnamechar((unsigned char) s[end]))
+                end++;
+        }
+        if (operatorcontext(lex))
+        {
+            if (end - pos == 3 && !strncmp(s + pos, "and", 3))
+                token = AND;
+            else if (end - pos == 2 && !strncmp(s + pos, "or", 2))
+                token = OR;
+            else if (end - pos == 3 && !strncmp(s + pos, "div", 3))
+                token = DIV;
+            else if (end - pos == 3 && !strncmp(s + pos, "mod", 3))
+                token = MOD;
+            else
+            {
+                writeerror(lex, "Expected operator, found[%.*s]", end - pos, s + pos);
+                token = NUL;
+            }
+        }
+        else
+        {
+            int look = end;
+
+            while (isspace((unsigned char) s[look]))
+                look++;
+            if (s[look] == '(')
+            {
+                if ((end - pos == 4 && !strncmp(s + pos, "node", 4)) ||
+                    (end - pos == 4 && !strncmp(s + pos, "text", 4)) ||
+                    (end - pos == 7 && !strncmp(s + pos, "comment", 7)) ||
+                    (end - pos == 22 && !strncmp(s + pos, "processing-instruction", 22)))
+                    token = NODETYPE;
+                else
+                    token = FUNCTIONNAME;
+            }
+            else if (s[look] == ':' && s[look+1] == ':')
+                token = AXISNAME;
+            else
+                token = NAME;
+        }
+    }
+    else
+    {
+        switch (ch)
+        {
+            case '@': token = STRUDEL; break;
+            case ',': token = COMMA; break;
+            case '(': token = OPENPAREN; break;
+            case ')': token = CLOSEPAREN; break;
+            case '[': token = OPENSQUARE; break;
+            case ']': token = CLOSESQUARE; break;
+            case '|': token = PIPE; break;
+            case '+': token = PLUS; break;
+            case '-': token = MINUS; break;
+            case '=': token = EQUALS; break;
+            case '$': token = DOLLAR; break;
+            default:
+                writeerror(lex, "Unrecognised character[%c]", isgraph(ch) ? ch : '?');
+                token = NUL;
+                end = pos;
+                break;
+        }
+    }
+    lex->tokenend = end;
+    lex->pos = end;
+
+    return token;
+}
+
+static void advance(LEXER *lex)
+{
+    lex->previous = lex->token;
+    lex->token = readtoken(lex);
+}
+
+static int match(LEXER *lex, int token)
+{
+    if (lex->token == token)
+    {
+        advance(lex);
+        return 1;
+    }
+    if (lex->token == NUL)
+        writeerror(lex, "Unexpected end of xpath");
+    else
+        writeerror(lex, "Unexpected symbol[%.*s]", lex->tokenend - lex->tokenpos, lex->input + lex->tokenpos);
+
+    return 0;
+}
+
+/*
+    After these tokens, "*" is a name test and a name is a name. After
+    anything else they must be operators.
+ */
+static int operatorcontext(LEXER *lex)
+{
+    switch (lex->previous)
+    {
+        case NUL:
+        case STRUDEL:
+        case COLONCOLON:
+        case OPENPAREN:
+        case OPENSQUARE:
+        case COMMA:
+        case SLASH:
+        case SLASHSLASH:
+        case PIPE:
+        case PLUS:
+        case MINUS:
+        case EQUALS:
+        case NOTEQUALS:
+        case LESS:
+        case LESSEQUALS:
+        case GREATER:
+        case GREATEREQUALS:
+        case MULTIPLY:
+        case AND:
+        case OR:
+        case DIV:
+        case MOD:
+        case DOLLAR:
+            return 0;
+    }
+
+    return 1;
+}
+
+static int isnamestart(int ch)
+{
+    return isalpha(ch) || ch == '_' || ch >= 0x80;
+}
+
+static int isnamechar(int ch)
+{
+    return isalnum(ch) || ch == '_' || ch == '-' || ch == '.' || ch >= 0x80;
+}
+
+static int haserror(LEXER *lex)
+{
+    return lex->error[0] ? 1 : 0;
+}
+
+static void writeerror(LEXER *lex, const char *fmt, ...)
+{
+    va_list valist;
+
+    va_start(valist, fmt);
+    if (lex->error[0] == 0)
+        vsnprintf(lex->error, sizeof(lex->error), fmt, valist);
+    va_end(valist);
+}
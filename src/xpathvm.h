@@ -0,0 +1,35 @@
+//
+//  xpathvm.h
+//  babyxrc
+//
+//  Full XPath 1.0 expressions, compiled to bytecode and run on a
+//  register machine. Used by xpath.c for anything beyond the simple
+//  location paths its own engine handles.
+//
+
+#ifndef xpathvm_h
+#define xpathvm_h
+
+#include "xmlparser2.h"
+
+typedef struct xpathprogram XPATHPROGRAM;
+
+/* with XPATH_STATS defined, both engines count the nodes they test */
+#ifdef XPATH_STATS
+extern unsigned long xml_xpath_nodesvisited;
+#define COUNTVISIT() (xml_xpath_nodesvisited++)
+#else
+#define COUNTVISIT()
+#endif
+
+XPATHPROGRAM *xpathvm_compile(const char *xpath, char *errormessage, int Nerr);
+int xpathvm_selectsattributes(const XPATHPROGRAM *prog);
+XMLNODE **xpathvm_selectnodes(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, int *Nselected);
+XMLATTRIBUTE **xpathvm_selectattributes(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, int *Nselected);
+int xpathvm_evalnumber(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, double *result);
+int xpathvm_evalboolean(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context, int *result);
+char *xpathvm_evalstring(const XPATHPROGRAM *prog, XMLDOC *doc, XMLNODE *context);
+double xpathvm_number(const char *str, int len);
+void killxpathprogram(XPATHPROGRAM *prog);
+
+#endif /* xpathvm_h */